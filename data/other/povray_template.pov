@@ -1,3 +1,4 @@
+{{#header}}
 // Generated from goxel {{version}}
 // https://github.com/guillaumechereau/goxel
 
@@ -14,12 +15,9 @@ camera {
 }
 {{/camera}}
 
-#declare Voxel = box {<-0.5, -0.5, -0.5>, <0.5, 0.5, 0.5>}
-#macro Vox(Pos, Color)
-    object {
-        Voxel
-        translate Pos
-        translate <0.5, 0.5, 0.5>
+#macro Vox(Pos, Size, Color)
+    box {
+        Pos, Pos + Size
         texture { pigment {color rgb Color / 255} }
     }
 #end
@@ -34,7 +32,7 @@ light_source {
 {{/light}}
 
 union {
-{{#voxels}}
-    Vox({{pos}}, {{color}})
-{{/voxels}}
+{{/header}}
+{{#footer}}
 }
+{{/footer}}
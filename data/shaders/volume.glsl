@@ -0,0 +1,254 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ray marching of a mesh stored into a texture atlas.
+ *
+ * The mesh is rendered as its bounding box.  For each fragment we walk the
+ * blocks along the view ray, using the alpha channel of the blocks table as
+ * an occupancy grid, and only march the voxels of non empty blocks.
+ *
+ * All the computations are done in the 'grid' space: voxel units, with the
+ * origin at the first block of the table.
+ */
+
+uniform highp mat4  u_view;
+uniform highp mat4  u_proj;
+uniform highp vec3  u_camera;       // Camera position.
+uniform highp vec3  u_ortho_dir;    // View direction if ortho, else zero.
+uniform highp vec3  u_box_pos;      // Position of the first block.
+uniform highp vec3  u_table_size;   // Size of the blocks table (in blocks).
+uniform highp float u_atlas_size;   // Size of the atlas texture (pixels).
+uniform mediump sampler2D u_table_tex;
+uniform mediump sampler2D u_atlas_tex;
+
+// Light parameters
+uniform lowp    vec3  u_l_dir;
+uniform lowp    float u_l_int;
+uniform lowp    float u_l_amb; // Ambient light coef.
+
+// Material parameters
+uniform lowp float u_m_metallic;
+uniform lowp float u_m_roughness;
+uniform lowp vec4  u_m_base_color;
+uniform lowp vec3  u_m_emissive_factor;
+
+varying highp vec3 v_pos;
+
+#ifdef VERTEX_SHADER
+
+/************************************************************************/
+attribute highp vec3 a_pos;
+
+void main()
+{
+    v_pos = u_box_pos + a_pos * u_table_size * 16.0;
+    gl_Position = u_proj * u_view * vec4(v_pos, 1.0);
+}
+/************************************************************************/
+
+#endif
+
+#ifdef FRAGMENT_SHADER
+
+#ifdef GL_ES
+precision highp float;
+#endif
+
+// Must be large enough to cross the biggest blocks table.
+#define MAX_BLOCK_STEPS 256
+#define MAX_VOXEL_STEPS 48
+
+const mediump float M_PI = 3.141592653589793;
+
+/************************************************************************/
+
+// Same lighting model as in mesh.glsl.
+mediump vec3 F_Schlick(mediump vec3 f0, mediump float LdotH)
+{
+    mediump float fresnel = exp2((-5.55473 * LdotH - 6.98316) * LdotH);
+    return (1.0 - f0) * fresnel + f0;
+}
+
+mediump float V_GGX(mediump float NdotL, mediump float NdotV,
+                    mediump float alpha)
+{
+    mediump float a = alpha;
+    mediump float GGXV = NdotL * (NdotV * (1.0 - a) + a);
+    mediump float GGXL = NdotV * (NdotL * (1.0 - a) + a);
+    return 0.5 / (GGXV + GGXL);
+}
+
+mediump float D_GGX(mediump float NdotH, mediump float alpha)
+{
+    mediump float a2 = alpha * alpha;
+    mediump float f = (NdotH * a2 - NdotH) * NdotH + 1.0;
+    return a2 / (M_PI * f * f);
+}
+
+mediump vec3 compute_light(mediump vec3 L,
+                           mediump float light_intensity,
+                           mediump float light_ambient,
+                           mediump vec3 base_color,
+                           mediump float metallic,
+                           mediump float roughness,
+                           mediump vec3 N, mediump vec3 V)
+{
+    mediump vec3 H = normalize(L + V);
+    mediump float NdotL = clamp(dot(N, L), 0.0, 1.0);
+    mediump float NdotV = clamp(dot(N, V), 0.0, 1.0);
+    mediump float NdotH = clamp(dot(N, H), 0.0, 1.0);
+    mediump float LdotH = clamp(dot(L, H), 0.0, 1.0);
+    mediump float a_roughness = roughness * roughness;
+    mediump vec3 f0 = vec3(0.04);
+    mediump vec3 diffuse_color = base_color * (vec3(1.0) - f0) * (1.0 - metallic);
+    mediump vec3 specular_color = mix(f0, base_color, metallic);
+    mediump vec3  F   = F_Schlick(specular_color, LdotH);
+    mediump float Vis = V_GGX(NdotL, NdotV, a_roughness);
+    mediump float D   = D_GGX(NdotH, a_roughness);
+    mediump vec3 diffuseContrib = (1.0 - F) * (diffuse_color / M_PI);
+    mediump vec3 specContrib = F * (Vis * D);
+    mediump vec3 shade = NdotL * (diffuseContrib + specContrib);
+    shade = max(shade, vec3(0.0));
+    return light_intensity * shade + light_ambient * base_color;
+}
+
+// Return the blocks table entry of a given block.
+// rg: tile position in the atlas, a: 1 if the block is not empty.
+highp vec4 get_block(highp vec3 b)
+{
+    highp vec2 uv = vec2(b.x + b.z * u_table_size.x + 0.5, b.y + 0.5);
+    uv /= vec2(u_table_size.x * u_table_size.z, u_table_size.y);
+    return texture2D(u_table_tex, uv);
+}
+
+// Return a voxel value from a block tile.  The tiles use the same layout
+// as the block data: the voxel (x, y, z) is at index x + y * 16 + z * 256.
+lowp vec4 get_voxel(highp vec2 tile, highp vec3 p)
+{
+    highp float i = p.x + p.y * 16.0 + p.z * 256.0;
+    highp vec2 uv = tile * 64.0 + vec2(mod(i, 64.0), floor(i / 64.0)) + 0.5;
+    return texture2D(u_atlas_tex, uv / u_atlas_size);
+}
+
+void main()
+{
+    highp vec3 rd, ro, inv, ta, tb, t_exit3, bmin, b, v, step, t_next, p;
+    highp vec3 n = vec3(0.0);
+    highp vec3 grid_size = u_table_size * 16.0;
+    highp vec2 tile;
+    highp float t, t_min, t_max, t_exit;
+    highp vec4 entry;
+    lowp vec4 voxel = vec4(0.0);
+    bool hit = false;
+
+    if (dot(u_ortho_dir, u_ortho_dir) > 0.0)
+        rd = normalize(u_ortho_dir);
+    else
+        rd = normalize(v_pos - u_camera);
+    // Avoid divisions by zero.
+    rd += vec3(equal(rd, vec3(0.0))) * 0.000001;
+    ro = v_pos - rd * dot(v_pos - u_camera, rd) - u_box_pos;
+    inv = 1.0 / rd;
+    step = sign(rd);
+
+    // Intersection with the grid box.
+    ta = (vec3(0.0) - ro) * inv;
+    tb = (grid_size - ro) * inv;
+    t_min = max(max(min(ta.x, tb.x), min(ta.y, tb.y)), min(ta.z, tb.z));
+    t_max = min(min(max(ta.x, tb.x), max(ta.y, tb.y)), max(ta.z, tb.z));
+    t = max(t_min, 0.0);
+    if (t_min > 0.0) {
+        ta = min(ta, tb);
+        if (ta.x >= ta.y && ta.x >= ta.z) n = vec3(-step.x, 0.0, 0.0);
+        else if (ta.y >= ta.z) n = vec3(0.0, -step.y, 0.0);
+        else n = vec3(0.0, 0.0, -step.z);
+    }
+
+    // Walk the blocks.
+    for (int i = 0; i < MAX_BLOCK_STEPS; i++) {
+        if (hit || t >= t_max) break;
+        p = ro + rd * (t + 0.001);
+        b = clamp(floor(p / 16.0), vec3(0.0), u_table_size - 1.0);
+        bmin = b * 16.0;
+        t_exit3 = (bmin + max(step, 0.0) * 16.0 - ro) * inv;
+        t_exit = min(min(t_exit3.x, t_exit3.y), t_exit3.z);
+        entry = get_block(b);
+
+        if (entry.a > 0.5) {
+            // Walk the voxels of the block.
+            tile = floor(entry.rg * 255.0 + 0.5);
+            v = clamp(floor(p), bmin, bmin + 15.0);
+            t_next = (v + max(step, 0.0) - ro) * inv;
+            for (int j = 0; j < MAX_VOXEL_STEPS; j++) {
+                voxel = get_voxel(tile, v - bmin);
+                if (voxel.a >= 0.5) {
+                    hit = true;
+                    break;
+                }
+                if (t_next.x < t_next.y && t_next.x < t_next.z) {
+                    v.x += step.x;
+                    t = t_next.x;
+                    t_next.x += abs(inv.x);
+                    n = vec3(-step.x, 0.0, 0.0);
+                } else if (t_next.y < t_next.z) {
+                    v.y += step.y;
+                    t = t_next.y;
+                    t_next.y += abs(inv.y);
+                    n = vec3(0.0, -step.y, 0.0);
+                } else {
+                    v.z += step.z;
+                    t = t_next.z;
+                    t_next.z += abs(inv.z);
+                    n = vec3(0.0, 0.0, -step.z);
+                }
+                if (any(lessThan(v, bmin)) || any(greaterThan(v, bmin + 15.0)))
+                    break;
+            }
+            if (hit) break;
+        }
+
+        // Next block.
+        if (t_exit3.x <= t_exit3.y && t_exit3.x <= t_exit3.z)
+            n = vec3(-step.x, 0.0, 0.0);
+        else if (t_exit3.y <= t_exit3.z)
+            n = vec3(0.0, -step.y, 0.0);
+        else
+            n = vec3(0.0, 0.0, -step.z);
+        t = t_exit;
+    }
+
+    if (!hit) discard;
+
+    p = ro + rd * t + u_box_pos;
+    mediump vec4 base_color = u_m_base_color * voxel * voxel; // srgb->linear
+    mediump vec3 color = compute_light(normalize(u_l_dir), u_l_int, u_l_amb,
+                                       base_color.rgb,
+                                       u_m_metallic, u_m_roughness, n,
+                                       normalize(u_camera - p));
+    color += u_m_emissive_factor;
+    gl_FragColor = vec4(sqrt(color), 1.0);
+
+#ifndef GL_ES
+    highp vec4 clip = u_proj * u_view * vec4(p, 1.0);
+    gl_FragDepth = 0.5 * clip.z / clip.w + 0.5;
+#endif
+}
+/************************************************************************/
+
+#endif
@@ -187,6 +187,8 @@ int action_execv(const action_t *action, const char *sig, va_list ap)
     }
 
     reentry--;
+    if (reentry == 0 && (action->flags & ACTION_TOUCH_IMAGE))
+        journal_record(goxel.image, action->id);
     lua_close(l);
     return 0;
 }
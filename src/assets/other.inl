@@ -18,7 +18,8 @@
 
 /* This file is autogenerated by tools/create_assets.py */
 
-{.path = "data/other/povray_template.pov", .size = 748, .data =
+{.path = "data/other/povray_template.pov", .size = 642, .data =
+    "{{#header}}\n"
     "// Generated from goxel {{version}}\n"
     "// https://github.com/guillaumechereau/goxel\n"
     "\n"
@@ -35,12 +36,9 @@
     "}\n"
     "{{/camera}}\n"
     "\n"
-    "#declare Voxel = box {<-0.5, -0.5, -0.5>, <0.5, 0.5, 0.5>}\n"
-    "#macro Vox(Pos, Color)\n"
-    "    object {\n"
-    "        Voxel\n"
-    "        translate Pos\n"
-    "        translate <0.5, 0.5, 0.5>\n"
+    "#macro Vox(Pos, Size, Color)\n"
+    "    box {\n"
+    "        Pos, Pos + Size\n"
     "        texture { pigment {color rgb Color / 255} }\n"
     "    }\n"
     "#end\n"
@@ -55,10 +53,10 @@
     "{{/light}}\n"
     "\n"
     "union {\n"
-    "{{#voxels}}\n"
-    "    Vox({{pos}}, {{color}})\n"
-    "{{/voxels}}\n"
+    "{{/header}}\n"
+    "{{#footer}}\n"
     "}\n"
+    "{{/footer}}\n"
     ""
 },
 {.path = "data/other/script_header.lua", .size = 1309, .data =
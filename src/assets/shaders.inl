@@ -495,6 +495,263 @@
     "#endif\n"
     ""
 },
+{.path = "data/shaders/volume.glsl", .size = 9082, .data =
+    "/* Goxel 3D voxels editor\n"
+    " *\n"
+    " * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>\n"
+    " *\n"
+    " * Goxel is free software: you can redistribute it and/or modify it under the\n"
+    " * terms of the GNU General Public License as published by the Free Software\n"
+    " * Foundation, either version 3 of the License, or (at your option) any later\n"
+    " * version.\n"
+    "\n"
+    " * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY\n"
+    " * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS\n"
+    " * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more\n"
+    " * details.\n"
+    "\n"
+    " * You should have received a copy of the GNU General Public License along with\n"
+    " * goxel.  If not, see <http://www.gnu.org/licenses/>.\n"
+    " */\n"
+    "\n"
+    "/*\n"
+    " * Ray marching of a mesh stored into a texture atlas.\n"
+    " *\n"
+    " * The mesh is rendered as its bounding box.  For each fragment we walk the\n"
+    " * blocks along the view ray, using the alpha channel of the blocks table as\n"
+    " * an occupancy grid, and only march the voxels of non empty blocks.\n"
+    " *\n"
+    " * All the computations are done in the 'grid' space: voxel units, with the\n"
+    " * origin at the first block of the table.\n"
+    " */\n"
+    "\n"
+    "uniform highp mat4  u_view;\n"
+    "uniform highp mat4  u_proj;\n"
+    "uniform highp vec3  u_camera;       // Camera position.\n"
+    "uniform highp vec3  u_ortho_dir;    // View direction if ortho, else zero.\n"
+    "uniform highp vec3  u_box_pos;      // Position of the first block.\n"
+    "uniform highp vec3  u_table_size;   // Size of the blocks table (in blocks).\n"
+    "uniform highp float u_atlas_size;   // Size of the atlas texture (pixels).\n"
+    "uniform mediump sampler2D u_table_tex;\n"
+    "uniform mediump sampler2D u_atlas_tex;\n"
+    "\n"
+    "// Light parameters\n"
+    "uniform lowp    vec3  u_l_dir;\n"
+    "uniform lowp    float u_l_int;\n"
+    "uniform lowp    float u_l_amb; // Ambient light coef.\n"
+    "\n"
+    "// Material parameters\n"
+    "uniform lowp float u_m_metallic;\n"
+    "uniform lowp float u_m_roughness;\n"
+    "uniform lowp vec4  u_m_base_color;\n"
+    "uniform lowp vec3  u_m_emissive_factor;\n"
+    "\n"
+    "varying highp vec3 v_pos;\n"
+    "\n"
+    "#ifdef VERTEX_SHADER\n"
+    "\n"
+    "/************************************************************************/\n"
+    "attribute highp vec3 a_pos;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    v_pos = u_box_pos + a_pos * u_table_size * 16.0;\n"
+    "    gl_Position = u_proj * u_view * vec4(v_pos, 1.0);\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    "\n"
+    "#ifdef FRAGMENT_SHADER\n"
+    "\n"
+    "#ifdef GL_ES\n"
+    "precision highp float;\n"
+    "#endif\n"
+    "\n"
+    "// Must be large enough to cross the biggest blocks table.\n"
+    "#define MAX_BLOCK_STEPS 256\n"
+    "#define MAX_VOXEL_STEPS 48\n"
+    "\n"
+    "const mediump float M_PI = 3.141592653589793;\n"
+    "\n"
+    "/************************************************************************/\n"
+    "\n"
+    "// Same lighting model as in mesh.glsl.\n"
+    "mediump vec3 F_Schlick(mediump vec3 f0, mediump float LdotH)\n"
+    "{\n"
+    "    mediump float fresnel = exp2((-5.55473 * LdotH - 6.98316) * LdotH);\n"
+    "    return (1.0 - f0) * fresnel + f0;\n"
+    "}\n"
+    "\n"
+    "mediump float V_GGX(mediump float NdotL, mediump float NdotV,\n"
+    "                    mediump float alpha)\n"
+    "{\n"
+    "    mediump float a = alpha;\n"
+    "    mediump float GGXV = NdotL * (NdotV * (1.0 - a) + a);\n"
+    "    mediump float GGXL = NdotV * (NdotL * (1.0 - a) + a);\n"
+    "    return 0.5 / (GGXV + GGXL);\n"
+    "}\n"
+    "\n"
+    "mediump float D_GGX(mediump float NdotH, mediump float alpha)\n"
+    "{\n"
+    "    mediump float a2 = alpha * alpha;\n"
+    "    mediump float f = (NdotH * a2 - NdotH) * NdotH + 1.0;\n"
+    "    return a2 / (M_PI * f * f);\n"
+    "}\n"
+    "\n"
+    "mediump vec3 compute_light(mediump vec3 L,\n"
+    "                           mediump float light_intensity,\n"
+    "                           mediump float light_ambient,\n"
+    "                           mediump vec3 base_color,\n"
+    "                           mediump float metallic,\n"
+    "                           mediump float roughness,\n"
+    "                           mediump vec3 N, mediump vec3 V)\n"
+    "{\n"
+    "    mediump vec3 H = normalize(L + V);\n"
+    "    mediump float NdotL = clamp(dot(N, L), 0.0, 1.0);\n"
+    "    mediump float NdotV = clamp(dot(N, V), 0.0, 1.0);\n"
+    "    mediump float NdotH = clamp(dot(N, H), 0.0, 1.0);\n"
+    "    mediump float LdotH = clamp(dot(L, H), 0.0, 1.0);\n"
+    "    mediump float a_roughness = roughness * roughness;\n"
+    "    mediump vec3 f0 = vec3(0.04);\n"
+    "    mediump vec3 diffuse_color = base_color * (vec3(1.0) - f0) * (1.0 - metallic);\n"
+    "    mediump vec3 specular_color = mix(f0, base_color, metallic);\n"
+    "    mediump vec3  F   = F_Schlick(specular_color, LdotH);\n"
+    "    mediump float Vis = V_GGX(NdotL, NdotV, a_roughness);\n"
+    "    mediump float D   = D_GGX(NdotH, a_roughness);\n"
+    "    mediump vec3 diffuseContrib = (1.0 - F) * (diffuse_color / M_PI);\n"
+    "    mediump vec3 specContrib = F * (Vis * D);\n"
+    "    mediump vec3 shade = NdotL * (diffuseContrib + specContrib);\n"
+    "    shade = max(shade, vec3(0.0));\n"
+    "    return light_intensity * shade + light_ambient * base_color;\n"
+    "}\n"
+    "\n"
+    "// Return the blocks table entry of a given block.\n"
+    "// rg: tile position in the atlas, a: 1 if the block is not empty.\n"
+    "highp vec4 get_block(highp vec3 b)\n"
+    "{\n"
+    "    highp vec2 uv = vec2(b.x + b.z * u_table_size.x + 0.5, b.y + 0.5);\n"
+    "    uv /= vec2(u_table_size.x * u_table_size.z, u_table_size.y);\n"
+    "    return texture2D(u_table_tex, uv);\n"
+    "}\n"
+    "\n"
+    "// Return a voxel value from a block tile.  The tiles use the same layout\n"
+    "// as the block data: the voxel (x, y, z) is at index x + y * 16 + z * 256.\n"
+    "lowp vec4 get_voxel(highp vec2 tile, highp vec3 p)\n"
+    "{\n"
+    "    highp float i = p.x + p.y * 16.0 + p.z * 256.0;\n"
+    "    highp vec2 uv = tile * 64.0 + vec2(mod(i, 64.0), floor(i / 64.0)) + 0.5;\n"
+    "    return texture2D(u_atlas_tex, uv / u_atlas_size);\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    highp vec3 rd, ro, inv, ta, tb, t_exit3, bmin, b, v, step, t_next, p;\n"
+    "    highp vec3 n = vec3(0.0);\n"
+    "    highp vec3 grid_size = u_table_size * 16.0;\n"
+    "    highp vec2 tile;\n"
+    "    highp float t, t_min, t_max, t_exit;\n"
+    "    highp vec4 entry;\n"
+    "    lowp vec4 voxel = vec4(0.0);\n"
+    "    bool hit = false;\n"
+    "\n"
+    "    if (dot(u_ortho_dir, u_ortho_dir) > 0.0)\n"
+    "        rd = normalize(u_ortho_dir);\n"
+    "    else\n"
+    "        rd = normalize(v_pos - u_camera);\n"
+    "    // Avoid divisions by zero.\n"
+    "    rd += vec3(equal(rd, vec3(0.0))) * 0.000001;\n"
+    "    ro = v_pos - rd * dot(v_pos - u_camera, rd) - u_box_pos;\n"
+    "    inv = 1.0 / rd;\n"
+    "    step = sign(rd);\n"
+    "\n"
+    "    // Intersection with the grid box.\n"
+    "    ta = (vec3(0.0) - ro) * inv;\n"
+    "    tb = (grid_size - ro) * inv;\n"
+    "    t_min = max(max(min(ta.x, tb.x), min(ta.y, tb.y)), min(ta.z, tb.z));\n"
+    "    t_max = min(min(max(ta.x, tb.x), max(ta.y, tb.y)), max(ta.z, tb.z));\n"
+    "    t = max(t_min, 0.0);\n"
+    "    if (t_min > 0.0) {\n"
+    "        ta = min(ta, tb);\n"
+    "        if (ta.x >= ta.y && ta.x >= ta.z) n = vec3(-step.x, 0.0, 0.0);\n"
+    "        else if (ta.y >= ta.z) n = vec3(0.0, -step.y, 0.0);\n"
+    "        else n = vec3(0.0, 0.0, -step.z);\n"
+    "    }\n"
+    "\n"
+    "    // Walk the blocks.\n"
+    "    for (int i = 0; i < MAX_BLOCK_STEPS; i++) {\n"
+    "        if (hit || t >= t_max) break;\n"
+    "        p = ro + rd * (t + 0.001);\n"
+    "        b = clamp(floor(p / 16.0), vec3(0.0), u_table_size - 1.0);\n"
+    "        bmin = b * 16.0;\n"
+    "        t_exit3 = (bmin + max(step, 0.0) * 16.0 - ro) * inv;\n"
+    "        t_exit = min(min(t_exit3.x, t_exit3.y), t_exit3.z);\n"
+    "        entry = get_block(b);\n"
+    "\n"
+    "        if (entry.a > 0.5) {\n"
+    "            // Walk the voxels of the block.\n"
+    "            tile = floor(entry.rg * 255.0 + 0.5);\n"
+    "            v = clamp(floor(p), bmin, bmin + 15.0);\n"
+    "            t_next = (v + max(step, 0.0) - ro) * inv;\n"
+    "            for (int j = 0; j < MAX_VOXEL_STEPS; j++) {\n"
+    "                voxel = get_voxel(tile, v - bmin);\n"
+    "                if (voxel.a >= 0.5) {\n"
+    "                    hit = true;\n"
+    "                    break;\n"
+    "                }\n"
+    "                if (t_next.x < t_next.y && t_next.x < t_next.z) {\n"
+    "                    v.x += step.x;\n"
+    "                    t = t_next.x;\n"
+    "                    t_next.x += abs(inv.x);\n"
+    "                    n = vec3(-step.x, 0.0, 0.0);\n"
+    "                } else if (t_next.y < t_next.z) {\n"
+    "                    v.y += step.y;\n"
+    "                    t = t_next.y;\n"
+    "                    t_next.y += abs(inv.y);\n"
+    "                    n = vec3(0.0, -step.y, 0.0);\n"
+    "                } else {\n"
+    "                    v.z += step.z;\n"
+    "                    t = t_next.z;\n"
+    "                    t_next.z += abs(inv.z);\n"
+    "                    n = vec3(0.0, 0.0, -step.z);\n"
+    "                }\n"
+    "                if (any(lessThan(v, bmin)) || any(greaterThan(v, bmin + 15.0)))\n"
+    "                    break;\n"
+    "            }\n"
+    "            if (hit) break;\n"
+    "        }\n"
+    "\n"
+    "        // Next block.\n"
+    "        if (t_exit3.x <= t_exit3.y && t_exit3.x <= t_exit3.z)\n"
+    "            n = vec3(-step.x, 0.0, 0.0);\n"
+    "        else if (t_exit3.y <= t_exit3.z)\n"
+    "            n = vec3(0.0, -step.y, 0.0);\n"
+    "        else\n"
+    "            n = vec3(0.0, 0.0, -step.z);\n"
+    "        t = t_exit;\n"
+    "    }\n"
+    "\n"
+    "    if (!hit) discard;\n"
+    "\n"
+    "    p = ro + rd * t + u_box_pos;\n"
+    "    mediump vec4 base_color = u_m_base_color * voxel * voxel; // srgb->linear\n"
+    "    mediump vec3 color = compute_light(normalize(u_l_dir), u_l_int, u_l_amb,\n"
+    "                                       base_color.rgb,\n"
+    "                                       u_m_metallic, u_m_roughness, n,\n"
+    "                                       normalize(u_camera - p));\n"
+    "    color += u_m_emissive_factor;\n"
+    "    gl_FragColor = vec4(sqrt(color), 1.0);\n"
+    "\n"
+    "#ifndef GL_ES\n"
+    "    highp vec4 clip = u_proj * u_view * vec4(p, 1.0);\n"
+    "    gl_FragDepth = 0.5 * clip.z / clip.w + 0.5;\n"
+    "#endif\n"
+    "}\n"
+    "/************************************************************************/\n"
+    "\n"
+    "#endif\n"
+    ""
+},
 
 
 
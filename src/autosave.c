@@ -0,0 +1,134 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include <pthread.h>
+
+// Time without any change before we start an autosave (seconds).
+#define IDLE_DELAY 1.0
+
+static struct {
+    image_t         *img;           // Image we autosave.
+    uint32_t        key;            // Image key of the last autosave.
+    double          save_time;      // Time of the last autosave.
+    double          change_time;    // Time of the last change.
+    uint32_t        change_key;     // Image key at change_time.
+
+    // Running job.
+    bool            running;
+    pthread_t       thread;
+    image_t         *snap;          // Copy of the image we are saving.
+    char            *path;
+    float           progress;
+    volatile bool   done;
+} g_autosave = {};
+
+static void get_autosave_path(const image_t *img, char *out, int len)
+{
+    const char *dir;
+    if (img->path) {
+        snprintf(out, len, "%s.autosave", img->path);
+        return;
+    }
+    dir = sys_get_user_dir();
+    if (dir && *dir) snprintf(out, len, "%s/unsaved.autosave.gox", dir);
+    else *out = '\0';
+}
+
+static void *autosave_thread(void *arg)
+{
+    // gox_write never leaves a partially written file.
+    gox_write(g_autosave.snap, g_autosave.path, false, &g_autosave.progress);
+    g_autosave.done = true;
+    return NULL;
+}
+
+static void autosave_start(image_t *img, const char *path)
+{
+    g_autosave.snap = image_copy(img);
+    g_autosave.path = strdup(path);
+    g_autosave.progress = 0;
+    g_autosave.done = false;
+    g_autosave.running = true;
+    if (pthread_create(&g_autosave.thread, NULL, autosave_thread, NULL)) {
+        LOG_E("Cannot start autosave thread");
+        g_autosave.running = false;
+        image_delete(g_autosave.snap);
+        g_autosave.snap = NULL;
+        free(g_autosave.path);
+        g_autosave.path = NULL;
+    }
+}
+
+static void autosave_finish(void)
+{
+    pthread_join(g_autosave.thread, NULL);
+    // The copy has to be deleted from the main thread, since it shares
+    // its blocks with the image.
+    image_delete(g_autosave.snap);
+    g_autosave.snap = NULL;
+    free(g_autosave.path);
+    g_autosave.path = NULL;
+    g_autosave.running = false;
+}
+
+void autosave_iter(image_t *img)
+{
+    char path[1024];
+    uint32_t key;
+    double time = sys_get_time();
+
+    if (g_autosave.running) {
+        if (!g_autosave.done) return;
+        autosave_finish();
+    }
+
+    key = image_get_key(img);
+    if (img != g_autosave.img) {
+        // New image: consider the loaded state as already saved.
+        g_autosave.img = img;
+        g_autosave.key = key;
+        g_autosave.save_time = time;
+    }
+    if (key != g_autosave.change_key) {
+        g_autosave.change_key = key;
+        g_autosave.change_time = time;
+    }
+
+    if (goxel.autosave_interval <= 0) return;
+    if (key == g_autosave.key || key == img->saved_key) return;
+    if (time - g_autosave.save_time < goxel.autosave_interval) return;
+    if (time - g_autosave.change_time < IDLE_DELAY) return;
+
+    get_autosave_path(img, path, sizeof(path));
+    if (!*path) return;
+    g_autosave.key = key;
+    g_autosave.save_time = time;
+    autosave_start(img, path);
+}
+
+void autosave_release(void)
+{
+    if (g_autosave.running) autosave_finish();
+}
+
+float autosave_get_progress(void)
+{
+    return g_autosave.running ? g_autosave.progress : -1;
+}
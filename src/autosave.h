@@ -0,0 +1,66 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Background autosave.
+ *
+ * When the image has unsaved changes, we periodically write it into an
+ * autosave file next to the gox file (or in the user directory for unsaved
+ * images).  We only take a copy of the image in the main thread, which is
+ * fast since the meshes are copy on write, and all the encoding is done
+ * in a background thread.  The data is first written into a temporary file
+ * that is then renamed, so that the autosave file is always complete.
+ *
+ * The autosave file is a normal gox file, the user's file is never
+ * modified.
+ */
+
+#ifndef AUTOSAVE_H
+#define AUTOSAVE_H
+
+#include "image.h"
+
+/*
+ * Function: autosave_iter
+ * Should be called once per frame.
+ *
+ * Start a new autosave when the image changed since the last one, the
+ * interval set in goxel.autosave_interval elapsed, and the user has been
+ * idle for a short time.  Also release the data of the finished autosaves.
+ */
+void autosave_iter(image_t *img);
+
+/*
+ * Function: autosave_release
+ * Wait for the running autosave to finish, if any.
+ *
+ * Should be called when we quit the application, so that we don't leave
+ * a temporary file behind.
+ */
+void autosave_release(void);
+
+/*
+ * Function: autosave_get_progress
+ * Return the progress of the running autosave.
+ *
+ * Returns:
+ *   A value between 0 and 1, or -1 if no autosave is running.
+ */
+float autosave_get_progress(void);
+
+#endif // AUTOSAVE_H
@@ -20,6 +20,24 @@
 
 #include <zlib.h> // For crc32.
 
+static uint64_t g_version = 0; // Global cameras version counter.
+
+static void turntable(camera_t *camera, float rz, float rx)
+{
+    float center[3], mat[4][4] = MAT4_IDENTITY;
+
+    mat4_mul_vec3(camera->mat, VEC(0, 0, -camera->dist), center);
+    mat4_itranslate(mat, center[0], center[1], center[2]);
+    mat4_irotate(mat, rz, 0, 0, 1);
+    mat4_itranslate(mat, -center[0], -center[1], -center[2]);
+    mat4_imul(mat, camera->mat);
+    mat4_copy(mat, camera->mat);
+
+    mat4_itranslate(camera->mat, 0, 0, -camera->dist);
+    mat4_irotate(camera->mat, rx, 1, 0, 0);
+    mat4_itranslate(camera->mat, 0, 0, camera->dist);
+}
+
 camera_t *camera_new(const char *name)
 {
     camera_t *cam = calloc(1, sizeof(*cam));
@@ -29,7 +47,9 @@ camera_t *camera_new(const char *name)
     cam->dist = 128;
     cam->aspect = 1;
     mat4_itranslate(cam->mat, 0, 0, cam->dist);
-    camera_turntable(cam, M_PI / 4, M_PI / 4);
+    turntable(cam, M_PI / 4, M_PI / 4);
+    // Not camera_touch: the camera is not part of an image yet.
+    cam->version = ++g_version;
     return cam;
 }
 
@@ -51,6 +71,7 @@ void camera_set(camera_t *cam, const camera_t *other)
     cam->ortho = other->ortho;
     cam->dist = other->dist;
     mat4_copy(other->mat, cam->mat);
+    camera_touch(cam);
 }
 
 static void compute_clip(const float view_mat[4][4], float *near_, float *far_)
@@ -132,6 +153,7 @@ void camera_set_target(camera_t *cam, const float pos[3])
     mat4_invert(cam->mat, world_to_mat);
     mat4_mul_vec3(world_to_mat, pos, p);
     cam->dist = -p[2];
+    camera_touch(cam);
 }
 
 /*
@@ -144,6 +166,7 @@ void camera_fit_box(camera_t *cam, const float box[4][4])
     if (box_is_null(box)) {
         cam->dist = 128;
         cam->aspect = 1;
+        camera_touch(cam);
         return;
     }
     box_get_size(box, size);
@@ -152,6 +175,7 @@ void camera_fit_box(camera_t *cam, const float box[4][4])
     mat4_mul_vec3(box, VEC(0, 0, 0), cam->mat[3]);
     mat4_itranslate(cam->mat, 0, 0, dist);
     cam->dist = dist;
+    camera_touch(cam);
 }
 
 /*
@@ -160,26 +184,17 @@ void camera_fit_box(camera_t *cam, const float box[4][4])
  */
 uint32_t camera_get_key(const camera_t *cam)
 {
-    uint32_t key = 0;
-    key = crc32(key, (void*)&cam->name, sizeof(cam->name));
-    key = crc32(key, (void*)&cam->ortho, sizeof(cam->ortho));
-    key = crc32(key, (void*)&cam->dist, sizeof(cam->dist));
-    key = crc32(key, (void*)&cam->mat, sizeof(cam->mat));
-    return key;
+    return crc32(0, (void*)&cam->version, sizeof(cam->version));
 }
 
-void camera_turntable(camera_t *camera, float rz, float rx)
+void camera_touch(camera_t *cam)
 {
-    float center[3], mat[4][4] = MAT4_IDENTITY;
-
-    mat4_mul_vec3(camera->mat, VEC(0, 0, -camera->dist), center);
-    mat4_itranslate(mat, center[0], center[1], center[2]);
-    mat4_irotate(mat, rz, 0, 0, 1);
-    mat4_itranslate(mat, -center[0], -center[1], -center[2]);
-    mat4_imul(mat, camera->mat);
-    mat4_copy(mat, camera->mat);
+    cam->version = ++g_version;
+    if (goxel.image) image_touch(goxel.image);
+}
 
-    mat4_itranslate(camera->mat, 0, 0, -camera->dist);
-    mat4_irotate(camera->mat, rx, 1, 0, 0);
-    mat4_itranslate(camera->mat, 0, 0, camera->dist);
+void camera_turntable(camera_t *camera, float rz, float rx)
+{
+    turntable(camera, rz, rx);
+    camera_touch(camera);
 }
@@ -51,6 +51,7 @@ struct camera
     float  fovy;
     float  aspect;
     float  mat[4][4];
+    uint64_t version; // Changed by camera_touch.
 
     // Auto computed from other values:
     float view_mat[4][4];    // Model to view transformation.
@@ -121,6 +122,15 @@ void camera_fit_box(camera_t *camera, const float box[4][4]);
  */
 uint32_t camera_get_key(const camera_t *camera);
 
+/*
+ * Function: camera_touch
+ * Give a new version to a camera, and to the current image.
+ *
+ * Must be called after changing the camera name, ortho, dist or mat
+ * attributes.  The camera functions already do it.
+ */
+void camera_touch(camera_t *camera);
+
 void camera_turntable(camera_t *camera, float rz, float rx);
 
 #endif // CAMERA_H
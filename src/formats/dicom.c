@@ -313,9 +313,10 @@ static void dicom_import(const char *dirpath)
     static UT_icd dicom_icd = {sizeof(dicom_t), NULL, NULL, NULL};
     UT_array *all_files;
     int w, h, d;    // Dimensions of the full data cube.
-    int i;
+    int i, x, y;
     uint16_t *data;
-    uint8_t (*cube)[4];
+    uint8_t v[4];
+    mesh_sink_t *sink;
 
     dirpath = dirpath ?: noc_file_dialog_open(
             NOC_FILE_DIALOG_OPEN | NOC_FILE_DIALOG_DIR, NULL, NULL, NULL);
@@ -335,34 +336,31 @@ static void dicom_import(const char *dirpath)
     closedir(dir);
     utarray_sort(all_files, dicom_sort);
 
-    // Read all the file data one by one into the data cube.
+    // Read all the file data one by one, and put them into the mesh
+    // as 4 * 8bit RGBA values.
+    // XXX: we should maybe support voxel data in 2 bytes monochrome.
     w = dicom.columns;
     h = dicom.rows;
     d = utarray_len(all_files);
-    data = calloc(w * h * d, 2);
+    data = calloc(w * h, 2);
+    sink = mesh_sink_new(goxel.image->active_layer->mesh, (int[2][3]){
+            {-w / 2, -h / 2, -d / 2}, {-w / 2 + w, -h / 2 + h, -d / 2 + d}});
 
     dptr = NULL;
     while( (dptr = (dicom_t*)utarray_next(all_files, dptr))) {
         i = utarray_eltidx(all_files, dptr);
-        dicom_load(dptr->path, &dicom,
-                   (char*)&data[w * h * i], w * h * 2);
+        dicom_load(dptr->path, &dicom, (char*)data, w * h * 2);
         free(dptr->path);
+        for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            vec4_set(v, 255, 255, 255, clamp(data[y * w + x], 0, 255));
+            mesh_sink_set(sink, (int[3]){-w / 2 + x, -h / 2 + y, -d / 2 + i},
+                          v);
+        }
     }
     utarray_free(all_files);
-
-    // Generate 4 * 8bit RGBA values.
-    // XXX: we should maybe support voxel data in 2 bytes monochrome.
-    cube = malloc(w * h * d * sizeof(*cube));
-    for (i = 0; i < w * h * d; i++) {
-        vec4_set(cube[i], 255, 255, 255, clamp(data[i], 0, 255));
-    }
+    mesh_sink_delete(sink);
     free(data);
-
-    // This could belong to the caller function.
-    mesh_blit(goxel.image->active_layer->mesh, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
-
-    free(cube);
 }
 
 static const dicom_uid_t UIDS[] = {
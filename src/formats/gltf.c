@@ -48,6 +48,22 @@ typedef struct {
     uint8_t color[4];
 } gltf_vertex_t;
 
+// Vertex used with the KHR_mesh_quantization extension.  The positions are
+// in subdivision units.
+typedef struct {
+    int16_t pos[3];
+    int16_t padding;
+    int8_t  normal[3];
+    int8_t  padding2;
+    uint8_t color[4];
+} gltf_qvertex_t;
+
+static struct {
+    bool quantize;  // Use KHR_mesh_quantization.
+} g_options = {};
+
+static UT_icd vertex_icd = {sizeof(gltf_vertex_t), NULL, NULL, NULL};
+
 static void gltf_init(gltf_t *g)
 {
     g->root = json_object_new(0);
@@ -64,7 +80,20 @@ static void gltf_init(gltf_t *g)
     g->scenes = json_object_push(g->root, "scenes", json_array_new(0));
 }
 
-// Create a buffer view and attribute.
+static json_t *make_buffer_view(gltf_t *g, json_t *buffer, int ofs, int size,
+                                int stride, int target)
+{
+    json_t *buffer_view;
+    buffer_view = json_array_push(g->buffer_views, json_object_new(0));
+    json_object_push_int(buffer_view, "buffer", json_index(buffer));
+    json_object_push_int(buffer_view, "byteOffset", ofs);
+    json_object_push_int(buffer_view, "byteLength", size);
+    if (stride) json_object_push_int(buffer_view, "byteStride", stride);
+    json_object_push_int(buffer_view, "target", target);
+    return buffer_view;
+}
+
+// Create an accessor attribute.
 static void make_attribute(gltf_t *g, json_t *buffer_view, json_t *attributes,
                            const char *name,
                            int component_type, const char *type,
@@ -89,54 +118,46 @@ static void make_attribute(gltf_t *g, json_t *buffer_view, json_t *attributes,
     json_object_push_int(attributes, name, json_index(accessor));
 }
 
-static void make_quad_indices(gltf_t *g, json_t *primitive, int nb, int size)
+static void make_indices(gltf_t *g, json_t *buffer_view, json_t *primitive,
+                         int nb, int component_type)
 {
-    json_t *buffer, *buffer_view, *accessor;
-    uint16_t *data;
-    int i;
-
-    data = calloc(nb * 6, sizeof(*data));
-    for (i = 0; i < nb * 6; i++)
-        data[i] = (i / 6) * 4 + ((int[]){0, 1, 2, 2, 3, 0})[i % 6];
-    buffer = json_array_push(g->buffers, json_object_new(0));
-    json_object_push_int(buffer, "byteLength", nb * 6 * sizeof(*data));
-    json_object_push(buffer, "uri",
-            json_data_new(data, nb * 6 * sizeof(*data), NULL));
-    free(data);
-    buffer_view = json_array_push(g->buffer_views, json_object_new(0));
-    json_object_push_int(buffer_view, "buffer", json_index(buffer));
-    json_object_push_int(buffer_view, "byteLength", nb * 6 * sizeof(*data));
-    json_object_push_int(buffer_view, "target", 34963);
-
+    json_t *accessor;
     accessor = json_array_push(g->accessors, json_object_new(0));
     json_object_push_int(accessor, "bufferView", json_index(buffer_view));
-    json_object_push_int(accessor, "componentType", GLTF_UNSIGNED_SHORT);
-    json_object_push_int(accessor, "count", nb * 6);
+    json_object_push_int(accessor, "componentType", component_type);
+    json_object_push_int(accessor, "count", nb);
     json_object_push_string(accessor, "type", "SCALAR");
-
     json_object_push_int(primitive, "indices", json_index(accessor));
 }
 
-static void fill_buffer(gltf_vertex_t *bverts, const voxel_vertex_t *verts,
-                        int nb, int subdivide)
+typedef struct {
+    UT_array    *verts;
+    int         size;
+    int         subdivide;
+} vertices_t;
+
+// Add the vertices of a block into the array, in world coordinates.
+static void add_block(const int bpos[3], const voxel_vertex_t *verts,
+                      int nb_elems, int size, int subdivide, void *user)
 {
-    int i;
-    for (i = 0; i < nb; i++) {
-        bverts[i].pos[0] = (float)verts[i].pos[0] / subdivide;
-        bverts[i].pos[1] = (float)verts[i].pos[1] / subdivide;
-        bverts[i].pos[2] = (float)verts[i].pos[2] / subdivide;
-        bverts[i].normal[0] = verts[i].normal[0];
-        bverts[i].normal[1] = verts[i].normal[1];
-        bverts[i].normal[2] = verts[i].normal[2];
-        vec3_normalize(bverts[i].normal, bverts[i].normal);
-        bverts[i].color[0] = verts[i].color[0];
-        bverts[i].color[1] = verts[i].color[1];
-        bverts[i].color[2] = verts[i].color[2];
-        bverts[i].color[3] = verts[i].color[3];
+    vertices_t *vertices = user;
+    int i, j;
+    gltf_vertex_t v;
+
+    vertices->size = size;
+    vertices->subdivide = subdivide;
+    for (i = 0; i < nb_elems * size; i++) {
+        for (j = 0; j < 3; j++) {
+            v.pos[j] = bpos[j] + (float)verts[i].pos[j] / subdivide;
+            v.normal[j] = verts[i].normal[j];
+        }
+        vec3_normalize(v.normal, v.normal);
+        memcpy(v.color, verts[i].color, 4);
+        utarray_push_back(vertices->verts, &v);
     }
 }
 
-static void get_pos_min_max(gltf_vertex_t *bverts, int nb,
+static void get_pos_min_max(const gltf_vertex_t *bverts, int nb,
                             float pos_min[3], float pos_max[3])
 {
     int i;
@@ -156,104 +177,221 @@ static void get_pos_min_max(gltf_vertex_t *bverts, int nb,
     }
 }
 
-static void gltf_export(const mesh_t *mesh, const char *path)
+static void quantize_vertices(const gltf_vertex_t *verts, int nb,
+                              int subdivide, gltf_qvertex_t *out)
 {
-    json_t *gmesh, *buffer, *primitives, *primitive, *attributes, *node,
-           *scene, *scene_nodes, *root_node, *root_node_children, *buffer_view;
+    int i, j;
+    for (i = 0; i < nb; i++) {
+        memset(&out[i], 0, sizeof(out[i]));
+        for (j = 0; j < 3; j++) {
+            out[i].pos[j] = roundf(verts[i].pos[j] * subdivide);
+            out[i].normal[j] = roundf(verts[i].normal[j] * 127);
+        }
+        memcpy(out[i].color, verts[i].color, 4);
+    }
+}
+
+static void write_glb(FILE *file, const char *json, const uint8_t *bin,
+                      int bin_size)
+{
+    int json_size = strlen(json);
+    int json_pad = (4 - json_size % 4) % 4;
+    int bin_pad = (4 - bin_size % 4) % 4;
+    uint32_t header[3] = {0x46546C67, 2, 0}; // "glTF", version, length.
+    uint32_t chunk[2];
+
+    header[2] = 12 + 8 + json_size + json_pad;
+    if (bin_size) header[2] += 8 + bin_size + bin_pad;
+    fwrite(header, sizeof(header), 1, file);
+
+    chunk[0] = json_size + json_pad;
+    chunk[1] = 0x4E4F534A; // JSON
+    fwrite(chunk, sizeof(chunk), 1, file);
+    fwrite(json, json_size, 1, file);
+    fwrite("   ", json_pad, 1, file);
+
+    if (!bin_size) return;
+    chunk[0] = bin_size + bin_pad;
+    chunk[1] = 0x004E4942; // BIN
+    fwrite(chunk, sizeof(chunk), 1, file);
+    fwrite(bin, bin_size, 1, file);
+    fwrite("\0\0\0", bin_pad, 1, file);
+}
+
+/*
+ * Function: gltf_export
+ * Export a mesh as a gltf file, or binary glb.
+ *
+ * All the blocks are merged into a single primitive, stored in a single
+ * buffer: the vertices followed by the indices.
+ */
+static void gltf_export(const mesh_t *mesh, const char *path, bool binary)
+{
+    json_t *gmesh, *buffer, *primitives, *primitive, *attributes,
+           *scene, *scene_nodes, *root_node, *buffer_view, *extensions;
     char *json_buf;
     FILE *file;
-    mesh_iterator_t iter;
-    int nb_elems, bpos[3], size = 0, subdivide;
-    voxel_vertex_t *verts;
-    const int N = BLOCK_SIZE;
+    int i, nb_verts, nb_indices = 0, size, subdivide;
+    int stride, vertices_size, index_size = 0, bin_size;
+    vertices_t vertices = {.subdivide = 1};
     gltf_t g;
     json_serialize_opts opts = {.indent_size = 4};
-    gltf_vertex_t *gverts;
-    int buf_size;
-    float pos_min[3], pos_max[3];
+    UT_array *gverts;
+    const gltf_vertex_t *data;
+    uint8_t *bin;
+    uint32_t index;
+    float pos_min[3], pos_max[3], s;
+    bool quantize;
 
     gltf_init(&g);
 
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    gverts = calloc(N * N * N * 6 * 4, sizeof(*gverts));
+    utarray_new(vertices.verts, &vertex_icd);
+    mesh_iter_vertices(mesh, goxel.rend.settings.effects, add_block,
+                       &vertices, NULL);
+    gverts = vertices.verts;
+    size = vertices.size;
+    subdivide = vertices.subdivide;
+    nb_verts = utarray_len(gverts);
+    if (size == 4) nb_indices = nb_verts / 4 * 6;
+
+    data = (void*)utarray_front(gverts);
+    get_pos_min_max(data, nb_verts, pos_min, pos_max);
+    // Quantized positions must fit into 16 bits integers.
+    quantize = g_options.quantize && nb_verts &&
+        max(max(fabsf(pos_min[0]), fabsf(pos_min[1])), fabsf(pos_min[2]))
+            * subdivide < INT16_MAX &&
+        max(max(fabsf(pos_max[0]), fabsf(pos_max[1])), fabsf(pos_max[2]))
+            * subdivide < INT16_MAX;
+    if (g_options.quantize && !quantize && nb_verts)
+        LOG_W("Mesh too big for quantization");
+
+    // Build the binary buffer.
+    stride = quantize ? sizeof(gltf_qvertex_t) : sizeof(gltf_vertex_t);
+    vertices_size = nb_verts * stride;
+    if (nb_indices) index_size = nb_verts > 0xffff ? 4 : 2;
+    bin_size = vertices_size + nb_indices * index_size;
+    bin = calloc(max(bin_size, 1), 1);
+    if (quantize)
+        quantize_vertices(data, nb_verts, subdivide,
+                          (void*)bin);
+    else if (data)
+        memcpy(bin, data, vertices_size);
+    utarray_free(gverts);
+    for (i = 0; i < nb_indices; i++) {
+        index = (i / 6) * 4 + ((int[]){0, 1, 2, 2, 3, 0})[i % 6];
+        if (index_size == 2)
+            ((uint16_t*)(bin + vertices_size))[i] = index;
+        else
+            ((uint32_t*)(bin + vertices_size))[i] = index;
+    }
+
+    // Goxel is z up, gltf is y up.  The quantized positions are scaled
+    // back with the node matrix.
+    s = quantize ? 1.0 / subdivide : 1.0;
     root_node = json_array_push(g.nodes, json_object_new(0));
-    json_object_push(root_node, "matrix", json_int_array_new((int[]) {
-        1, 0,  0, 0,
-        0, 0, -1, 0,
-        0, 1,  0, 0,
+    json_object_push(root_node, "matrix", json_float_array_new((float[]) {
+        s, 0,  0, 0,
+        0, 0, -s, 0,
+        0, s,  0, 0,
         0, 0,  0, 1
     }, 16));
-    root_node_children = json_object_push(root_node, "children",
-                                          json_array_new(0));
     scene = json_array_push(g.scenes, json_object_new(0));
     scene_nodes = json_object_push(scene, "nodes", json_array_new(0));
     json_array_push(scene_nodes, json_integer_new(json_index(root_node)));
 
-    iter = mesh_get_iterator(mesh,
-            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-    while (mesh_iter(&iter, bpos)) {
-        nb_elems = mesh_generate_vertices(mesh, bpos,
-                                    goxel.rend.settings.effects, verts,
-                                    &size, &subdivide);
-        if (!nb_elems) continue;
-        fill_buffer(gverts, verts, nb_elems * size, subdivide);
-        get_pos_min_max(gverts, nb_elems * size, pos_min, pos_max);
-        buf_size = nb_elems * size * sizeof(*gverts);
-
+    if (nb_verts) {
         buffer = json_array_push(g.buffers, json_object_new(0));
-        json_object_push_int(buffer, "byteLength", buf_size);
-        json_object_push(buffer, "uri", json_data_new(gverts, buf_size, NULL));
+        json_object_push_int(buffer, "byteLength", bin_size);
+        if (!binary)
+            json_object_push(buffer, "uri", json_data_new(bin, bin_size,
+                                                          NULL));
         gmesh = json_array_push(g.meshes, json_object_new(0));
         primitives = json_object_push(gmesh, "primitives", json_array_new(0));
         primitive = json_array_push(primitives, json_object_new(0));
         attributes = json_object_push(primitive, "attributes",
                                       json_object_new(0));
+        json_object_push_int(root_node, "mesh", json_index(gmesh));
+
+        buffer_view = make_buffer_view(&g, buffer, 0, vertices_size, stride,
+                                       34962);
+        if (quantize) {
+            for (i = 0; i < 3; i++) {
+                pos_min[i] = roundf(pos_min[i] * subdivide);
+                pos_max[i] = roundf(pos_max[i] * subdivide);
+            }
+            make_attribute(&g, buffer_view, attributes,
+                           "POSITION", GLTF_SHORT, "VEC3", false,
+                           nb_verts, offsetof(gltf_qvertex_t, pos),
+                           pos_min, pos_max);
+            make_attribute(&g, buffer_view, attributes,
+                           "NORMAL", GLTF_BYTE, "VEC3", true,
+                           nb_verts, offsetof(gltf_qvertex_t, normal),
+                           NULL, NULL);
+            make_attribute(&g, buffer_view, attributes,
+                           "COLOR_0", GLTF_UNSIGNED_BYTE, "VEC4", true,
+                           nb_verts, offsetof(gltf_qvertex_t, color),
+                           NULL, NULL);
+        } else {
+            make_attribute(&g, buffer_view, attributes,
+                           "POSITION", GLTF_FLOAT, "VEC3", false,
+                           nb_verts, offsetof(gltf_vertex_t, pos),
+                           pos_min, pos_max);
+            make_attribute(&g, buffer_view, attributes,
+                           "COLOR_0", GLTF_UNSIGNED_BYTE, "VEC4", true,
+                           nb_verts, offsetof(gltf_vertex_t, color),
+                           NULL, NULL);
+            make_attribute(&g, buffer_view, attributes,
+                           "NORMAL", GLTF_FLOAT, "VEC3", false,
+                           nb_verts, offsetof(gltf_vertex_t, normal),
+                           NULL, NULL);
+        }
+
+        if (nb_indices) {
+            buffer_view = make_buffer_view(&g, buffer, vertices_size,
+                                nb_indices * index_size, 0, 34963);
+            make_indices(&g, buffer_view, primitive, nb_indices,
+                         index_size == 2 ? GLTF_UNSIGNED_SHORT :
+                                           GLTF_UNSIGNED_INT);
+        }
+    }
 
-        if (size == 4)
-            make_quad_indices(&g, primitive, nb_elems, size);
-
-        buffer_view = json_array_push(g.buffer_views, json_object_new(0));
-        json_object_push_int(buffer_view, "buffer", json_index(buffer));
-        json_object_push_int(buffer_view, "byteLength", buf_size);
-        json_object_push_int(buffer_view, "byteStride", sizeof(gltf_vertex_t));
-        json_object_push_int(buffer_view, "target", 34962);
-
-        make_attribute(&g, buffer_view, attributes,
-                       "POSITION", GLTF_FLOAT, "VEC3", false,
-                       nb_elems * size, offsetof(gltf_vertex_t, pos),
-                       pos_min, pos_max);
-        make_attribute(&g, buffer_view, attributes,
-                       "COLOR_0", GLTF_UNSIGNED_BYTE, "VEC4", true,
-                       nb_elems * size, offsetof(gltf_vertex_t, color),
-                       NULL, NULL);
-        make_attribute(&g, buffer_view, attributes,
-                       "NORMAL", GLTF_FLOAT, "VEC3", false,
-                       nb_elems * size, offsetof(gltf_vertex_t, normal),
-                       NULL, NULL);
-
-        node = json_array_push(g.nodes, json_object_new(0));
-        json_object_push(node, "translation", json_int_array_new(bpos, 3));
-        json_object_push_int(node, "mesh", json_index(gmesh));
-        json_array_push(root_node_children, json_integer_new(json_index(node)));
+    if (quantize) {
+        extensions = json_object_push(g.root, "extensionsUsed",
+                                      json_array_new(0));
+        json_array_push(extensions, json_string_new("KHR_mesh_quantization"));
+        extensions = json_object_push(g.root, "extensionsRequired",
+                                      json_array_new(0));
+        json_array_push(extensions, json_string_new("KHR_mesh_quantization"));
     }
-    free(verts);
-    free(gverts);
 
+    if (binary) opts = (json_serialize_opts){
+        .mode = json_serialize_mode_packed};
     json_buf = malloc(json_measure_ex(g.root, opts));
     json_serialize_ex(json_buf, g.root, opts);
-    file = fopen(path, "w");
-    fwrite(json_buf, 1, strlen(json_buf), file);
+    file = fopen(path, "wb");
+    if (binary)
+        write_glb(file, json_buf, bin, nb_verts ? bin_size : 0);
+    else
+        fwrite(json_buf, 1, strlen(json_buf), file);
     free(json_buf);
+    free(bin);
     fclose(file);
     json_builder_free(g.root);
 }
 
+static void export_gui(void)
+{
+    gui_checkbox("Quantize", &g_options.quantize,
+                 "Use integer positions and normals "
+                 "(KHR_mesh_quantization)");
+}
+
 static void export_as_gltf(const char *path)
 {
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                     "gltf\0*.gltf\0", NULL, "untitled.gltf");
     if (!path) return;
-    gltf_export(goxel_get_layers_mesh(), path);
+    gltf_export(goxel_get_layers_mesh(), path, false);
 }
 
 ACTION_REGISTER(export_as_gltf,
@@ -263,5 +401,25 @@ ACTION_REGISTER(export_as_gltf,
     .file_format = {
         .name = "gltf",
         .ext = "*.gltf\0",
+        .export_gui = export_gui,
+    },
+)
+
+static void export_as_glb(const char *path)
+{
+    path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
+                    "glb\0*.glb\0", NULL, "untitled.glb");
+    if (!path) return;
+    gltf_export(goxel_get_layers_mesh(), path, true);
+}
+
+ACTION_REGISTER(export_as_glb,
+    .help = "Save the image as a binary gltf file",
+    .cfunc = export_as_glb,
+    .csig = "vp",
+    .file_format = {
+        .name = "glb",
+        .ext = "*.glb\0",
+        .export_gui = export_gui,
     },
 )
@@ -19,22 +19,30 @@
 
 #include "goxel.h"
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
 
-#define VERSION 2 // Current version of the file format.
+#ifndef WIN32
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+#define VERSION 3 // Current version of the file format.
 
 /*
- * File format, version 2:
+ * File format, version 3:
  *
  * This is inspired by the png format, where the file consists of a list of
  * chunks with different types.
  *
  *  4 bytes magic string        : "GOX "
- *  4 bytes version             : 2
+ *  4 bytes version             : 3
  *  List of chunks:
  *      4 bytes: type
  *      4 bytes: data length
  *      n bytes: data
- *      4 bytes: CRC
+ *      4 bytes: CRC32 of the type and data (0 in older files)
  *
  *  The layer can end with a DICT:
  *      for each entry:
@@ -50,7 +58,20 @@
  *
  *  PREV: a png image for preview.
  *
- *  BL16: a 16^3 block saved as a 64x64 png image.
+ *  BL16: a 16^3 block saved as a 64x64 png image.  Only used up to version
+ *        2, still supported when reading.
+ *
+ *  BLKS: a list of 16^3 blocks:
+ *      4 bytes: number of blocks.
+ *      4 bytes: uncompressed data size.
+ *      n bytes: zlib compressed data, for each block:
+ *          1 byte: size of the block palette (1 to 255), or 0 for raw data.
+ *          if raw data: 16^3 * 4 bytes RGBA voxels.
+ *          else: palette size * 4 bytes RGBA colors, and if there is more
+ *                than one color, 16^3 bytes of palette indices.
+ *
+ *  The blocks of the BL16 and BLKS chunks are indexed in the order they
+ *  appear in the file.
  *
  *  LAYR: a layer:
  *      4 bytes: number of blocks.
@@ -70,6 +91,20 @@
  *          ofs: offset
  *          ortho: bool
  *
+ *  TOC : optional index of all the previous chunks, for random access:
+ *      4 bytes: number of entries.
+ *      for each entry:
+ *          4 bytes: chunk type
+ *          8 bytes: chunk offset in the file
+ *          4 bytes: chunk data length
+ *          4 bytes: BL16 and BLKS: index of the first block of the chunk.
+ *                   LAYR: smallest block index used by the layer.
+ *          4 bytes: BL16 and BLKS: number of blocks.
+ *                   LAYR: size of the range of block indices used.
+ *
+ *  TOCP: must be the last chunk if there is a TOC chunk:
+ *      8 bytes: offset of the TOC chunk in the file.
+ *
  */
 
 // We create a hash table of all the blocks, so that blocks with the same
@@ -81,7 +116,63 @@ typedef struct {
     int             index;
 } block_hash_t;
 
-#define CHUNK_BUFF_SIZE (1 << 20) // 1 MiB max buffer size!
+// When loading, we put all the blocks of the file into a mesh, so that the
+// layers can directly share their data with mesh_copy_block.
+typedef struct {
+    mesh_t  *mesh;      // Block i is at position (i * BLOCK_SIZE, 0, 0).
+    int     nb;
+    int     capacity;
+    bool    *empty;     // Set for the blocks without any voxel.
+} file_blocks_t;
+
+// Entry of the chunks index.
+typedef struct {
+    char    type[4];
+    int64_t offset;     // Offset of the chunk in the file.
+    int32_t length;     // Chunk data length.
+    int32_t first;      // Index of the first block, or first block used.
+    int32_t count;      // Number of blocks, or size of the blocks range.
+} toc_entry_t;
+
+typedef struct {
+    toc_entry_t *entries;
+    int         nb;
+    int         capacity;
+} toc_t;
+
+#define TOC_ENTRY_SIZE 24
+#define TOC_POINTER_SIZE 20 // Size of the TOCP chunk at the end of a file.
+
+// Memory mapped gox file, used to lazily load the blocks.
+typedef struct {
+    int     ref;
+    void    *addr;
+    size_t  size;
+} file_map_t;
+
+// A BLKS chunk of a mapped file, whose blocks are only decoded the first
+// time they are accessed.
+//
+// The file stays mapped (MAP_PRIVATE) until all the blocks are loaded, so
+// changes made to the file by other programs in the meantime can still be
+// seen.  We check the CRC again before decoding to catch this, but a file
+// truncated while mapped will still crash (SIGBUS).
+typedef struct {
+    int             ref;        // Number of blocks not loaded yet.
+    file_map_t      *map;
+    const uint8_t   *data;      // Chunk data in the mapped file.
+    int             size;
+    uint32_t        crc;        // CRC of the chunk, zero if not set.
+    int             nb;         // Number of blocks.
+    uint8_t         *raw;       // Uncompressed data, once needed.
+    int             raw_size;
+    int             *offsets;   // Offset of each block in the raw data.
+    bool            error;
+} lazy_chunk_t;
+
+#define BLOCK_VOXELS (BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE)
+// Max number of blocks per BLKS chunk.
+#define BLKS_MAX_BLOCKS 256
 
 // XXX: should be something in goxel.h
 static const shape_t *SHAPES[] = {
@@ -90,11 +181,32 @@ static const shape_t *SHAPES[] = {
     &shape_cylinder,
 };
 
+// ftell and fseek with 64 bits offsets, since long is only 32 bits on
+// Windows.
+static int64_t file_tell(FILE *file)
+{
+#ifdef WIN32
+    return _ftelli64(file);
+#else
+    return ftello(file);
+#endif
+}
+
+static int file_seek(FILE *file, int64_t offset, int whence)
+{
+#ifdef WIN32
+    return _fseeki64(file, offset, whence);
+#else
+    return fseeko(file, offset, whence);
+#endif
+}
+
 typedef struct {
     char     type[4];
     int      length;
-    uint32_t crc;
-    char     *buffer;   // Used when writing.
+    uint32_t crc;       // CRC of the type and data read or written so far.
+    int64_t  offset;    // Used when writing: offset of the chunk.
+    bool     skipped;   // Used when reading: set if we skipped some data.
 
     int      pos;
 } chunk_t;
@@ -129,6 +241,7 @@ static bool chunk_read_start(chunk_t *c, FILE *in)
     if (r == 0) return false; // eof.
     if (r != 1) LOG_E("Error reading file");
     c->length = read_int32(in);
+    c->crc = crc32(0, (const Bytef*)c->type, 4);
     return true;
 }
 
@@ -142,8 +255,10 @@ static void chunk_read(chunk_t *c, FILE *in, char *buff, int size, int line)
         if (fread(buff, size, 1, in) != 1) {
             LOG_E("Error reading file (line %d)", line);
         }
+        c->crc = crc32(c->crc, (const Bytef*)buff, size);
     } else {
         fseek(in, size, SEEK_CUR);
+        c->skipped = true;
     }
 }
 
@@ -154,10 +269,17 @@ static int32_t chunk_read_int32(chunk_t *c, FILE *in, int line)
     return v;
 }
 
-static void chunk_read_finish(chunk_t *c, FILE *in)
+// Finish reading a chunk, and check its CRC if we read all its data.
+// Return false if the CRC doesn't match.
+static bool chunk_read_finish(chunk_t *c, FILE *in)
 {
+    uint32_t crc;
     assert(c->pos == c->length);
-    read_int32(in); // TODO: check crc.
+    crc = read_int32(in);
+    // Files saved by older versions of goxel have all their CRC set to 0.
+    if (crc == 0 || c->skipped || crc == c->crc) return true;
+    LOG_E("Wrong CRC for %.4s chunk", c->type);
+    return false;
 }
 
 static bool chunk_read_dict_value(chunk_t *c, FILE *in,
@@ -178,19 +300,24 @@ static bool chunk_read_dict_value(chunk_t *c, FILE *in,
     return true;
 }
 
+// The chunks are directly written into the file, with a placeholder for
+// the length that we patch when we finish the chunk.
 static void chunk_write_start(chunk_t *c, FILE *out, const char *type)
 {
     memset(c, 0, sizeof(*c));
     assert(strlen(type) == 4);
     memcpy(c->type, type, 4);
-    c->buffer = calloc(1, CHUNK_BUFF_SIZE);
+    c->offset = file_tell(out);
+    c->crc = crc32(0, (const Bytef*)type, 4);
+    fwrite(type, 4, 1, out);
+    write_int32(out, 0);
 }
 
 static void chunk_write(chunk_t *c, FILE *out, const char *data, int size)
 {
     if (size == 0) return;
-    assert(c->length + size < CHUNK_BUFF_SIZE);
-    memcpy(c->buffer + c->length, data, size);
+    fwrite(data, size, 1, out);
+    c->crc = crc32(c->crc, (const Bytef*)data, size);
     c->length += size;
 }
 
@@ -208,23 +335,110 @@ static void chunk_write_dict_value(chunk_t *c, FILE *out, const char *name,
     chunk_write(c, out, data, size);
 }
 
-static void chunk_write_finish(chunk_t *c, FILE *out)
+// Add an entry to the chunks index for a chunk about to be written.
+static toc_entry_t *toc_add(toc_t *toc, const char *type, int64_t offset,
+                            int length)
 {
-    fwrite(c->type, 4, 1, out);
+    toc_entry_t *entry;
+    if (!toc) return NULL;
+    if (toc->nb == toc->capacity) {
+        toc->capacity = max(64, toc->capacity * 2);
+        toc->entries = realloc(toc->entries,
+                               toc->capacity * sizeof(*toc->entries));
+    }
+    entry = &toc->entries[toc->nb++];
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->type, type, 4);
+    entry->offset = offset;
+    entry->length = length;
+    return entry;
+}
+
+static toc_entry_t *chunk_write_finish(chunk_t *c, FILE *out, toc_t *toc)
+{
+    int64_t end;
+    write_int32(out, c->crc);
+    end = file_tell(out);
+    file_seek(out, c->offset + 4, SEEK_SET);
     write_int32(out, c->length);
-    fwrite(c->buffer, c->length, 1, out);
-    write_int32(out, 0);        // CRC XXX: todo.
-    free(c->buffer);
-    c->buffer = NULL;
+    file_seek(out, end, SEEK_SET);
+    return toc_add(toc, c->type, c->offset, c->length);
 }
 
-static void chunk_write_all(FILE *out, const char *type,
-                            const char *data, int size)
+static toc_entry_t *chunk_write_all(FILE *out, const char *type,
+                                    const char *data, int size, toc_t *toc)
 {
+    toc_entry_t *entry = toc_add(toc, type, file_tell(out), size);
+    uint32_t crc;
+    crc = crc32(crc32(0, (const Bytef*)type, 4), (const Bytef*)data, size);
     fwrite(type, 4, 1, out);
     write_int32(out, size);
     fwrite(data, size, 1, out);
-    write_int32(out, 0);        // CRC XXX: todo.
+    write_int32(out, crc);
+    return entry;
+}
+
+// Write the chunks index, followed by the TOCP chunk pointing to it.
+static void toc_write(FILE *out, const toc_t *toc)
+{
+    char *data;
+    int i;
+    const toc_entry_t *e;
+    int64_t offset = file_tell(out);
+
+    data = malloc(4 + toc->nb * TOC_ENTRY_SIZE);
+    memcpy(data, &(int32_t){toc->nb}, 4);
+    for (i = 0; i < toc->nb; i++) {
+        e = &toc->entries[i];
+        memcpy(data + 4 + i * TOC_ENTRY_SIZE + 0, e->type, 4);
+        memcpy(data + 4 + i * TOC_ENTRY_SIZE + 4, &e->offset, 8);
+        memcpy(data + 4 + i * TOC_ENTRY_SIZE + 12, &e->length, 4);
+        memcpy(data + 4 + i * TOC_ENTRY_SIZE + 16, &e->first, 4);
+        memcpy(data + 4 + i * TOC_ENTRY_SIZE + 20, &e->count, 4);
+    }
+    chunk_write_all(out, "TOC ", data, 4 + toc->nb * TOC_ENTRY_SIZE, NULL);
+    chunk_write_all(out, "TOCP", (char*)&offset, 8, NULL);
+    free(data);
+}
+
+// Read the chunks index of a file if it has one.
+static int toc_read(FILE *in, toc_t *toc)
+{
+    chunk_t c;
+    int64_t offset;
+    int32_t nb;
+    int i;
+    uint8_t *data = NULL;
+    toc_entry_t *e;
+
+    memset(toc, 0, sizeof(*toc));
+    if (file_seek(in, -TOC_POINTER_SIZE, SEEK_END)) goto error;
+    if (!chunk_read_start(&c, in)) goto error;
+    if (strncmp(c.type, "TOCP", 4) != 0 || c.length != 8) goto error;
+    if (fread(&offset, 8, 1, in) != 1) goto error;
+    if (offset < 8 || file_seek(in, offset, SEEK_SET)) goto error;
+    if (!chunk_read_start(&c, in)) goto error;
+    if (strncmp(c.type, "TOC ", 4) != 0 || c.length < 4) goto error;
+    if (fread(&nb, 4, 1, in) != 1) goto error;
+    if (nb < 0 || c.length != 4 + (int64_t)nb * TOC_ENTRY_SIZE) goto error;
+    data = malloc(max(nb, 1) * TOC_ENTRY_SIZE);
+    if (nb && fread(data, nb * TOC_ENTRY_SIZE, 1, in) != 1) goto error;
+    toc->entries = calloc(max(nb, 1), sizeof(*toc->entries));
+    toc->nb = toc->capacity = nb;
+    for (i = 0; i < nb; i++) {
+        e = &toc->entries[i];
+        memcpy(e->type, data + i * TOC_ENTRY_SIZE + 0, 4);
+        memcpy(&e->offset, data + i * TOC_ENTRY_SIZE + 4, 8);
+        memcpy(&e->length, data + i * TOC_ENTRY_SIZE + 12, 4);
+        memcpy(&e->first, data + i * TOC_ENTRY_SIZE + 16, 4);
+        memcpy(&e->count, data + i * TOC_ENTRY_SIZE + 20, 4);
+    }
+    free(data);
+    return 0;
+
+error:
+    free(data);
+    return -1;
 }
 
 static int get_material_idx(const image_t *img, const material_t *mat)
@@ -247,26 +461,545 @@ static const material_t *get_material(const image_t *img, int idx)
     return NULL;
 }
 
-void save_to_file(const image_t *img, const char *path, bool with_preview)
+// Encode a block in the BLKS format, return the size written to out.
+// out must be at least 1 + BLOCK_VOXELS * 4 bytes.
+static int block_encode(const uint8_t *voxels, uint8_t *out)
+{
+    // Open addressing hash table of the palette colors.
+    uint32_t keys[512], color;
+    uint8_t values[512], *indices, *palette;
+    bool used[512] = {};
+    int i, h, nb = 0;
+
+    palette = out + 1;
+    indices = out + 1 + 255 * 4; // Moved after the palette at the end.
+    for (i = 0; i < BLOCK_VOXELS; i++) {
+        memcpy(&color, voxels + i * 4, 4);
+        h = (color * 2654435761u) >> 23;
+        while (used[h] && keys[h] != color) h = (h + 1) % 512;
+        if (!used[h]) {
+            if (nb == 255) break; // Too many colors.
+            used[h] = true;
+            keys[h] = color;
+            values[h] = nb;
+            memcpy(palette + nb * 4, &color, 4);
+            nb++;
+        }
+        indices[i] = values[h];
+    }
+    if (i < BLOCK_VOXELS) {
+        out[0] = 0;
+        memcpy(out + 1, voxels, BLOCK_VOXELS * 4);
+        return 1 + BLOCK_VOXELS * 4;
+    }
+    out[0] = nb;
+    if (nb == 1) return 1 + 4;
+    memmove(out + 1 + nb * 4, indices, BLOCK_VOXELS);
+    return 1 + nb * 4 + BLOCK_VOXELS;
+}
+
+// Return the size of a block in the BLKS format, or -1 in case of error.
+static int block_encoded_size(const uint8_t *data, int size)
+{
+    int ret;
+    if (size < 1) return -1;
+    ret = data[0] == 0 ? 1 + BLOCK_VOXELS * 4 :
+          data[0] == 1 ? 1 + 4 :
+                         1 + data[0] * 4 + BLOCK_VOXELS;
+    return ret <= size ? ret : -1;
+}
+
+// Decode a block from the BLKS format, return the size read, or -1 in
+// case of error.
+static int block_decode(const uint8_t *data, int size, uint8_t *voxels)
+{
+    int i, nb;
+    const uint8_t *palette;
+    if (size < 1) return -1;
+    nb = data[0];
+    if (nb == 0) {
+        if (size < 1 + BLOCK_VOXELS * 4) return -1;
+        memcpy(voxels, data + 1, BLOCK_VOXELS * 4);
+        return 1 + BLOCK_VOXELS * 4;
+    }
+    palette = data + 1;
+    if (nb == 1) {
+        if (size < 1 + 4) return -1;
+        for (i = 0; i < BLOCK_VOXELS; i++)
+            memcpy(voxels + i * 4, palette, 4);
+        return 1 + 4;
+    }
+    if (size < 1 + nb * 4 + BLOCK_VOXELS) return -1;
+    for (i = 0; i < BLOCK_VOXELS; i++) {
+        if (data[1 + nb * 4 + i] >= nb) return -1;
+        memcpy(voxels + i * 4, palette + data[1 + nb * 4 + i] * 4, 4);
+    }
+    return 1 + nb * 4 + BLOCK_VOXELS;
+}
+
+static void file_blocks_grow(file_blocks_t *blocks)
+{
+    if (blocks->nb == blocks->capacity) {
+        blocks->capacity = max(64, blocks->capacity * 2);
+        blocks->empty = realloc(blocks->empty,
+                                blocks->capacity * sizeof(*blocks->empty));
+    }
+    if (!blocks->mesh) blocks->mesh = mesh_new();
+}
+
+static void file_blocks_add(file_blocks_t *blocks, const uint8_t *voxels)
+{
+    int i;
+    bool empty = true;
+
+    for (i = 0; i < BLOCK_VOXELS; i++) {
+        if (voxels[i * 4 + 3]) {
+            empty = false;
+            break;
+        }
+    }
+    file_blocks_grow(blocks);
+    blocks->empty[blocks->nb] = empty;
+    if (!empty) {
+        mesh_set_block(blocks->mesh,
+                       (int[3]){blocks->nb * BLOCK_SIZE, 0, 0}, voxels);
+    }
+    blocks->nb++;
+}
+
+static file_map_t *file_map_open(FILE *in)
+{
+#ifdef WIN32
+    return NULL;
+#else
+    struct stat st;
+    void *addr;
+    file_map_t *map;
+
+    if (fstat(fileno(in), &st) || st.st_size == 0) return NULL;
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    if (addr == MAP_FAILED) return NULL;
+    map = calloc(1, sizeof(*map));
+    map->ref = 1;
+    map->addr = addr;
+    map->size = st.st_size;
+    return map;
+#endif
+}
+
+static void file_map_release(file_map_t *map)
+{
+    if (!map || --map->ref) return;
+#ifndef WIN32
+    munmap(map->addr, map->size);
+#endif
+    free(map);
+}
+
+static void lazy_chunk_inflate(lazy_chunk_t *chunk)
+{
+    int i, r, ofs = 0;
+    uLongf len;
+
+    if (chunk->crc && chunk->crc != crc32(crc32(0, (const Bytef*)"BLKS", 4),
+                                          chunk->data, chunk->size)) {
+        LOG_E("BLKS chunk changed since the file was loaded");
+        chunk->error = true;
+        return;
+    }
+    memcpy(&chunk->raw_size, chunk->data + 4, 4);
+    chunk->raw = malloc(chunk->raw_size);
+    chunk->offsets = calloc(chunk->nb, sizeof(*chunk->offsets));
+    len = chunk->raw_size;
+    if (    !chunk->raw ||
+            uncompress(chunk->raw, &len, chunk->data + 8,
+                       chunk->size - 8) != Z_OK ||
+            len != chunk->raw_size) {
+        chunk->error = true;
+        return;
+    }
+    for (i = 0; i < chunk->nb; i++) {
+        r = block_encoded_size(chunk->raw + ofs, chunk->raw_size - ofs);
+        if (r < 0) {
+            chunk->error = true;
+            return;
+        }
+        chunk->offsets[i] = ofs;
+        ofs += r;
+    }
+}
+
+static void lazy_chunk_load(void *user, int index, uint8_t *voxels)
+{
+    lazy_chunk_t *chunk = user;
+    int ofs;
+
+    if (!chunk->raw && !chunk->error) lazy_chunk_inflate(chunk);
+    if (!chunk->error) {
+        ofs = chunk->offsets[index];
+        if (block_decode(chunk->raw + ofs, chunk->raw_size - ofs, voxels) >= 0)
+            return;
+    }
+    LOG_E("Cannot decode block %d", index);
+    memset(voxels, 0, BLOCK_VOXELS * 4);
+}
+
+static void lazy_chunk_release(void *user)
+{
+    lazy_chunk_t *chunk = user;
+    if (--chunk->ref) return;
+    file_map_release(chunk->map);
+    free(chunk->raw);
+    free(chunk->offsets);
+    free(chunk);
+}
+
+// Add all the blocks of a mapped BLKS chunk to the file blocks, without
+// decoding them.  We still check the CRC here, so that a corrupted file
+// fails to load instead of being silently saved back with empty blocks.
+static int file_blocks_add_lazy(file_blocks_t *blocks, file_map_t *map,
+                                int64_t offset, int size)
+{
+    const uint8_t *data = (const uint8_t*)map->addr + offset;
+    lazy_chunk_t *chunk;
+    int32_t nb, raw_size;
+    uint32_t crc;
+    int i;
+
+    if (size < 8 || offset < 0 || offset + size + 4 > (int64_t)map->size)
+        return -1;
+    memcpy(&crc, data + size, 4);
+    if (crc && crc != crc32(crc32(0, (const Bytef*)"BLKS", 4), data, size)) {
+        LOG_E("Wrong CRC for BLKS chunk");
+        return -1;
+    }
+    memcpy(&nb, data + 0, 4);
+    memcpy(&raw_size, data + 4, 4);
+    // Each encoded block takes at least 5 bytes.
+    if (nb < 0 || raw_size < 0 || (int64_t)nb * 5 > raw_size) return -1;
+    if (nb == 0) return 0;
+    chunk = calloc(1, sizeof(*chunk));
+    chunk->ref = nb;
+    chunk->map = map;
+    chunk->data = data;
+    chunk->size = size;
+    chunk->crc = crc;
+    chunk->nb = nb;
+    map->ref++;
+    for (i = 0; i < nb; i++) {
+        file_blocks_grow(blocks);
+        blocks->empty[blocks->nb] = false;
+        mesh_set_block_lazy(blocks->mesh,
+                            (int[3]){blocks->nb * BLOCK_SIZE, 0, 0},
+                            lazy_chunk_load, lazy_chunk_release, chunk, i);
+        blocks->nb++;
+    }
+    return 0;
+}
+
+// Add a block of the file to a layer mesh.
+static void file_blocks_copy(const file_blocks_t *blocks, int index,
+                             mesh_t *mesh, const int pos[3])
+{
+    const int src_pos[3] = {index * BLOCK_SIZE, 0, 0};
+    const uint8_t *voxels;
+
+    if (blocks->empty[index]) return;
+    if (    pos[0] % BLOCK_SIZE == 0 &&
+            pos[1] % BLOCK_SIZE == 0 &&
+            pos[2] % BLOCK_SIZE == 0) {
+        mesh_copy_block(blocks->mesh, src_pos, mesh, pos);
+        return;
+    }
+    // Not aligned, should not happen with files saved by goxel.
+    voxels = mesh_get_block_data(blocks->mesh, NULL, src_pos, NULL);
+    mesh_blit(mesh, voxels, pos[0], pos[1], pos[2],
+              BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE, NULL);
+}
+
+static void file_blocks_release(file_blocks_t *blocks)
+{
+    mesh_delete(blocks->mesh);
+    free(blocks->empty);
+    memset(blocks, 0, sizeof(*blocks));
+}
+
+// Encode a list of blocks into the data of a BLKS chunk.
+static uint8_t *encode_blocks_chunk(const void **blocks, int nb, int *size)
+{
+    uint8_t *raw, *data;
+    int i, raw_size = 0;
+    uLongf len;
+
+    raw = malloc(nb * (1 + BLOCK_VOXELS * 4));
+    for (i = 0; i < nb; i++)
+        raw_size += block_encode(blocks[i], raw + raw_size);
+    len = compressBound(raw_size);
+    data = malloc(8 + len);
+    compress2(data + 8, &len, raw, raw_size, Z_BEST_SPEED);
+    memcpy(data + 0, &(int32_t){nb}, 4);
+    memcpy(data + 4, &(int32_t){raw_size}, 4);
+    free(raw);
+    *size = 8 + len;
+    return data;
+}
+
+// Decode the data of a BLKS chunk into an array of blocks voxels.
+static uint8_t *decode_blocks_chunk(const uint8_t *data, int size, int *nb)
+{
+    int32_t n, raw_size;
+    int i, r, ofs = 0;
+    uint8_t *raw, *voxels;
+    uLongf len;
+
+    if (size < 8) return NULL;
+    memcpy(&n, data + 0, 4);
+    memcpy(&raw_size, data + 4, 4);
+    // Each encoded block takes at least 5 bytes.
+    if (n < 0 || raw_size < 0 || (int64_t)n * 5 > raw_size) return NULL;
+    raw = malloc(raw_size);
+    voxels = malloc((size_t)max(n, 1) * BLOCK_VOXELS * 4);
+    if (!raw || !voxels) goto error;
+    len = raw_size;
+    if (uncompress(raw, &len, data + 8, size - 8) != Z_OK || len != raw_size)
+        goto error;
+    for (i = 0; i < n; i++) {
+        r = block_decode(raw + ofs, raw_size - ofs,
+                         voxels + (size_t)i * BLOCK_VOXELS * 4);
+        if (r < 0) goto error;
+        ofs += r;
+    }
+    free(raw);
+    *nb = n;
+    return voxels;
+
+error:
+    free(raw);
+    free(voxels);
+    return NULL;
+}
+
+/*
+ * Blocks chunks are independent from each other, so we encode and decode
+ * them with a pool of worker threads.  The main thread pushes the jobs in
+ * the file order and pops them back in the same order, so that the output
+ * is deterministic.  The number of jobs in flight is bounded to limit the
+ * memory usage.
+ */
+
+#define MAX_THREADS 16
+#define MAX_JOBS (2 * MAX_THREADS)
+
+typedef struct {
+    char        type[4];    // "BL16" or "BLKS".
+    const void  **blocks;   // Encoding: the blocks voxels.
+    uint8_t     *data;      // Chunk data.
+    int         size;       // Chunk data size.
+    uint8_t     *voxels;    // Decoding: the blocks voxels.
+    int         nb;         // Number of blocks.
+    bool        error;
+    bool        done;
+} codec_job_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    pthread_t       threads[MAX_THREADS];
+    int             nb_threads;
+    codec_job_t     jobs[MAX_JOBS];     // Ring buffer.
+    int             capacity;
+    int             nb_pushed;
+    int             nb_started;
+    int             nb_popped;
+    bool            stop;
+    void            (*func)(codec_job_t *job);
+} codec_pool_t;
+
+static void encode_job(codec_job_t *job)
+{
+    if (strncmp(job->type, "BL16", 4) == 0) {
+        job->data = img_write_to_mem(job->blocks[0], 64, 64, 4, &job->size);
+    } else {
+        job->data = encode_blocks_chunk(job->blocks, job->nb, &job->size);
+    }
+    job->error = !job->data;
+}
+
+static void decode_job(codec_job_t *job)
+{
+    int w, h, bpp = 4;
+    if (strncmp(job->type, "BL16", 4) == 0) {
+        job->voxels = img_read_from_mem((void*)job->data, job->size,
+                                        &w, &h, &bpp);
+        job->nb = 1;
+        if (job->voxels && (w != 64 || h != 64 || bpp != 4)) {
+            free(job->voxels);
+            job->voxels = NULL;
+        }
+    } else {
+        job->voxels = decode_blocks_chunk(job->data, job->size, &job->nb);
+    }
+    job->error = !job->voxels;
+}
+
+static void *codec_thread(void *arg)
+{
+    codec_pool_t *pool = arg;
+    codec_job_t *job;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (!pool->stop && pool->nb_started == pool->nb_pushed)
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        if (pool->nb_started == pool->nb_pushed) break;
+        job = &pool->jobs[pool->nb_started++ % MAX_JOBS];
+        pthread_mutex_unlock(&pool->mutex);
+        pool->func(job);
+        pthread_mutex_lock(&pool->mutex);
+        job->done = true;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static int get_nb_threads(void)
+{
+    int ret = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    ret = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return clamp(ret, 1, MAX_THREADS);
+}
+
+static void codec_pool_init(codec_pool_t *pool,
+                            void (*func)(codec_job_t *job))
+{
+    int i, nb;
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->func = func;
+    // The main thread also runs jobs while waiting for the results.
+    nb = get_nb_threads() - 1;
+    for (i = 0; i < nb; i++) {
+        if (pthread_create(&pool->threads[i], NULL, codec_thread, pool))
+            break;
+        pool->nb_threads++;
+    }
+    pool->capacity = 2 * (pool->nb_threads + 1);
+}
+
+static bool codec_pool_is_full(const codec_pool_t *pool)
+{
+    return pool->nb_pushed - pool->nb_popped == pool->capacity;
+}
+
+static void codec_pool_push(codec_pool_t *pool, const codec_job_t *job)
+{
+    assert(!codec_pool_is_full(pool));
+    pthread_mutex_lock(&pool->mutex);
+    pool->jobs[pool->nb_pushed % MAX_JOBS] = *job;
+    pool->jobs[pool->nb_pushed % MAX_JOBS].done = false;
+    pool->nb_pushed++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Return the oldest job once it is done, or NULL if there is no job left.
+// The returned job is only valid until the next push.
+static codec_job_t *codec_pool_pop(codec_pool_t *pool)
+{
+    codec_job_t *job;
+    if (pool->nb_popped == pool->nb_pushed) return NULL;
+    pthread_mutex_lock(&pool->mutex);
+    job = &pool->jobs[pool->nb_popped % MAX_JOBS];
+    // If no worker took the job yet, do it ourself.
+    if (pool->nb_started == pool->nb_popped) {
+        pool->nb_started++;
+        pthread_mutex_unlock(&pool->mutex);
+        pool->func(job);
+        pthread_mutex_lock(&pool->mutex);
+        job->done = true;
+    }
+    while (!job->done)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    pool->nb_popped++;
+    pthread_mutex_unlock(&pool->mutex);
+    return job;
+}
+
+static void codec_job_release(codec_job_t *job)
+{
+    free(job->blocks);
+    free(job->data);
+    free(job->voxels);
+    memset(job, 0, sizeof(*job));
+}
+
+static void codec_pool_release(codec_pool_t *pool)
+{
+    int i;
+    codec_job_t *job;
+    if (!pool->func) return; // Not initialized.
+    while ((job = codec_pool_pop(pool))) codec_job_release(job);
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+}
+
+// Write an encoded blocks chunk job to the file.
+static void write_job(FILE *out, codec_job_t *job, toc_t *toc,
+                      int *nb_written, int nb_total, float *progress)
+{
+    toc_entry_t *entry;
+    entry = chunk_write_all(out, job->type, (char*)job->data, job->size,
+                            toc);
+    entry->first = *nb_written;
+    entry->count = job->nb;
+    *nb_written += job->nb;
+    if (progress) *progress = (float)*nb_written / nb_total;
+    codec_job_release(job);
+}
+
+// Save an image.  If png_blocks is set, we save the blocks as BL16 chunks
+// like in version 2 of the format (only used to compare the codecs).
+static int write_file(const image_t *img, const char *path, bool with_preview,
+                      bool png_blocks, float *progress)
 {
     // XXX: remove all empty blocks before saving.
     LOG_I("Save to %s", path);
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
+    codec_pool_t pool;
+    codec_job_t job = {}, *job_ptr;
+    int nb_written = 0, range[2];
+    toc_t toc = {};
+    toc_entry_t *entry;
     layer_t *layer;
     chunk_t c;
-    int nb_blocks, index, size, bpos[3], material_idx;
+    int nb_blocks, index, size, bpos[3], material_idx, ret;
     uint64_t uid;
     FILE *out;
     uint8_t *png, *preview;
     camera_t *camera;
     material_t *material;
     mesh_iterator_t iter;
+    char tmp_path[1024];
 
     img = img ?: goxel.image;
-    out = fopen(path, "wb");
+    // Write into a temporary file first, so that we never leave a
+    // partially written file, and don't modify a file that is still
+    // mapped in memory by lazily loaded blocks.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    out = fopen(tmp_path, "wb");
     if (!out) {
         LOG_E("Cannot save to %s: %s", path, strerror(errno));
-        return;
+        return -1;
     }
     fwrite("GOX ", 4, 1, out);
     write_int32(out, VERSION);
@@ -275,13 +1008,13 @@ void save_to_file(const image_t *img, const char *path, bool with_preview)
     chunk_write_start(&c, out, "IMG ");
     if (!box_is_null(img->box))
         chunk_write_dict_value(&c, out, "box", &img->box, sizeof(img->box));
-    chunk_write_finish(&c, out);
+    chunk_write_finish(&c, out, &toc);
 
     if (with_preview) {
         preview = calloc(128 * 128, 4);
-        goxel_render_to_buf(preview, 128, 128, 4);
+        goxel_render_preview(img, preview, 128, 128, 4);
         png = img_write_to_mem(preview, 128, 128, 4, &size);
-        chunk_write_all(out, "PREV", (char*)png, size);
+        chunk_write_all(out, "PREV", (char*)png, size, &toc);
         free(preview);
         free(png);
     }
@@ -291,7 +1024,7 @@ void save_to_file(const image_t *img, const char *path, bool with_preview)
     DL_FOREACH(img->layers, layer) {
         iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
         while (mesh_iter(&iter, bpos)) {
-            mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
+            uid = mesh_get_block_id(layer->mesh, &iter, bpos);
             HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
             if (data) continue;
             data = calloc(1, sizeof(*data));
@@ -304,11 +1037,24 @@ void save_to_file(const image_t *img, const char *path, bool with_preview)
     }
 
     // Write all the blocks chunks.
+    codec_pool_init(&pool, encode_job);
     HASH_ITER(hh, blocks_table, data, data_tmp) {
-        png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
-        chunk_write_all(out, "BL16", (char*)png, size);
-        free(png);
+        if (!job.nb) {
+            memcpy(job.type, png_blocks ? "BL16" : "BLKS", 4);
+            job.blocks = calloc(BLKS_MAX_BLOCKS, sizeof(*job.blocks));
+        }
+        job.blocks[job.nb++] = data->v;
+        if (!png_blocks && job.nb < BLKS_MAX_BLOCKS && data->hh.next)
+            continue;
+        while (codec_pool_is_full(&pool))
+            write_job(out, codec_pool_pop(&pool), &toc, &nb_written, index,
+                      progress);
+        codec_pool_push(&pool, &job);
+        memset(&job, 0, sizeof(job));
     }
+    while ((job_ptr = codec_pool_pop(&pool)))
+        write_job(out, job_ptr, &toc, &nb_written, index, progress);
+    codec_pool_release(&pool);
 
     // Write all the materials.
     DL_FOREACH(img->materials, material) {
@@ -323,7 +1069,7 @@ void save_to_file(const image_t *img, const char *path, bool with_preview)
                                sizeof(material->roughness));
         chunk_write_dict_value(&c, out, "emission", &material->emission,
                                sizeof(material->emission));
-        chunk_write_finish(&c, out);
+        chunk_write_finish(&c, out, &toc);
     }
 
     // Write all the layers.
@@ -337,12 +1083,16 @@ void save_to_file(const image_t *img, const char *path, bool with_preview)
             }
         }
         chunk_write_int32(&c, out, nb_blocks);
+        range[0] = INT_MAX;
+        range[1] = INT_MIN;
         if (!layer->base_id && !layer->shape) {
             iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
             while (mesh_iter(&iter, bpos)) {
-                mesh_get_block_data(layer->mesh, &iter, bpos, &uid);
+                uid = mesh_get_block_id(layer->mesh, &iter, bpos);
                 HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
                 assert(data);
+                range[0] = min(range[0], data->index);
+                range[1] = max(range[1], data->index);
                 chunk_write_int32(&c, out, data->index);
                 chunk_write_int32(&c, out, bpos[0]);
                 chunk_write_int32(&c, out, bpos[1]);
@@ -377,7 +1127,11 @@ void save_to_file(const image_t *img, const char *path, bool with_preview)
         chunk_write_dict_value(&c, out, "visible", &layer->visible,
                                sizeof(layer->visible));
 
-        chunk_write_finish(&c, out);
+        entry = chunk_write_finish(&c, out, &toc);
+        if (nb_blocks) {
+            entry->first = range[0];
+            entry->count = range[1] - range[0] + 1;
+        }
     }
 
     // Write all the cameras.
@@ -398,79 +1152,194 @@ void save_to_file(const image_t *img, const char *path, bool with_preview)
         if (camera == img->active_camera)
             chunk_write_dict_value(&c, out, "active", NULL, 0);
 
-        chunk_write_finish(&c, out);
+        chunk_write_finish(&c, out, &toc);
     }
 
+    toc_write(out, &toc);
+    free(toc.entries);
+
     HASH_ITER(hh, blocks_table, data, data_tmp) {
         HASH_DEL(blocks_table, data);
         free(data);
     }
 
-    fclose(out);
+    ret = ferror(out) ? -1 : 0;
+    if (fclose(out) != 0) ret = -1;
+    if (ret == 0) {
+#ifdef WIN32
+        remove(path);
+#endif
+        if (rename(tmp_path, path) != 0) ret = -1;
+    }
+    if (ret) {
+        LOG_E("Error writing %s", path);
+        remove(tmp_path);
+    }
+    return ret;
 }
 
-// Iter info of a gox file, without actually reading it.
-// For the moment only returns the image preview if available.
-int gox_iter_infos(const char *path,
-                   int (*callback)(const char *attr, int size,
-                                   void *value, void *user),
-                   void *user)
+int gox_write(const image_t *img, const char *path, bool with_preview,
+              float *progress)
 {
-    FILE *in;
+    return write_file(img, path, with_preview, false, progress);
+}
+
+int save_to_file(const image_t *img, const char *path, bool with_preview)
+{
+    return gox_write(img, path, with_preview, NULL);
+}
+
+// Check if a chunk type is in a list of types, like "BL16BLKS".
+static bool type_in(const char type[4], const char *list)
+{
+    for (; list && *list; list += 4) {
+        if (strncmp(type, list, 4) == 0) return true;
+    }
+    return false;
+}
+
+// Call a function for each chunk of a given type in a gox file, with the
+// file positioned at the start of the chunk data.  Use the chunks index if
+// the file has one, otherwise scan the file until one of the stop types.
+// Stop as soon as the function returns a non zero value.
+static int iter_chunks(FILE *in, const char *type, const char *stop,
+                       int (*f)(FILE *in, chunk_t *c, void *user),
+                       void *user)
+{
+    toc_t toc;
     chunk_t c;
-    uint8_t *png;
     char magic[4];
+    int i, ret = 0;
+
+    if (toc_read(in, &toc) == 0) {
+        for (i = 0; i < toc.nb && !ret; i++) {
+            if (strncmp(toc.entries[i].type, type, 4) != 0) continue;
+            if (file_seek(in, toc.entries[i].offset, SEEK_SET)) {
+                ret = -1;
+                break;
+            }
+            if (!chunk_read_start(&c, in)) {
+                ret = -1;
+                break;
+            }
+            ret = f(in, &c, user);
+        }
+        free(toc.entries);
+        return ret;
+    }
 
-    in = fopen(path, "rb");
-
+    fseek(in, 0, SEEK_SET);
     if (fread(magic, 4, 1, in) != 1) return -1;
     if (strncmp(magic, "GOX ", 4) != 0) return -1;
     read_int32(in);
-
-    while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) break;
-        if (strncmp(c.type, "LAYR", 4) == 0) break;
-        if (strncmp(c.type, "PREV", 4) == 0) {
-            png = calloc(1, c.length);
-            chunk_read(&c, in, (char*)png, c.length, __LINE__);
-            callback(c.type, c.length, png, user);
-            free(png);
-        } else {
-            // Ignore other blocks.
-            chunk_read(&c, in, NULL, c.length, __LINE__);
-        }
+    while (!ret && chunk_read_start(&c, in)) {
+        if (type_in(c.type, stop)) break;
+        if (strncmp(c.type, type, 4) == 0) ret = f(in, &c, user);
+        chunk_read(&c, in, NULL, c.length - c.pos, __LINE__);
         chunk_read_finish(&c, in);
     }
+    return ret;
+}
+
+typedef struct {
+    int (*callback)(const char *attr, int size, void *value, void *user);
+    int (*layer_callback)(int index, const char *name, int nb_blocks,
+                          void *user);
+    void *user;
+    int index;
+} iter_ctx_t;
+
+static int on_preview(FILE *in, chunk_t *c, void *user)
+{
+    iter_ctx_t *ctx = user;
+    uint8_t *png;
+    png = calloc(1, c->length);
+    chunk_read(c, in, (char*)png, c->length, __LINE__);
+    ctx->callback(c->type, c->length, png, ctx->user);
+    free(png);
+    return 1; // There is only one preview.
+}
+
+int gox_iter_infos(const char *path,
+                   int (*callback)(const char *attr, int size,
+                                   void *value, void *user),
+                   void *user)
+{
+    FILE *in;
+    iter_ctx_t ctx = {.callback = callback, .user = user};
+    int ret;
+
+    in = fopen(path, "rb");
+    if (!in) return -1;
+    // Without index, the preview is always before the blocks.
+    ret = iter_chunks(in, "PREV", "BL16BLKSLAYR", on_preview, &ctx);
     fclose(in);
-    return 0;
+    return ret < 0 ? -1 : 0;
 }
 
+static int on_layer(FILE *in, chunk_t *c, void *user)
+{
+    iter_ctx_t *ctx = user;
+    int nb_blocks, size;
+    char key[256], value[256], name[256] = "";
+
+    nb_blocks = chunk_read_int32(c, in, __LINE__);
+    if (nb_blocks < 0 || (int64_t)nb_blocks * 20 > c->length - 4) return -1;
+    chunk_read(c, in, NULL, nb_blocks * 20, __LINE__);
+    while (chunk_read_dict_value(c, in, key, value, &size, __LINE__)) {
+        if (strcmp(key, "name") == 0) copy_string(name, value);
+    }
+    return ctx->layer_callback(ctx->index++, name, nb_blocks, ctx->user);
+}
 
-static block_hash_t *hash_find_at(block_hash_t *hash, int index)
+int gox_iter_layers(const char *path,
+                    int (*callback)(int index, const char *name,
+                                    int nb_blocks, void *user),
+                    void *user)
 {
-    int i;
-    for (i = 0; i < index; i++) {
-        hash = hash->hh.next;
+    FILE *in;
+    iter_ctx_t ctx = {.layer_callback = callback, .user = user};
+    int ret;
+
+    in = fopen(path, "rb");
+    if (!in) return -1;
+    ret = iter_chunks(in, "LAYR", NULL, on_layer, &ctx);
+    fclose(in);
+    return ret < 0 ? -1 : 0;
+}
+
+// Add the decoded blocks of a job to the file blocks.
+static int add_job_blocks(codec_job_t *job, file_blocks_t *blocks)
+{
+    int i, ret = 0;
+    if (job->error) {
+        LOG_E("Cannot read %.4s chunk", job->type);
+        ret = -1;
+    } else {
+        for (i = 0; i < job->nb; i++) {
+            file_blocks_add(blocks,
+                            job->voxels + (size_t)i * BLOCK_VOXELS * 4);
+        }
     }
-    return hash;
+    codec_job_release(job);
+    return ret;
 }
 
 int load_from_file(const char *path)
 {
     layer_t *layer, *layer_tmp;
-    block_hash_t *blocks_table = NULL, *data, *data_tmp;
+    file_blocks_t blocks = {};
     FILE *in;
     char magic[4] = {};
-    uint8_t *voxel_data;
+    codec_pool_t pool = {};
+    codec_job_t job = {}, *job_ptr;
+    file_map_t *map = NULL;
     int nb_blocks;
-    int w, h, bpp;
-    uint8_t *png;
     chunk_t c;
     int i, index, version, x, y, z, material_idx;
     int  dict_value_size;
     char dict_key[256];
     char dict_value[256];
-    uint64_t uid = 1;
     camera_t *camera, *camera_tmp;
     material_t *mat, *mat_tmp;
 
@@ -506,28 +1375,57 @@ int load_from_file(const char *path)
 
     memset(&goxel.image->box, 0, sizeof(goxel.image->box));
 
+    // If we can map the file, the blocks of the BLKS chunks are only
+    // decoded when they are first used.
+    map = file_map_open(in);
+    codec_pool_init(&pool, decode_job);
     while (chunk_read_start(&c, in)) {
-        if (strncmp(c.type, "BL16", 4) == 0) {
-            png = calloc(1, c.length);
-            chunk_read(&c, in, (char*)png, c.length, __LINE__);
-            bpp = 4;
-            voxel_data = img_read_from_mem((void*)png, c.length, &w, &h, &bpp);
-            assert(w == 64 && h == 64 && bpp == 4);
-            data = calloc(1, sizeof(*data));
-            data->v = calloc(1, 64 * 64 * 4);
-            memcpy(data->v, voxel_data, 64 * 64 * 4);
-            data->uid = ++uid;
-            HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
-            free(voxel_data);
-            free(png);
+        if (map && strncmp(c.type, "BLKS", 4) == 0) {
+            while ((job_ptr = codec_pool_pop(&pool))) {
+                if (add_job_blocks(job_ptr, &blocks)) goto error;
+            }
+            if (file_blocks_add_lazy(&blocks, map, file_tell(in), c.length)) {
+                LOG_E("Cannot read BLKS chunk");
+                goto error;
+            }
+            chunk_read(&c, in, NULL, c.length, __LINE__);
+            chunk_read_finish(&c, in);
+            continue;
+        }
+        if (    strncmp(c.type, "BL16", 4) == 0 ||
+                strncmp(c.type, "BLKS", 4) == 0) {
+            // Decode the blocks in the background while we keep reading.
+            while (codec_pool_is_full(&pool)) {
+                if (add_job_blocks(codec_pool_pop(&pool), &blocks))
+                    goto error;
+            }
+            memcpy(job.type, c.type, 4);
+            job.data = calloc(1, c.length);
+            job.size = c.length;
+            chunk_read(&c, in, (char*)job.data, c.length, __LINE__);
+            if (!chunk_read_finish(&c, in)) {
+                free(job.data);
+                goto error;
+            }
+            codec_pool_push(&pool, &job);
+            memset(&job, 0, sizeof(job));
+            continue;
+        }
+        // All the other chunks might use the blocks.
+        while ((job_ptr = codec_pool_pop(&pool))) {
+            if (add_job_blocks(job_ptr, &blocks)) goto error;
+        }
 
-        } else if (strncmp(c.type, "LAYR", 4) == 0) {
+        if (strncmp(c.type, "LAYR", 4) == 0) {
             layer = image_add_layer(goxel.image, NULL);
             nb_blocks = chunk_read_int32(&c, in, __LINE__);
             assert(nb_blocks >= 0);
             for (i = 0; i < nb_blocks; i++) {
                 index = chunk_read_int32(&c, in, __LINE__);
-                assert(index >= 0);
+                if (index < 0 || index >= blocks.nb) {
+                    LOG_E("Invalid block index %d", index);
+                    goto error;
+                }
                 x = chunk_read_int32(&c, in, __LINE__);
                 y = chunk_read_int32(&c, in, __LINE__);
                 z = chunk_read_int32(&c, in, __LINE__);
@@ -535,9 +1433,8 @@ int load_from_file(const char *path)
                     x -= 8; y -= 8; z -= 8;
                 }
                 chunk_read_int32(&c, in, __LINE__);
-                data = hash_find_at(blocks_table, index);
-                assert(data);
-                mesh_blit(layer->mesh, data->v, x, y, z, 16, 16, 16, NULL);
+                file_blocks_copy(&blocks, index, layer->mesh,
+                                 (int[3]){x, y, z});
             }
             while ((chunk_read_dict_value(&c, in, dict_key, dict_value,
                                           &dict_value_size, __LINE__))) {
@@ -625,16 +1522,13 @@ int load_from_file(const char *path)
             // Ignore other blocks.
             chunk_read(&c, in, NULL, c.length, __LINE__);
         }
-        chunk_read_finish(&c, in);
+        if (!chunk_read_finish(&c, in)) goto error;
     }
 
-    // Free the block hash table.  We do not delete the block data because
-    // they have been used by the meshes.
-    HASH_ITER(hh, blocks_table, data, data_tmp) {
-        HASH_DEL(blocks_table, data);
-        free(data->v);
-        free(data);
-    }
+    codec_pool_release(&pool);
+    // The layers meshes keep a reference to the blocks data they use.
+    file_blocks_release(&blocks);
+    file_map_release(map);
 
     goxel.image->path = strdup(path);
     goxel.image->saved_key = image_get_key(goxel.image);
@@ -653,6 +1547,9 @@ int load_from_file(const char *path)
     return 0;
 
 error:
+    codec_pool_release(&pool);
+    file_blocks_release(&blocks);
+    file_map_release(map);
     fclose(in);
     return -1;
 }
@@ -664,6 +1561,7 @@ static void action_open(const char *path)
         path = noc_file_dialog_open(NOC_FILE_DIALOG_OPEN, "gox\0*.gox\0",
                                     NULL, NULL);
     if (!path) return;
+    journal_new_document();
     image_delete(goxel.image);
     goxel.image = image_new();
     load_from_file(path);
@@ -683,12 +1581,16 @@ static void save_as(const char *path, bool with_preview)
                                     NULL, "untitled.gox");
         if (!path) return;
     }
+    // If the save failed we keep the journal, so that the changes can
+    // still be recovered.
+    if (save_to_file(goxel.image, path, with_preview)) return;
     if (path != goxel.image->path) {
         free(goxel.image->path);
         goxel.image->path = strdup(path);
-        goxel.image->saved_key = image_get_key(goxel.image);
     }
-    save_to_file(goxel.image, goxel.image->path, with_preview);
+    goxel.image->saved_key = image_get_key(goxel.image);
+    // All the changes are in the file now.
+    journal_reset(goxel.image);
 }
 
 ACTION_REGISTER(save_as,
@@ -708,3 +1610,64 @@ ACTION_REGISTER(save,
     .csig = "vpi",
     .default_shortcut = "Ctrl S"
 )
+
+// Force the decoding of all the lazily loaded blocks of an image.
+static void image_load_all_blocks(const image_t *img)
+{
+    const layer_t *layer;
+    mesh_iterator_t iter;
+    int bpos[3];
+
+    DL_FOREACH(img->layers, layer) {
+        iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos))
+            mesh_get_block_data(layer->mesh, &iter, bpos, NULL);
+    }
+}
+
+// Compare the save and load time and the file size of the BL16 and BLKS
+// blocks chunks on the current image.  The load time includes the
+// decoding of all the blocks, even the ones loaded lazily.
+static void gox_benchmark(void)
+{
+    const char *names[] = {"BL16", "BLKS"};
+    char path[1024];
+    image_t *img = goxel.image;
+    float plane[4][4];
+    int i, snap_mask = goxel.snap_mask;
+    double t0, t1, t2;
+    int64_t size;
+    FILE *file;
+
+    mat4_copy(goxel.plane, plane);
+    snprintf(path, sizeof(path), "%s/benchmark.gox", sys_get_user_dir());
+    sys_make_dir(path);
+    for (i = 0; i < 2; i++) {
+        t0 = sys_get_time();
+        if (write_file(img, path, false, i == 0, NULL)) break;
+        t1 = sys_get_time();
+        goxel.image = image_new();
+        load_from_file(path);
+        image_load_all_blocks(goxel.image);
+        t2 = sys_get_time();
+        image_delete(goxel.image);
+        goxel.image = img;
+        file = fopen(path, "rb");
+        if (!file) break;
+        file_seek(file, 0, SEEK_END);
+        size = file_tell(file);
+        fclose(file);
+        LOG_I("%s: save %.3fs, load %.3fs, size %lld bytes",
+              names[i], t1 - t0, t2 - t1, (long long)size);
+    }
+    remove(path);
+    // Loading changes the plane and snap mask.
+    mat4_copy(plane, goxel.plane);
+    goxel.snap_mask = snap_mask;
+}
+
+ACTION_REGISTER(gox_benchmark,
+    .help = "Compare the gox blocks encodings speed and size",
+    .cfunc = gox_benchmark,
+    .csig = "v",
+)
@@ -17,15 +17,123 @@
  */
 
 #include "goxel.h"
+#include <zlib.h>
+
+// Minimal streaming png writer, so that we never need to keep the full
+// image in memory.
+typedef struct {
+    FILE        *file;
+    z_stream    z;
+    uint8_t     out[1 << 16];
+} png_writer_t;
+
+static void write_uint32_be(FILE *file, uint32_t v)
+{
+    uint8_t buf[4] = {v >> 24, v >> 16, v >> 8, v};
+    fwrite(buf, 4, 1, file);
+}
+
+static void png_write_chunk(FILE *file, const char *type,
+                            const uint8_t *data, int size)
+{
+    uint32_t crc;
+    write_uint32_be(file, size);
+    fwrite(type, 4, 1, file);
+    fwrite(data, size, 1, file);
+    crc = crc32(0, (const uint8_t*)type, 4);
+    crc = crc32(crc, data, size);
+    write_uint32_be(file, crc);
+}
+
+// Compress some data, and write the output as IDAT chunks.
+static void png_deflate(png_writer_t *png, const uint8_t *data, int size,
+                        int flush)
+{
+    int n;
+    png->z.next_in = (uint8_t*)data;
+    png->z.avail_in = size;
+    do {
+        png->z.next_out = png->out;
+        png->z.avail_out = sizeof(png->out);
+        deflate(&png->z, flush);
+        n = sizeof(png->out) - png->z.avail_out;
+        if (n) png_write_chunk(png->file, "IDAT", png->out, n);
+    } while (png->z.avail_out == 0);
+}
+
+static int png_begin(png_writer_t *png, const char *path, int w, int h)
+{
+    uint8_t header[13] = {
+        w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h,
+        8,  // Bit depth.
+        6,  // Color type RGBA.
+        0, 0, 0};
+    png->file = fopen(path, "wb");
+    if (!png->file) {
+        LOG_E("Cannot open %s", path);
+        return -1;
+    }
+    fwrite("\x89PNG\r\n\x1a\n", 8, 1, png->file);
+    png_write_chunk(png->file, "IHDR", header, sizeof(header));
+    memset(&png->z, 0, sizeof(png->z));
+    deflateInit(&png->z, Z_DEFAULT_COMPRESSION);
+    return 0;
+}
+
+static void png_write_row(png_writer_t *png, const uint8_t *row, int w)
+{
+    const uint8_t filter = 0;
+    png_deflate(png, &filter, 1, Z_NO_FLUSH);
+    png_deflate(png, row, w * 4, Z_NO_FLUSH);
+}
+
+static void png_end(png_writer_t *png)
+{
+    png_deflate(png, NULL, 0, Z_FINISH);
+    deflateEnd(&png->z);
+    png_write_chunk(png->file, "IEND", NULL, 0);
+    fclose(png->file);
+}
+
+/*
+ * Read one row of the slices image: all the voxels at a given y, with the
+ * z slices side by side.  The voxels are copied directly from the blocks.
+ */
+static void read_row(const mesh_t *mesh, mesh_accessor_t *acc,
+                     const int start[3], int w, int d, int y, uint8_t *row)
+{
+    const int N = BLOCK_SIZE;
+    const uint8_t *data;
+    int bpos[3], z, x0, x1;
+
+    memset(row, 0, w * d * 4);
+    bpos[1] = y & ~(N - 1);
+    for (bpos[2] = start[2] & ~(N - 1); bpos[2] < start[2] + d; bpos[2] += N)
+    for (bpos[0] = start[0] & ~(N - 1); bpos[0] < start[0] + w; bpos[0] += N)
+    {
+        data = mesh_get_block_data(mesh, acc, bpos, NULL);
+        if (!data) continue;
+        x0 = max(bpos[0], start[0]);
+        x1 = min(bpos[0] + N, start[0] + w);
+        for (z = max(bpos[2], start[2]);
+             z < min(bpos[2] + N, start[2] + d); z++)
+        {
+            memcpy(row + ((z - start[2]) * w + x0 - start[0]) * 4,
+                   data + (((z - bpos[2]) * N + y - bpos[1]) * N +
+                           x0 - bpos[0]) * 4,
+                   (x1 - x0) * 4);
+        }
+    }
+}
 
 static void export_as_png_slices(const char *path)
 {
     float box[4][4];
     const mesh_t *mesh;
-    int x, y, z, w, h, d, pos[3], start_pos[3];
-    uint8_t c[4];
-    uint8_t *img;
-    mesh_iterator_t iter = {0};
+    int y, w, h, d, start_pos[3];
+    uint8_t *row;
+    mesh_accessor_t acc;
+    png_writer_t *png;
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                    "png\0*.png\0", NULL, "untitled.png");
@@ -39,22 +147,21 @@ static void export_as_png_slices(const char *path)
     start_pos[0] = box[3][0] - box[0][0];
     start_pos[1] = box[3][1] - box[1][1];
     start_pos[2] = box[3][2] - box[2][2];
-    img = calloc(w * h * d, 4);
-    for (z = 0; z < d; z++)
-    for (y = 0; y < h; y++)
-    for (x = 0; x < w; x++) {
-        pos[0] = x + start_pos[0];
-        pos[1] = y + start_pos[1];
-        pos[2] = z + start_pos[2];
-        mesh_get_at(mesh, &iter, pos, c);
-        img[(y * w * d + z * w + x) * 4 + 0] = c[0];
-        img[(y * w * d + z * w + x) * 4 + 1] = c[1];
-        img[(y * w * d + z * w + x) * 4 + 2] = c[2];
-        img[(y * w * d + z * w + x) * 4 + 3] = c[3];
-    }
-    img_write(img, w * d, h, 4, path);
 
-    free(img);
+    // The image is written one row at a time, so we only keep a single
+    // row in memory.
+    png = calloc(1, sizeof(*png));
+    if (png_begin(png, path, w * d, h) == 0) {
+        row = malloc(w * d * 4);
+        acc = mesh_get_accessor(mesh);
+        for (y = 0; y < h; y++) {
+            read_row(mesh, &acc, start_pos, w, d, start_pos[1] + y, row);
+            png_write_row(png, row, w * d);
+        }
+        png_end(png);
+        free(row);
+    }
+    free(png);
 }
 
 ACTION_REGISTER(export_as_png_slices,
@@ -21,18 +21,88 @@
 #include "goxel.h"
 #include "utils/mustache.h"
 
+// Render the template section ('header' or 'footer') into a file.
+static void write_template(FILE *file, const char *template, mustache_t *m)
+{
+    int size;
+    char *buf;
+
+    size = mustache_render(m, template, NULL);
+    buf = calloc(size + 1, 1);
+    mustache_render(m, template, buf);
+    fwrite(buf, 1, size, file);
+    free(buf);
+}
+
+// Voxel at a position in a block read with a one voxel border.
+#define AT(data, x, y, z) \
+    (&(data)[(((z) + 1) * (N + 2) * (N + 2) + ((y) + 1) * (N + 2) + \
+              ((x) + 1)) * 4])
+
+static bool is_hidden(const uint8_t *data, int x, int y, int z)
+{
+    const int N = BLOCK_SIZE;
+    return AT(data, x - 1, y, z)[3] >= 127 &&
+           AT(data, x + 1, y, z)[3] >= 127 &&
+           AT(data, x, y - 1, z)[3] >= 127 &&
+           AT(data, x, y + 1, z)[3] >= 127 &&
+           AT(data, x, y, z - 1)[3] >= 127 &&
+           AT(data, x, y, z + 1)[3] >= 127;
+}
+
+/*
+ * Write the voxels of a mesh, one block at a time.
+ *
+ * Runs of voxels of the same color along x are merged into a single box,
+ * and the runs whose voxels are all surrounded by other voxels are
+ * skipped.
+ */
+static void write_voxels(FILE *file, const mesh_t *mesh)
+{
+    const int N = BLOCK_SIZE;
+    uint8_t *data;
+    const uint8_t *v, *v2;
+    int bpos[3], x, y, z, len;
+    bool visible;
+    mesh_iterator_t iter;
+
+    data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        mesh_read(mesh, (int[3]){bpos[0] - 1, bpos[1] - 1, bpos[2] - 1},
+                  (int[3]){N + 2, N + 2, N + 2}, data);
+        for (z = 0; z < N; z++)
+        for (y = 0; y < N; y++)
+        for (x = 0; x < N; x += len) {
+            len = 1;
+            v = AT(data, x, y, z);
+            if (v[3] < 127) continue;
+            visible = !is_hidden(data, x, y, z);
+            while (x + len < N) {
+                v2 = AT(data, x + len, y, z);
+                if (v2[3] < 127 || memcmp(v, v2, 3) != 0) break;
+                visible = visible || !is_hidden(data, x + len, y, z);
+                len++;
+            }
+            if (!visible) continue;
+            fprintf(file, "    Vox(<%d, %d, %d>, <%d, 1, 1>, <%d, %d, %d>)\n",
+                    bpos[0] + x, bpos[1] + y, bpos[2] + z, len,
+                    v[0], v[1], v[2]);
+        }
+    }
+    free(data);
+}
+
+#undef AT
+
 static void export_as_pov(const char *path, int w, int h)
 {
     FILE *file;
     layer_t *layer;
-    int size, p[3];
-    char *buf;
     const char *template;
-    uint8_t v[4];
     float modelview[4][4], light_dir[3];
-    mustache_t *m, *m_cam, *m_light, *m_voxels, *m_voxel;
+    mustache_t *m, *m_header, *m_cam, *m_light;
     camera_t camera = *goxel.image->active_camera;
-    mesh_iterator_t iter;
 
     w = w ?: goxel.image->export_width;
     h = h ?: goxel.image->export_height;
@@ -52,8 +122,9 @@ static void export_as_pov(const char *path, int w, int h)
     render_get_light_dir(&goxel.rend, light_dir);
 
     m = mustache_root();
-    mustache_add_str(m, "version", GOXEL_VERSION_STR);
-    m_cam = mustache_add_dict(m, "camera");
+    m_header = mustache_add_dict(m, "header");
+    mustache_add_str(m_header, "version", GOXEL_VERSION_STR);
+    m_cam = mustache_add_dict(m_header, "camera");
     mustache_add_str(m_cam, "width", "%d", w);
     mustache_add_str(m_cam, "height", "%d", h);
     mustache_add_str(m_cam, "angle", "%.1f", camera.fovy * camera.aspect);
@@ -63,35 +134,28 @@ static void export_as_pov(const char *path, int w, int h)
                      modelview[1][0], modelview[1][1], modelview[1][2],
                      modelview[2][0], modelview[2][1], modelview[2][2],
                      modelview[3][0], modelview[3][1], modelview[3][2]);
-    m_light = mustache_add_dict(m, "light");
+    m_light = mustache_add_dict(m_header, "light");
     mustache_add_str(m_light, "ambient", "%.2f",
                      goxel.rend.settings.ambient);
     mustache_add_str(m_light, "point_at", "<%.1f, %.1f, %.1f + 1024>",
                      -light_dir[0], -light_dir[1], -light_dir[2]);
 
-    m_voxels = mustache_add_list(m, "voxels");
+    file = fopen(path, "wb");
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
+    write_template(file, template, m);
+    mustache_free(m);
+
+    // The voxels are streamed directly to the file between the template
+    // header and footer.
     DL_FOREACH(goxel.image->layers, layer) {
-        iter = mesh_get_iterator(layer->mesh, MESH_ITER_VOXELS);
-        while (mesh_iter(&iter, p)) {
-            mesh_get_at(layer->mesh, &iter, p, v);
-            if (v[3] < 127) continue;
-            m_voxel = mustache_add_dict(m_voxels, NULL);
-            mustache_add_str(m_voxel, "pos", "<%d, %d, %d>",
-                             p[0], p[1], p[2]);
-            mustache_add_str(m_voxel, "color", "<%d, %d, %d>",
-                             v[0], v[1], v[2]);
-        }
+        write_voxels(file, layer->mesh);
     }
 
-    size = mustache_render(m, template, NULL);
-    buf = calloc(size + 1, 1);
-    mustache_render(m, template, buf);
+    m = mustache_root();
+    mustache_add_dict(m, "footer");
+    write_template(file, template, m);
     mustache_free(m);
-
-    file = fopen(path, "wb");
-    fwrite(buf, 1, size, file);
     fclose(file);
-    free(buf);
 }
 
 ACTION_REGISTER(export_as_pov,
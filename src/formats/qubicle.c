@@ -35,11 +35,29 @@ static void apply_orientation(int orientation, int pos[3])
     }
 }
 
+#define CODEFLAG 2
+#define NEXTSLICEFLAG 6
+
+// Return the box of the voxels inside a file matrix, after orientation.
+static void get_matrix_aabb(int orientation, const int pos[3],
+                            int w, int h, int d, int aabb[2][3])
+{
+    int i, a[3] = {pos[0], pos[1], pos[2]};
+    int b[3] = {pos[0] + w - 1, pos[1] + h - 1, pos[2] + d - 1};
+    apply_orientation(orientation, a);
+    apply_orientation(orientation, b);
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] = min(a[i], b[i]);
+        aabb[1][i] = max(a[i], b[i]) + 1;
+    }
+}
+
 static void qubicle_import(const char *path)
 {
     FILE *file;
     int version, color_format, orientation, compression, vmask, mat_count;
-    int i, j, r, index, len, w, h, d, pos[3], vpos[3], x, y, z, bbox[2][3];
+    int i, r, index, len, n, w, h, d, pos[3], vpos[3], z, bbox[2][3];
+    int aabb[2][3];
     union {
         uint8_t v[4];
         uint32_t uint32;
@@ -47,10 +65,8 @@ static void qubicle_import(const char *path)
             uint8_t r, g, b, a;
         };
     } v;
-    const uint32_t CODEFLAG = 2;
-    const uint32_t NEXTSLICEFLAG = 6;
     layer_t *layer;
-    mesh_iterator_t iter = {0};
+    mesh_sink_t *sink;
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_OPEN,
                                         NULL, NULL, NULL);
@@ -69,7 +85,6 @@ static void qubicle_import(const char *path)
 
     for (i = 0; i < mat_count; i++) {
         layer = image_add_layer(goxel.image, NULL);
-        iter = mesh_get_accessor(layer->mesh);
         memset(layer->name, 0, sizeof(layer->name));
         len = READ(uint8_t, file);
         r = (int)fread(layer->name, len, 1, file);
@@ -88,21 +103,27 @@ static void qubicle_import(const char *path)
         apply_orientation(orientation, bbox[1]);
         bbox_from_aabb(layer->box, bbox);
 
+        // All the voxels of the matrix are set, including the transparent
+        // ones, so that the sink can write each block as soon as it is
+        // complete.
+        get_matrix_aabb(orientation, pos, w, h, d, aabb);
+        sink = mesh_sink_new(layer->mesh, aabb);
+
         if (compression == 0) {
             for (index = 0; index < w * h * d; index++) {
                 v.uint32 = READ(uint32_t, file);
-                if (!v.a) continue;
+                if (!v.a) v.uint32 = 0;
                 v.a = v.a ? 255 : 0;
                 vpos[0] = pos[0] + index % w;
                 vpos[1] = pos[1] + (index % (w * h)) / w;
                 vpos[2] = pos[2] + index / (w * h);
                 apply_orientation(orientation, vpos);
-                mesh_set_at(layer->mesh, &iter, vpos, v.v);
+                mesh_sink_set(sink, vpos, v.v);
             }
         } else {
             for (z = 0; z < d; z++) {
                 index = 0;
-                while (true) {
+                while (!feof(file)) {
                     v.uint32 = READ(uint32_t, file);
                     if (v.uint32 == NEXTSLICEFLAG) {
                         break; // Next z.
@@ -111,53 +132,103 @@ static void qubicle_import(const char *path)
                     if (v.uint32 == CODEFLAG) {
                         len = READ(uint32_t, file);
                         v.uint32 = READ(uint32_t, file);
-                        v.a = v.a ? 255 : 0;
                     }
-                    for (j = 0; j < len; j++) {
-                        x = index % w;
-                        y = index / w;
-                        v.a = v.a ? 255 : 0;
-                        vpos[0] = pos[0] + x;
-                        vpos[1] = pos[1] + y;
+                    if (!v.a) v.uint32 = 0;
+                    v.a = v.a ? 255 : 0;
+                    len = min(len, w * h - index);
+                    // Split the run at the end of each row.
+                    while (len > 0) {
+                        n = min(len, w - index % w);
+                        vpos[0] = pos[0] + index % w;
+                        vpos[1] = pos[1] + index / w;
                         vpos[2] = pos[2] + z;
                         apply_orientation(orientation, vpos);
-                        mesh_set_at(layer->mesh, &iter, vpos, v.v);
-                        index++;
+                        mesh_sink_set_span(sink, vpos, 0, n, v.v);
+                        index += n;
+                        len -= n;
                     }
                 }
             }
         }
+        mesh_sink_delete(sink);
+    }
+    fclose(file);
+}
+
+// Read a row of voxels along x, one block at a time.
+static void read_row(const mesh_t *mesh, mesh_accessor_t *acc,
+                     int x, int y, int z, int w, uint8_t *out)
+{
+    int bpos[3], i, n;
+    const uint8_t *data;
+
+    while (w > 0) {
+        bpos[0] = x & ~(BLOCK_SIZE - 1);
+        bpos[1] = y & ~(BLOCK_SIZE - 1);
+        bpos[2] = z & ~(BLOCK_SIZE - 1);
+        n = min(w, bpos[0] + BLOCK_SIZE - x);
+        data = mesh_get_block_data(mesh, acc, bpos, NULL);
+        if (data) {
+            i = (x - bpos[0]) + (y - bpos[1]) * BLOCK_SIZE +
+                (z - bpos[2]) * BLOCK_SIZE * BLOCK_SIZE;
+            memcpy(out, data + i * 4, n * 4);
+        } else {
+            memset(out, 0, n * 4);
+        }
+        out += n * 4;
+        x += n;
+        w -= n;
+    }
+}
+
+static void write_run(FILE *file, uint32_t v, int len)
+{
+    int i;
+    if (len > 2) {
+        WRITE(uint32_t, CODEFLAG, file);
+        WRITE(uint32_t, len, file);
+        WRITE(uint32_t, v, file);
+        return;
+    }
+    for (i = 0; i < len; i++) WRITE(uint32_t, v, file);
+}
+
+static bool get_layer_aabb(const layer_t *layer, int aabb[2][3])
+{
+    if (!box_is_null(layer->box)) {
+        bbox_to_aabb(layer->box, aabb);
+        return true;
     }
+    return mesh_get_bbox(layer->mesh, aabb, true);
 }
 
 static void qubicle_export(const image_t *img, const char *path)
 {
     FILE *file;
-    int i, count, x, y, z, pos[3], bbox[2][3];
-    uint8_t v[4];
+    int count, x, y, z, len, w, bbox[2][3];
+    uint32_t v, run;
+    uint8_t *row;
     layer_t *layer;
-    mesh_iterator_t iter;
+    mesh_accessor_t acc;
     mesh_t *mesh;
 
     count = 0;
-    DL_COUNT(img->layers, layer, count);
+    DL_FOREACH(img->layers, layer) {
+        if (get_layer_aabb(layer, bbox)) count++;
+    }
 
     file = fopen(path, "wb");
+    setvbuf(file, NULL, _IOFBF, 1 << 16);
     WRITE(uint32_t, 257, file); // version
     WRITE(uint32_t, 0, file);   // color format RGBA
     WRITE(uint32_t, 1, file);   // orientation right handed
-    WRITE(uint32_t, 0, file);   // no compression
+    WRITE(uint32_t, 1, file);   // RLE compression
     WRITE(uint32_t, 0, file);   // vmask
     WRITE(uint32_t, count, file);
 
-    i = 0;
     DL_FOREACH(img->layers, layer) {
         mesh = layer->mesh;
-
-        if (!box_is_null(layer->box))
-            bbox_to_aabb(layer->box, bbox);
-        else
-            if (!mesh_get_bbox(mesh, bbox, true)) continue;
+        if (!get_layer_aabb(layer, bbox)) continue;
 
         WRITE(uint8_t, strlen(layer->name), file);
         fwrite(layer->name, strlen(layer->name), 1, file);
@@ -167,17 +238,32 @@ static void qubicle_export(const image_t *img, const char *path)
         WRITE(int32_t, bbox[0][0], file);
         WRITE(int32_t, bbox[0][2], file);
         WRITE(int32_t, bbox[0][1], file);
-        iter = mesh_get_accessor(mesh);
-        for (y = bbox[0][1]; y < bbox[1][1]; y++)
-        for (z = bbox[0][2]; z < bbox[1][2]; z++)
-        for (x = bbox[0][0]; x < bbox[1][0]; x++) {
-            pos[0] = x;
-            pos[1] = y;
-            pos[2] = z;
-            mesh_get_at(mesh, &iter, pos, v);
-            fwrite(v, 4, 1, file);
+
+        w = bbox[1][0] - bbox[0][0];
+        row = malloc(w * 4);
+        acc = mesh_get_accessor(mesh);
+        // Each slice is run length encoded, the runs can span several rows.
+        for (y = bbox[0][1]; y < bbox[1][1]; y++) {
+            run = 0;
+            len = 0;
+            for (z = bbox[0][2]; z < bbox[1][2]; z++) {
+                read_row(mesh, &acc, bbox[0][0], y, z, w, row);
+                for (x = 0; x < w; x++) {
+                    memcpy(&v, row + x * 4, 4);
+                    if (!row[x * 4 + 3]) v = 0;
+                    if (len && v == run) {
+                        len++;
+                        continue;
+                    }
+                    write_run(file, run, len);
+                    run = v;
+                    len = 1;
+                }
+            }
+            write_run(file, run, len);
+            WRITE(uint32_t, NEXTSLICEFLAG, file);
         }
-        i++;
+        free(row);
     }
     fclose(file);
 }
@@ -42,22 +42,20 @@ static inline void hexcolor(uint32_t v, uint8_t out[4])
 static void vox_import_old(const char *path)
 {
     FILE *file;
-    int w, h, d, i;
-    uint8_t *voxels;
+    int w, h, d, i, x, y, z;
+    uint8_t v;
     uint8_t (*palette)[4];
-    uint8_t (*cube)[4];
+    mesh_sink_t *sink;
 
     file = fopen(path, "rb");
     d = READ(uint32_t, file);
     h = READ(uint32_t, file);
     w = READ(uint32_t, file);
 
-    voxels = calloc(w * h * d, 1);
+    // Read the palette first, so that we can directly put the voxels into
+    // the mesh.
     palette = calloc(256, sizeof(*palette));
-    cube = calloc(w * h * d, sizeof(*cube));
-    for (i = 0; i < w * h * d; i++) {
-        voxels[i] = READ(uint8_t, file);
-    }
+    fseek(file, 12 + (long)w * h * d, SEEK_SET);
     for (i = 0; i < 256; i++) {
         palette[i][0] = READ(uint8_t, file);
         palette[i][1] = READ(uint8_t, file);
@@ -66,42 +64,205 @@ static void vox_import_old(const char *path)
     }
     memset(palette[255], 0, 4);
 
-    for (i = 0; i < w * h * d; i++) {
-        if (voxels[i] == 255) continue;
-        memcpy(cube[i], palette[voxels[i]], 4);
+    fseek(file, 12, SEEK_SET);
+    sink = mesh_sink_new(goxel.image->active_layer->mesh, (int[2][3]){
+            {-w / 2, -h / 2, -d / 2}, {-w / 2 + w, -h / 2 + h, -d / 2 + d}});
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+        v = READ(uint8_t, file);
+        mesh_sink_set(sink, (int[3]){-w / 2 + x, -h / 2 + y, -d / 2 + z},
+                      palette[v]);
     }
-
-    mesh_blit(goxel.image->active_layer->mesh, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+    mesh_sink_delete(sink);
     free(palette);
-    free(voxels);
-    free(cube);
     fclose(file);
 }
 
+// Maximum size of a model along each axis.
+#define VOX_MAX_SIZE 256
+
+enum {
+    NODE_TRN = 1,
+    NODE_GRP,
+    NODE_SHP,
+};
+
+// A node of the scene graph.  For transform nodes the only child is the
+// transformed node, for shape nodes the children are the models indices.
 typedef struct {
-    int         w, h, d;
-    uint8_t     (*palette)[4];
+    UT_hash_handle  hh;
+    int             id;
+    int             type;
+    char            name[256];
+    bool            hidden;
+    int             rot[3][3];
+    int             t[3];
+    int             nb_children;
+    int             *children;
+} vox_node_t;
+
+typedef struct {
+    int         size[3];
     int         nb;
-    uint8_t     *voxels;
+    uint8_t     *voxels;    // XYZI values.
+} vox_model_t;
+
+// A model placed in the scene, with its world transformation.
+typedef struct {
+    int         model;
+    int         rot[3][3];
+    int         t[3];
+    char        name[256];
+    bool        hidden;
+} vox_instance_t;
+
+typedef struct {
+    uint8_t         (*palette)[4];
+    int             nb_models;
+    vox_model_t     *models;
+    vox_node_t      *nodes;
+    int             nb_instances;
+    vox_instance_t  *instances;
 } context_t;
 
+// Bounds checked reader used to parse the scene graph chunks.
+typedef struct {
+    const uint8_t   *data;
+    int             size;
+    int             pos;
+    bool            error;
+} reader_t;
+
+static int32_t rd_int32(reader_t *r)
+{
+    int32_t v;
+    if (r->pos + 4 > r->size) {
+        r->error = true;
+        return 0;
+    }
+    memcpy(&v, r->data + r->pos, 4);
+    r->pos += 4;
+    return v;
+}
+
+static void rd_string(reader_t *r, char *out, int out_size)
+{
+    int len = rd_int32(r);
+    if (len < 0 || len > r->size - r->pos) {
+        r->error = true;
+        len = 0;
+    }
+    snprintf(out, out_size, "%.*s", len, r->data + r->pos);
+    r->pos += len;
+}
+
+// Decode a packed rotation: bits 0-1 and 2-3 are the column of the non zero
+// entry of the first and second rows, and bits 4-6 their signs.
+static void get_rotation(int v, int rot[3][3])
+{
+    int c0 = v & 3, c1 = (v >> 2) & 3, c2 = 3 - c0 - c1;
+    memset(rot, 0, 9 * sizeof(int));
+    if (c0 > 2 || c1 > 2 || c0 == c1) {
+        rot[0][0] = rot[1][1] = rot[2][2] = 1;
+        return;
+    }
+    rot[0][c0] = (v & (1 << 4)) ? -1 : 1;
+    rot[1][c1] = (v & (1 << 5)) ? -1 : 1;
+    rot[2][c2] = (v & (1 << 6)) ? -1 : 1;
+}
+
+// Read a dictionary, storing the attributes we know about into the node.
+static void read_dict(reader_t *r, vox_node_t *node)
+{
+    int i, nb;
+    char key[256], value[256];
+
+    nb = rd_int32(r);
+    for (i = 0; i < nb && !r->error; i++) {
+        rd_string(r, key, sizeof(key));
+        rd_string(r, value, sizeof(value));
+        if (!node) continue;
+        if (strcmp(key, "_name") == 0)
+            snprintf(node->name, sizeof(node->name), "%s", value);
+        if (strcmp(key, "_hidden") == 0)
+            node->hidden = value[0] == '1';
+        if (strcmp(key, "_r") == 0)
+            get_rotation(atoi(value), node->rot);
+        if (strcmp(key, "_t") == 0)
+            sscanf(value, "%d %d %d", &node->t[0], &node->t[1], &node->t[2]);
+    }
+}
+
+static void read_node(context_t *ctx, const char *id,
+                      const uint8_t *data, int size)
+{
+    reader_t r = {data, size};
+    vox_node_t *node, *other;
+    int i, nb;
+
+    node = calloc(1, sizeof(*node));
+    node->rot[0][0] = node->rot[1][1] = node->rot[2][2] = 1;
+    node->id = rd_int32(&r);
+    read_dict(&r, node);
+
+    if (strncmp(id, "nTRN", 4) == 0) {
+        node->type = NODE_TRN;
+        node->nb_children = 1;
+        node->children = calloc(1, sizeof(int));
+        node->children[0] = rd_int32(&r);
+        rd_int32(&r); // Reserved.
+        rd_int32(&r); // Layer id.
+        nb = rd_int32(&r);
+        // We only use the first frame.
+        for (i = 0; i < nb && !r.error; i++)
+            read_dict(&r, i == 0 ? node : NULL);
+    } else {
+        node->type = strncmp(id, "nGRP", 4) == 0 ? NODE_GRP : NODE_SHP;
+        nb = rd_int32(&r);
+        if (nb < 0 || nb > (size - r.pos) / 4) r.error = true;
+        if (!r.error) {
+            node->nb_children = nb;
+            node->children = calloc(nb, sizeof(int));
+        }
+        for (i = 0; i < node->nb_children && !r.error; i++) {
+            node->children[i] = rd_int32(&r);
+            if (node->type == NODE_SHP) read_dict(&r, NULL);
+        }
+    }
+
+    HASH_FIND_INT(ctx->nodes, &node->id, other);
+    if (r.error || other) {
+        LOG_W("Invalid %.4s chunk", id);
+        free(node->children);
+        free(node);
+        return;
+    }
+    HASH_ADD_INT(ctx->nodes, id, node);
+}
+
 static void read_chunk(FILE *file, context_t *ctx)
 {
     char id[4], r;
-    int size, children_size, i;
+    int size, children_size, i, nb;
     long fpos;
+    vox_model_t *model;
+    uint8_t *data;
 
     r = fread(id, 1, 4, file);
     (void)r;
     size = READ(uint32_t, file);
     children_size = READ(uint32_t, file);
+    fpos = ftell(file);
 
     if (strncmp(id, "SIZE", 4) == 0) {
         assert(size == 4 * 3);
-        ctx->w = READ(uint32_t, file);
-        ctx->h = READ(uint32_t, file);
-        ctx->d = READ(uint32_t, file);
+        ctx->models = realloc(ctx->models,
+                              (ctx->nb_models + 1) * sizeof(*ctx->models));
+        model = &ctx->models[ctx->nb_models++];
+        memset(model, 0, sizeof(*model));
+        for (i = 0; i < 3; i++)
+            model->size[i] = READ(uint32_t, file);
     } else if (strncmp(id, "RGBA", 4) == 0) {
         ctx->palette = malloc(4 * 256);
         for (i = 1; i < 256; i++) {
@@ -112,41 +273,143 @@ static void read_chunk(FILE *file, context_t *ctx)
         }
         // Skip the last value!
         for (i = 0; i < 4; i++) READ(uint8_t, file);
-    } else if (strncmp(id, "XYZI", 4) == 0) {
-        ctx->nb = READ(uint32_t, file);
-        ctx->voxels = calloc(ctx->nb, 4);
-        for (i = 0; i < ctx->nb; i++) {
-            ctx->voxels[i * 4 + 0] = READ(uint8_t, file);
-            ctx->voxels[i * 4 + 1] = READ(uint8_t, file);
-            ctx->voxels[i * 4 + 2] = READ(uint8_t, file);
-            ctx->voxels[i * 4 + 3] = READ(uint8_t, file);
-        }
-
-    } else {
-        fseek(file, size, SEEK_CUR);
+    } else if (strncmp(id, "XYZI", 4) == 0 && ctx->nb_models &&
+               !ctx->models[ctx->nb_models - 1].voxels) {
+        // The voxels of the model defined by the previous SIZE chunk.
+        model = &ctx->models[ctx->nb_models - 1];
+        nb = READ(uint32_t, file);
+        nb = clamp(nb, 0, (size - 4) / 4);
+        model->voxels = calloc(max(nb, 1), 4);
+        model->nb = fread(model->voxels, 4, nb, file);
+    } else if (    strncmp(id, "nTRN", 4) == 0 ||
+                   strncmp(id, "nGRP", 4) == 0 ||
+                   strncmp(id, "nSHP", 4) == 0) {
+        data = malloc(size);
+        if (fread(data, size, 1, file) == 1)
+            read_node(ctx, id, data, size);
+        free(data);
     }
+    fseek(file, fpos + size, SEEK_SET);
 
     fpos = ftell(file);
-    while (ftell(file) < fpos + children_size) {
+    while (!feof(file) && ftell(file) < fpos + children_size) {
         read_chunk(file, ctx);
     }
 }
 
+static void add_instance(context_t *ctx, int model, const int rot[3][3],
+                         const int t[3], const char *name, bool hidden)
+{
+    vox_instance_t *inst;
+    ctx->instances = realloc(ctx->instances,
+                    (ctx->nb_instances + 1) * sizeof(*ctx->instances));
+    inst = &ctx->instances[ctx->nb_instances++];
+    memset(inst, 0, sizeof(*inst));
+    inst->model = model;
+    memcpy(inst->rot, rot, sizeof(inst->rot));
+    memcpy(inst->t, t, sizeof(inst->t));
+    snprintf(inst->name, sizeof(inst->name), "%s", name ?: "");
+    inst->hidden = hidden;
+}
+
+// Walk the scene graph, composing the transformations down to the shapes.
+static void visit_node(context_t *ctx, int id, const int rot[3][3],
+                       const int t[3], const char *name, bool hidden,
+                       int depth)
+{
+    vox_node_t *node;
+    int i, j, k, m, rot2[3][3], t2[3];
+
+    HASH_FIND_INT(ctx->nodes, &id, node);
+    if (!node || depth > 64) return;
+    hidden = hidden || node->hidden;
+    if (node->name[0]) name = node->name;
+
+    switch (node->type) {
+    case NODE_TRN:
+        for (i = 0; i < 3; i++) {
+            t2[i] = t[i];
+            for (j = 0; j < 3; j++) {
+                t2[i] += rot[i][j] * node->t[j];
+                rot2[i][j] = 0;
+                for (k = 0; k < 3; k++)
+                    rot2[i][j] += rot[i][k] * node->rot[k][j];
+            }
+        }
+        visit_node(ctx, node->children[0], rot2, t2, name, hidden, depth + 1);
+        break;
+    case NODE_GRP:
+        for (i = 0; i < node->nb_children; i++)
+            visit_node(ctx, node->children[i], rot, t, name, hidden,
+                       depth + 1);
+        break;
+    case NODE_SHP:
+        for (i = 0; i < node->nb_children; i++) {
+            m = node->children[i];
+            if (m < 0 || m >= ctx->nb_models || !ctx->models[m].voxels)
+                continue;
+            add_instance(ctx, m, rot, t, name, hidden);
+        }
+        break;
+    }
+}
+
+// Put the voxels of a model instance into a mesh.  The model is centered
+// on its translation, as in magica voxel.
+static void import_instance(const context_t *ctx, const vox_instance_t *inst,
+                            mesh_t *mesh)
+{
+    const vox_model_t *model = &ctx->models[inst->model];
+    int i, j, k, c, p[3], pos[3], corners[2][3], aabb[2][3];
+    uint8_t color[4];
+    mesh_sink_t *sink;
+
+    for (i = 0; i < 3; i++) {
+        corners[0][i] = -model->size[i] / 2;
+        corners[1][i] = model->size[i] - 1 - model->size[i] / 2;
+        aabb[0][i] = inst->t[i];
+        aabb[1][i] = inst->t[i] + 1;
+        for (j = 0; j < 3; j++) {
+            k = inst->rot[i][j] > 0 ? 0 : 1;
+            aabb[0][i] += inst->rot[i][j] * corners[k][j];
+            aabb[1][i] += inst->rot[i][j] * corners[1 - k][j];
+        }
+    }
+
+    sink = mesh_sink_new(mesh, aabb);
+    for (i = 0; i < model->nb; i++) {
+        c = model->voxels[i * 4 + 3];
+        if (!c) continue; // Not sure what c == 0 means.
+        for (j = 0; j < 3; j++)
+            p[j] = model->voxels[i * 4 + j] - model->size[j] / 2;
+        for (j = 0; j < 3; j++) {
+            pos[j] = inst->t[j];
+            for (k = 0; k < 3; k++) pos[j] += inst->rot[j][k] * p[k];
+        }
+        if (ctx->palette)
+            memcpy(color, ctx->palette[c], 4);
+        else
+            hexcolor(VOX_DEFAULT_PALETTE[c], color);
+        mesh_sink_set(sink, pos, color);
+    }
+    mesh_sink_delete(sink);
+}
+
 static void vox_import(const char *path)
 {
     FILE *file;
     char magic[4];
-    int version, r, i, x, y, z, c, pos[3];
-    mesh_t      *mesh;
-    mesh_iterator_t iter = {0};
-    uint8_t color[4];
+    int version, r, i;
+    const int identity[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    const vox_instance_t *inst;
+    layer_t *layer;
+    vox_node_t *node, *node_tmp;
     context_t ctx = {};
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_OPEN, "vox\0*.vox\0",
                                         NULL, NULL);
     if (!path) return;
 
-    mesh = goxel.image->active_layer->mesh;
     file = fopen(path, "rb");
     r = fread(magic, 1, 4, file);
     (void)r;
@@ -160,26 +423,45 @@ static void vox_import(const char *path)
     version = READ(uint32_t, file);
     (void)version;
     read_chunk(file, &ctx);
+    fclose(file);
 
-    assert(ctx.voxels);
-    for (i = 0; i < ctx.nb; i++) {
-        x = ctx.voxels[i * 4 + 0];
-        y = ctx.voxels[i * 4 + 1];
-        z = ctx.voxels[i * 4 + 2];
-        c = ctx.voxels[i * 4 + 3];
-        pos[0] = x - ctx.w / 2;
-        pos[1] = y - ctx.h / 2;
-        pos[2] = z;
-        if (!c) continue; // Not sure what c == 0 means.
-        if (ctx.palette)
-            memcpy(color, ctx.palette[c], 4);
-        else
-            hexcolor(VOX_DEFAULT_PALETTE[c], color);
-        mesh_set_at(mesh, &iter, pos, color);
+    if (ctx.nodes) {
+        visit_node(&ctx, 0, identity, (int[3]){}, NULL, false, 0);
+    } else {
+        // No scene graph: keep the models bottom on the z = 0 plane.
+        for (i = 0; i < ctx.nb_models; i++) {
+            if (!ctx.models[i].voxels) continue;
+            add_instance(&ctx, i, identity,
+                         (int[3]){0, 0, ctx.models[i].size[2] / 2},
+                         NULL, false);
+        }
+    }
+
+    // A single model goes into the current layer, otherwise we create
+    // one layer per model instance.
+    for (i = 0; i < ctx.nb_instances; i++) {
+        inst = &ctx.instances[i];
+        if (ctx.nb_instances == 1) {
+            import_instance(&ctx, inst, goxel.image->active_layer->mesh);
+            continue;
+        }
+        layer = image_add_layer(goxel.image, NULL);
+        if (inst->name[0])
+            snprintf(layer->name, sizeof(layer->name), "%s", inst->name);
+        layer->visible = !inst->hidden;
+        import_instance(&ctx, inst, layer->mesh);
+        layer_touch(layer);
     }
-    free(ctx.voxels);
+
+    HASH_ITER(hh, ctx.nodes, node, node_tmp) {
+        HASH_DEL(ctx.nodes, node);
+        free(node->children);
+        free(node);
+    }
+    for (i = 0; i < ctx.nb_models; i++) free(ctx.models[i].voxels);
+    free(ctx.models);
+    free(ctx.instances);
     free(ctx.palette);
-    mesh_remove_empty_blocks(mesh, false);
 }
 
 static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
@@ -201,6 +483,27 @@ static int get_color_index(uint8_t v[4], uint8_t (*palette)[4], bool exact)
     return best;
 }
 
+// Cache of the palette index of each distinct color of the image, so that
+// we only search the palette once per color.
+typedef struct {
+    UT_hash_handle  hh;
+    uint8_t         color[3];
+    int             index;
+} color_index_t;
+
+static color_index_t *get_color_entry(color_index_t **cache,
+                                      const uint8_t v[4])
+{
+    color_index_t *entry;
+    HASH_FIND(hh, *cache, v, 3, entry);
+    if (entry) return entry;
+    entry = calloc(1, sizeof(*entry));
+    memcpy(entry->color, v, 3);
+    entry->index = -1;
+    HASH_ADD(hh, *cache, color, 3, entry);
+    return entry;
+}
+
 static int voxel_cmp(const void *a_, const void *b_)
 {
     const uint8_t *a = a_;
@@ -211,102 +514,296 @@ static int voxel_cmp(const void *a_, const void *b_)
     return 0;
 }
 
-static void vox_export(const mesh_t *mesh, const char *path)
+// A part of a layer that fits into a single model.
+typedef struct vox_tile vox_tile_t;
+struct vox_tile {
+    UT_hash_handle  hh;
+    vox_tile_t      *next;
+    int             pos[3];     // Tile index.
+    int             origin[3];  // Position of the model first voxel.
+    int             size[3];
+    int             nb;
+    int             capacity;
+    uint8_t         *voxels;    // XYZI values.
+    const layer_t   *layer;
+};
+
+// Growable memory buffer, so that we can patch the chunks size once they
+// are known.
+typedef struct {
+    uint8_t *data;
+    int     size;
+    int     capacity;
+} buf_t;
+
+static void buf_write(buf_t *buf, const void *data, int size)
+{
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = max(max(buf->capacity * 2, buf->size + size), 1024);
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void buf_int32(buf_t *buf, int32_t v)
+{
+    buf_write(buf, &v, 4);
+}
+
+static void buf_string(buf_t *buf, const char *str)
+{
+    buf_int32(buf, strlen(str));
+    buf_write(buf, str, strlen(str));
+}
+
+// Start a new chunk, and return its offset to pass to chunk_end.
+static int chunk_start(buf_t *buf, const char *id)
+{
+    int ofs = buf->size;
+    buf_write(buf, id, 4);
+    buf_int32(buf, 0); // Content size, set by chunk_end.
+    buf_int32(buf, 0); // Children size.
+    return ofs;
+}
+
+static void chunk_end(buf_t *buf, int ofs)
+{
+    int32_t size = buf->size - ofs - 12;
+    memcpy(buf->data + ofs + 4, &size, 4);
+}
+
+static void write_models(buf_t *buf, vox_tile_t *tiles)
+{
+    vox_tile_t *tile;
+    int ofs, i;
+
+    LL_FOREACH(tiles, tile) {
+        ofs = chunk_start(buf, "SIZE");
+        for (i = 0; i < 3; i++) buf_int32(buf, tile->size[i]);
+        chunk_end(buf, ofs);
+        ofs = chunk_start(buf, "XYZI");
+        buf_int32(buf, tile->nb);
+        qsort(tile->voxels, tile->nb, 4, voxel_cmp);
+        buf_write(buf, tile->voxels, tile->nb * 4);
+        chunk_end(buf, ofs);
+    }
+}
+
+// Write the scene graph: a root transform and group, with one transform and
+// shape node per model.
+static void write_nodes(buf_t *buf, vox_tile_t *tiles)
+{
+    vox_tile_t *tile;
+    int ofs, i = 0, nb;
+    char translation[64];
+
+    LL_COUNT(tiles, tile, nb);
+    ofs = chunk_start(buf, "nTRN");
+    buf_int32(buf, 0);          // Node id.
+    buf_int32(buf, 0);          // Attributes.
+    buf_int32(buf, 1);          // Child node.
+    buf_int32(buf, -1);         // Reserved.
+    buf_int32(buf, -1);         // Layer.
+    buf_int32(buf, 1);          // Frames.
+    buf_int32(buf, 0);
+    chunk_end(buf, ofs);
+
+    ofs = chunk_start(buf, "nGRP");
+    buf_int32(buf, 1);
+    buf_int32(buf, 0);
+    buf_int32(buf, nb);
+    for (i = 0; i < nb; i++) buf_int32(buf, 2 + i * 2);
+    chunk_end(buf, ofs);
+
+    LL_FOREACH(tiles, tile) {
+        ofs = chunk_start(buf, "nTRN");
+        buf_int32(buf, 2 + i * 2);
+        buf_int32(buf, 1);
+        buf_string(buf, "_name");
+        buf_string(buf, tile->layer->name);
+        buf_int32(buf, 3 + i * 2);
+        buf_int32(buf, -1);
+        buf_int32(buf, 0);
+        buf_int32(buf, 1);
+        buf_int32(buf, 1);
+        buf_string(buf, "_t");
+        snprintf(translation, sizeof(translation), "%d %d %d",
+                 tile->origin[0] + tile->size[0] / 2,
+                 tile->origin[1] + tile->size[1] / 2,
+                 tile->origin[2] + tile->size[2] / 2);
+        buf_string(buf, translation);
+        chunk_end(buf, ofs);
+
+        ofs = chunk_start(buf, "nSHP");
+        buf_int32(buf, 3 + i * 2);
+        buf_int32(buf, 0);
+        buf_int32(buf, 1);      // Models.
+        buf_int32(buf, i);
+        buf_int32(buf, 0);
+        chunk_end(buf, ofs);
+        i++;
+    }
+}
+
+// Call a function for all the visible voxels of a layer, reading the mesh
+// one block at a time.
+static void iter_layer_voxels(const layer_t *layer,
+                              void (*f)(const int pos[3], const uint8_t v[4],
+                                        void *user),
+                              void *user)
+{
+    mesh_iterator_t iter;
+    int i, bpos[3], pos[3];
+    const uint8_t *data, *v;
+
+    iter = mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        data = mesh_get_block_data(layer->mesh, &iter, bpos, NULL);
+        if (!data) continue;
+        for (i = 0; i < BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE; i++) {
+            v = data + i * 4;
+            if (v[3] < 127) continue;
+            pos[0] = bpos[0] + i % BLOCK_SIZE;
+            pos[1] = bpos[1] + (i / BLOCK_SIZE) % BLOCK_SIZE;
+            pos[2] = bpos[2] + i / (BLOCK_SIZE * BLOCK_SIZE);
+            f(pos, v, user);
+        }
+    }
+}
+
+typedef struct {
+    color_index_t   *colors;
+    int             bbox[2][3];
+    const layer_t   *layer;
+    vox_tile_t      *tiles;
+} export_ctx_t;
+
+static void scan_voxel(const int pos[3], const uint8_t v[4], void *user)
+{
+    export_ctx_t *ctx = user;
+    int i;
+    get_color_entry(&ctx->colors, v);
+    for (i = 0; i < 3; i++) {
+        ctx->bbox[0][i] = min(ctx->bbox[0][i], pos[i]);
+        ctx->bbox[1][i] = max(ctx->bbox[1][i], pos[i] + 1);
+    }
+}
+
+static void add_voxel(const int pos[3], const uint8_t v[4], void *user)
+{
+    export_ctx_t *ctx = user;
+    vox_tile_t *tile;
+    int i, tpos[3], p[3];
+
+    for (i = 0; i < 3; i++) {
+        tpos[i] = (pos[i] - ctx->bbox[0][i]) / VOX_MAX_SIZE;
+        p[i] = (pos[i] - ctx->bbox[0][i]) % VOX_MAX_SIZE;
+    }
+    HASH_FIND(hh, ctx->tiles, tpos, sizeof(tpos), tile);
+    if (!tile) {
+        tile = calloc(1, sizeof(*tile));
+        memcpy(tile->pos, tpos, sizeof(tpos));
+        for (i = 0; i < 3; i++)
+            tile->origin[i] = ctx->bbox[0][i] + tpos[i] * VOX_MAX_SIZE;
+        tile->layer = ctx->layer;
+        HASH_ADD(hh, ctx->tiles, pos, sizeof(tile->pos), tile);
+    }
+    if (tile->nb >= tile->capacity) {
+        tile->capacity = max(tile->capacity * 2, 1024);
+        tile->voxels = realloc(tile->voxels, tile->capacity * 4);
+    }
+    for (i = 0; i < 3; i++) {
+        tile->voxels[tile->nb * 4 + i] = p[i];
+        tile->size[i] = max(tile->size[i], p[i] + 1);
+    }
+    tile->voxels[tile->nb * 4 + 3] = get_color_entry(&ctx->colors, v)->index;
+    tile->nb++;
+}
+
+static void vox_export(const image_t *img, const char *path)
 {
     FILE *file;
-    int children_size, nb_vox = 0, i, pos[3];
-    int xmin = INT_MAX, ymin = INT_MAX, zmin = INT_MAX;
-    int xmax = INT_MIN, ymax = INT_MIN, zmax = INT_MIN;
+    int i, ofs;
     uint8_t (*palette)[4];
     bool use_default_palette = true;
-    uint8_t *voxels;
-    uint8_t v[4];
-    mesh_iterator_t iter;
+    const layer_t *layer;
+    color_index_t *entry, *entry_tmp;
+    vox_tile_t *tiles = NULL, *tile, *tile_tmp;
+    export_ctx_t ctx = {};
+    buf_t buf = {};
 
     palette = calloc(256, sizeof(*palette));
     for (i = 0; i < 256; i++)
         hexcolor(VOX_DEFAULT_PALETTE[i], palette[i]);
 
-    // Iter all the voxels to get the count and the size.
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        v[3] = 255;
-        use_default_palette = use_default_palette &&
-                            get_color_index(v, palette, true) != -1;
-        nb_vox++;
-        xmin = min(xmin, pos[0]);
-        ymin = min(ymin, pos[1]);
-        zmin = min(zmin, pos[2]);
-        xmax = max(xmax, pos[0] + 1);
-        ymax = max(ymax, pos[1] + 1);
-        zmax = max(zmax, pos[2] + 1);
+    // First pass to collect the colors.
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->visible) continue;
+        iter_layer_voxels(layer, scan_voxel, &ctx);
+    }
+    HASH_ITER(hh, ctx.colors, entry, entry_tmp) {
+        if (get_color_index((uint8_t[4]){entry->color[0], entry->color[1],
+                                         entry->color[2], 255},
+                            palette, true) == -1) {
+            use_default_palette = false;
+            break;
+        }
     }
     if (!use_default_palette)
-        quantization_gen_palette(mesh, 255, (void*)(palette + 1));
+        quantization_gen_palette(goxel_get_layers_mesh(), 255,
+                                 (void*)(palette + 1));
+    HASH_ITER(hh, ctx.colors, entry, entry_tmp) {
+        entry->index = get_color_index((uint8_t[4]){entry->color[0],
+                            entry->color[1], entry->color[2], 255},
+                            palette, false);
+    }
 
-    children_size = 12 + 4 * 3 +      // SIZE chunk
-                    12 + 4 + 4 * nb_vox + // XYZI chunk
-                    (use_default_palette ? 0 : (12 + 4 * 256)); // RGBA chunk.
+    // Split each layer into models no bigger than VOX_MAX_SIZE.
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->visible) continue;
+        for (i = 0; i < 3; i++) {
+            ctx.bbox[0][i] = INT_MAX;
+            ctx.bbox[1][i] = INT_MIN;
+        }
+        iter_layer_voxels(layer, scan_voxel, &ctx);
+        if (ctx.bbox[0][0] > ctx.bbox[1][0]) continue;
+        ctx.layer = layer;
+        ctx.tiles = NULL;
+        iter_layer_voxels(layer, add_voxel, &ctx);
+        HASH_ITER(hh, ctx.tiles, tile, tile_tmp) {
+            HASH_DEL(ctx.tiles, tile);
+            LL_APPEND(tiles, tile);
+        }
+    }
+
+    write_models(&buf, tiles);
+    write_nodes(&buf, tiles);
+    if (!use_default_palette) {
+        ofs = chunk_start(&buf, "RGBA");
+        buf_write(&buf, palette + 1, 255 * 4);
+        buf_int32(&buf, 0);
+        chunk_end(&buf, ofs);
+    }
 
     file = fopen(path, "wb");
     fprintf(file, "VOX ");
     WRITE(uint32_t, 150, file);     // Version
     fprintf(file, "MAIN");
     WRITE(uint32_t, 0, file);       // Main chunck size.
-    WRITE(uint32_t, children_size, file);
-
-    fprintf(file, "SIZE");
-    WRITE(uint32_t, 4 * 3, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, xmax - xmin, file);
-    WRITE(uint32_t, ymax - ymin, file);
-    WRITE(uint32_t, zmax - zmin, file);
-
-    fprintf(file, "XYZI");
-    WRITE(uint32_t, 4 * nb_vox + 4, file);
-    WRITE(uint32_t, 0, file);
-    WRITE(uint32_t, nb_vox, file);
-
-    voxels = calloc(nb_vox, 4);
-    i = 0;
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-    while (mesh_iter(&iter, pos)) {
-        mesh_get_at(mesh, &iter, pos, v);
-        if (v[3] < 127) continue;
-        pos[0] -= xmin;
-        pos[1] -= ymin;
-        pos[2] -= zmin;
-        assert(pos[0] >= 0 && pos[0] < 255);
-        assert(pos[1] >= 0 && pos[1] < 255);
-        assert(pos[2] >= 0 && pos[2] < 255);
-
-        voxels[i * 4 + 0] = pos[0];
-        voxels[i * 4 + 1] = pos[1];
-        voxels[i * 4 + 2] = pos[2];
-        voxels[i * 4 + 3] = get_color_index(v, palette, false);
-        i++;
-    }
-    qsort(voxels, nb_vox, 4, voxel_cmp);
-    for (i = 0; i < nb_vox; i++)
-        fwrite(voxels + i * 4, 4, 1, file);
-    free(voxels);
+    WRITE(uint32_t, buf.size, file);
+    fwrite(buf.data, buf.size, 1, file);
+    fclose(file);
 
-    if (!use_default_palette) {
-        fprintf(file, "RGBA");
-        WRITE(uint32_t, 4 * 256, file);
-        WRITE(uint32_t, 0, file);
-        for (i = 1; i < 256; i++) {
-            WRITE(uint8_t, palette[i][0], file);
-            WRITE(uint8_t, palette[i][1], file);
-            WRITE(uint8_t, palette[i][2], file);
-            WRITE(uint8_t, palette[i][3], file);
-        }
-        WRITE(uint32_t, 0, file);
+    LL_FOREACH_SAFE(tiles, tile, tile_tmp) {
+        free(tile->voxels);
+        free(tile);
     }
-
-    fclose(file);
+    HASH_ITER(hh, ctx.colors, entry, entry_tmp) {
+        HASH_DEL(ctx.colors, entry);
+        free(entry);
+    }
+    free(buf.data);
     free(palette);
 }
 
@@ -315,7 +812,7 @@ static void export_as_vox(const char *path)
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                     "magica voxel\0*.vox\0", NULL, "untitled.vox");
     if (!path) return;
-    vox_export(goxel_get_layers_mesh(), path);
+    vox_export(goxel.image, path);
 }
 
 ACTION_REGISTER(export_as_vox,
@@ -56,12 +56,6 @@ typedef struct {
         goto end; \
     } while (0)
 
-static inline int AT(int x, int y, int z, int w, int h, int d) {
-    y = h - y - 1;
-    z = d - z - 1;
-    return x + y * w + z * w * h;
-}
-
 static void swap_color(uint32_t v, uint8_t ret[4])
 {
     uint8_t o[4];
@@ -76,11 +70,12 @@ static int kv6_import(const char *path)
 {
     FILE *file;
     char magic[4];
-    int i, r, ret = 0, w, h, d, blklen, x, y, z = 0, nb, p = 0;
+    int i, r, ret = 0, w, h, d, blklen, x, y, z = 0, nb, p = 0, p0;
     uint32_t *xoffsets = NULL;
     uint16_t *xyoffsets = NULL;
-    uint8_t (*cube)[4] = NULL;
+    uint8_t (*column)[4] = NULL;
     uint8_t color[4] = {0};
+    mesh_sink_t *sink = NULL;
     (void)r;
     struct {
         uint32_t color;
@@ -98,7 +93,7 @@ static int kv6_import(const char *path)
     w = READ(uint32_t, file);
     h = READ(uint32_t, file);
     d = READ(uint32_t, file);
-    cube = calloc(w * h * d, sizeof(*cube));
+    column = calloc(d, sizeof(*column));
 
     READ(float, file);
     READ(float, file);
@@ -116,21 +111,20 @@ static int kv6_import(const char *path)
     for (i = 0; i < w; i++)      xoffsets[i] = READ(uint32_t, file);
     for (i = 0; i < w * h; i++) xyoffsets[i] = READ(uint16_t, file);
 
+    // Decode the voxels one column at a time.
+    sink = mesh_sink_new(goxel.image->active_layer->mesh, (int[2][3]){
+            {-w / 2, -h / 2, -d / 2}, {-w / 2 + w, -h / 2 + h, -d / 2 + d}});
     for (x = 0; x < w; x++)
     for (y = 0; y < h; y++) {
+        memset(column, 0, d * sizeof(*column));
         nb = xyoffsets[x * h + y];
-        for (i = 0; i < nb; i++, p++) {
-            z = blocks[p].zpos;
-            swap_color(blocks[p].color, cube[AT(x, y, z, w, h, d)]);
+        for (i = 0, p0 = p; i < nb; i++, p++) {
+            if (blocks[p].zpos >= d) raise("Invalid format");
+            swap_color(blocks[p].color, column[blocks[p].zpos]);
         }
-    }
 
-    // Fill
-    p = 0;
-    for (x = 0; x < w; x++)
-    for (y = 0; y < h; y++) {
-        nb = xyoffsets[x * h + y];
-        for (i = 0; i < nb; i++, p++) {
+        // Fill
+        for (i = 0, p = p0; i < nb; i++, p++) {
             if (blocks[p].visface & 0x10) {
                 z = blocks[p].zpos;
                 swap_color(blocks[p].color, color);
@@ -138,16 +132,20 @@ static int kv6_import(const char *path)
             }
             if (blocks[p].visface & 0x20) {
                 for (; z < blocks[p].zpos; z++)
-                    if (cube[AT(x, y, z, w, h, d)][3] == 0)
-                        memcpy(cube[AT(x, y, z, w, h, d)], color, 4);
+                    if (column[z][3] == 0) memcpy(column[z], color, 4);
             }
         }
+
+        for (z = 0; z < d; z++) {
+            mesh_sink_set(sink, (int[3]){
+                    x - w / 2, h - 1 - y - h / 2, d - 1 - z - d / 2},
+                    column[z]);
+        }
     }
 
-    mesh_blit(goxel.image->active_layer->mesh, (const uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
 end:
-    free(cube);
+    mesh_sink_delete(sink);
+    free(column);
     free(blocks);
     free(xoffsets);
     free(xyoffsets);
@@ -166,8 +164,9 @@ static int kvx_import(const char *path)
     uint8_t (*palette)[4] = NULL;
     uint32_t *xoffsets = NULL;
     uint16_t *xyoffsets = NULL;
-    uint8_t (*cube)[4] = NULL;
+    uint8_t (*column)[4] = NULL;
     long datpos;
+    mesh_sink_t *sink = NULL;
     (void)r;
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_OPEN,
@@ -179,7 +178,7 @@ static int kvx_import(const char *path)
     w = READ(uint32_t, file);
     h = READ(uint32_t, file);
     d = READ(uint32_t, file);
-    cube = calloc(w * h * d, sizeof(*cube));
+    column = calloc(d, sizeof(*column));
 
     px = READ(uint32_t, file) / 256;
     py = READ(uint32_t, file) / 256;
@@ -209,8 +208,14 @@ static int kvx_import(const char *path)
     }
     fseek(file, datpos, SEEK_SET);
 
+    vec3_set(aabb[0], -px, -py, pz - d);
+    vec3_set(aabb[1], w - px, h - py, pz);
+
+    // Decode the voxels one column at a time.
+    sink = mesh_sink_new(goxel.image->active_layer->mesh, aabb);
     for (x = 0; x < w; x++)
     for (y = 0; y < h; y++) {
+        memset(column, 0, d * sizeof(*column));
         if (xyoffsets[x * (h + 1) + y + 1] < xyoffsets[x * (h + 1) + y])
             raise("Invalid format");
         nb = xyoffsets[x * (h + 1) + y + 1] - xyoffsets[x * (h + 1) + y];
@@ -221,7 +226,7 @@ static int kvx_import(const char *path)
             assert(z + len - 1  < d);
             for (i = 0; i < len; i++) {
                 color = READ(uint8_t, file);
-                memcpy(cube[AT(x, y, z + i, w, h, d)], palette[color], 4);
+                memcpy(column[z + i], palette[color], 4);
             }
             nb -= len + 3;
 
@@ -232,25 +237,26 @@ static int kvx_import(const char *path)
             if (visface & 0x10) lastz = z + len;
             if (visface & 0x20) {
                 for (i = lastz; i < z; i++) {
-                    if (cube[AT(x, y, i, w, h, d)][3] == 0) {
-                        memcpy(cube[AT(x, y, i, w, h, d)], palette[color], 4);
+                    if (column[i][3] == 0) {
+                        memcpy(column[i], palette[color], 4);
                     }
                 }
             }
         }
-    }
 
-    vec3_set(aabb[0], -px, -py, pz - d);
-    vec3_set(aabb[1], w - px, h - py, pz);
+        for (z = 0; z < d; z++) {
+            mesh_sink_set(sink, (int[3]){
+                    x - px, h - 1 - y - py, d - 1 - z + pz - d}, column[z]);
+        }
+    }
 
     bbox_from_aabb(goxel.image->box, aabb);
     bbox_from_aabb(goxel.image->active_layer->box, aabb);
-    mesh_blit(goxel.image->active_layer->mesh, (uint8_t*)cube,
-              -px, -py, pz - d, w, h, d, NULL);
 
 end:
+    mesh_sink_delete(sink);
     free(palette);
-    free(cube);
+    free(column);
     free(xoffsets);
     free(xyoffsets);
     fclose(file);
@@ -313,15 +319,21 @@ static bool slab_append(slab_t *slab, voxel_t *vox)
 }
 
 
+#define N BLOCK_SIZE
+
+// Voxel at a position in a block read with a one voxel border.
+#define AT(data, x, y, z) \
+    (&(data)[(((z) * (N + 2) + (y)) * (N + 2) + (x)) * 4])
+
 static void kvx_export(const mesh_t *mesh, const char *path)
 {
     FILE *file;
     uint8_t (*palette)[4];
     mesh_iterator_t iter;
-    mesh_accessor_t acc;
-    uint8_t v[4];
+    uint8_t v[4], *data;
     float box[4][4];
-    int pos[3], size[3], orig[3], x, y, i;
+    int bpos[3], size[3], orig[3], x, y, z, i;
+    uint32_t rows[N + 2][N + 2], solid, faces[6];
     UT_array *slabs;
     UT_array *voxels;
     slab_t *slab;
@@ -351,13 +363,15 @@ static void kvx_export(const mesh_t *mesh, const char *path)
     // create a palette.
     if (goxel.palette->size == 256) {
         use_current_palette = true;
-        iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS);
-        while (mesh_iter(&iter, pos)) {
-            mesh_get_at(mesh, &iter, pos, v);
-            if (v[3] < 127) continue;
-            if (palette_search(goxel.palette, v, true) < 0) {
-                use_current_palette = false;
-                break;
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (use_current_palette && mesh_iter(&iter, bpos)) {
+            data = mesh_get_block_data(mesh, &iter, bpos, NULL);
+            for (i = 0; data && i < N * N * N; i++) {
+                if (data[i * 4 + 3] < 127) continue;
+                if (palette_search(goxel.palette, data + i * 4, true) < 0) {
+                    use_current_palette = false;
+                    break;
+                }
             }
         }
     }
@@ -371,50 +385,62 @@ static void kvx_export(const mesh_t *mesh, const char *path)
         quantization_gen_palette(mesh, 256, (void*)(palette));
     }
 
-    // Iter the voxels and only keep the visible ones, plus the visible
+    // Iter the blocks and only keep the visible voxels, plus the visible
     // faces mask.  Put them all into an array.
     utarray_new(voxels, &voxel_icd);
-    iter = mesh_get_iterator(mesh, MESH_ITER_VOXELS | MESH_ITER_SKIP_EMPTY);
-    acc = mesh_get_accessor(mesh);
-
-    while (mesh_iter(&iter, voxel.pos)) {
-        mesh_get_at(mesh, &iter, voxel.pos, v);
-        if (v[3] < 127) continue;
-
-        // XXX: we should be able to use box iterator instead of this,
-        // but for some reason it doesn't work!
-        if (!bbox_contains_vec(box,
-                    (float[]){voxel.pos[0], voxel.pos[1], voxel.pos[2]}))
-            continue;
-
-        // Compute visible face mask.
-        voxel.vis = 0;
-        #define vis_test(x, y, z) \
-            (mesh_get_alpha_at(mesh, &acc, (int[]){voxel.pos[0] + (x), \
-                                                   voxel.pos[1] + (y), \
-                                                   voxel.pos[2] + (z)}) < 127)
-        if (vis_test(-1,  0,  0)) voxel.vis |= 1;
-        if (vis_test(+1,  0,  0)) voxel.vis |= 2;
-        if (vis_test( 0, +1,  0)) voxel.vis |= 4;
-        if (vis_test( 0, -1,  0)) voxel.vis |= 8;
-        if (vis_test( 0,  0, +1)) voxel.vis |= 16;
-        if (vis_test( 0,  0, -1)) voxel.vis |= 32;
-
-        #undef vis_test
-        if (!voxel.vis) continue; // No visible faces.
-        voxel.color = get_color_index(v, palette, false);
-        voxel.pos[0] -= orig[0];
-        voxel.pos[1] -= orig[1];
-        voxel.pos[2] -= orig[2];
-
-        voxel.pos[1] = size[1] - voxel.pos[1] - 1;
-        voxel.pos[2] = size[2] - voxel.pos[2] - 1;
-
-        assert(voxel.pos[0] >= 0 && voxel.pos[0] < size[0]);
-        assert(voxel.pos[1] >= 0 && voxel.pos[1] < size[1]);
-        assert(voxel.pos[2] >= 0 && voxel.pos[2] < size[2]);
-        utarray_push_back(voxels, &voxel);
+    data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        mesh_read(mesh, (int[3]){bpos[0] - 1, bpos[1] - 1, bpos[2] - 1},
+                  (int[3]){N + 2, N + 2, N + 2}, data);
+        // Bit mask of the solid voxels of each row along x, including the
+        // one voxel border around the block.
+        for (z = 0; z < N + 2; z++)
+        for (y = 0; y < N + 2; y++) {
+            rows[z][y] = 0;
+            for (x = 0; x < N + 2; x++) {
+                if (AT(data, x, y, z)[3] >= 127) rows[z][y] |= 1 << x;
+            }
+        }
+        for (z = 1; z <= N; z++)
+        for (y = 1; y <= N; y++) {
+            // Solid voxels with an empty neighbor, for each face.
+            solid = rows[z][y];
+            faces[0] = solid & ~(solid << 1);
+            faces[1] = solid & ~(solid >> 1);
+            faces[2] = solid & ~rows[z][y + 1];
+            faces[3] = solid & ~rows[z][y - 1];
+            faces[4] = solid & ~rows[z + 1][y];
+            faces[5] = solid & ~rows[z - 1][y];
+            for (x = 1; x <= N; x++) {
+                voxel.vis = 0;
+                for (i = 0; i < 6; i++) {
+                    if (faces[i] & (1 << x)) voxel.vis |= 1 << i;
+                }
+                if (!voxel.vis) continue; // No visible faces.
+                voxel.pos[0] = bpos[0] + x - 1;
+                voxel.pos[1] = bpos[1] + y - 1;
+                voxel.pos[2] = bpos[2] + z - 1;
+                if (!bbox_contains_vec(box, (float[]){
+                            voxel.pos[0], voxel.pos[1], voxel.pos[2]}))
+                    continue;
+                memcpy(v, AT(data, x, y, z), 4);
+                voxel.color = get_color_index(v, palette, false);
+                voxel.pos[0] -= orig[0];
+                voxel.pos[1] -= orig[1];
+                voxel.pos[2] -= orig[2];
+
+                voxel.pos[1] = size[1] - voxel.pos[1] - 1;
+                voxel.pos[2] = size[2] - voxel.pos[2] - 1;
+
+                assert(voxel.pos[0] >= 0 && voxel.pos[0] < size[0]);
+                assert(voxel.pos[1] >= 0 && voxel.pos[1] < size[1]);
+                assert(voxel.pos[2] >= 0 && voxel.pos[2] < size[2]);
+                utarray_push_back(voxels, &voxel);
+            }
+        }
     }
+    free(data);
 
     // Sort the voxels by xy columns in order they will be in the slabs.
     utarray_sort(voxels, voxel_cmp);
@@ -509,6 +535,9 @@ static void kvx_export(const mesh_t *mesh, const char *path)
     fclose(file);
 }
 
+#undef AT
+#undef N
+
 static void export_as_kvx(const char *path)
 {
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
@@ -19,6 +19,7 @@
 // Support for Ace of Spades map files (vxl)
 
 #include "goxel.h"
+#include <limits.h>
 
 #define READ(type, file) \
     ({ type v; size_t r = fread(&v, sizeof(v), 1, file); (void)r; v;})
@@ -29,12 +30,6 @@
         goto end; \
     } while (0)
 
-static inline int AT(int x, int y, int z) {
-    x = 511 - x;
-    z = 63 - z;
-    return x + y * 512 + z * 512 * 512;
-}
-
 static void swap_color(uint32_t v, uint8_t ret[4])
 {
     uint8_t o[4];
@@ -53,8 +48,9 @@ static int vxl_import(const char *path)
     // ext_src/stb!).
     int ret = 0, size;
     int w = 512, h = 512, d = 64, x, y, z;
-    uint8_t (*cube)[4] = NULL;
+    uint8_t column[64][4];
     uint8_t *data, *v;
+    mesh_sink_t *sink;
 
     uint32_t *color;
     int i;
@@ -70,15 +66,19 @@ static int vxl_import(const char *path)
                                         "vxl\0*.vxl\0", NULL, NULL);
     if (!path) return -1;
 
-    cube = calloc(w * h * d, sizeof(*cube));
     data = (void*)read_file(path, &size);
     v = data;
+    sink = mesh_sink_new(goxel.image->active_layer->mesh, (int[2][3]){
+            {-w / 2, -h / 2, -d / 2}, {w / 2, h / 2, d / 2}});
 
+    // Each column is decoded into a buffer first, and then put into the
+    // mesh.
     for (y = 0; y < h; y++)
     for (x = 0; x < w; x++) {
 
+        memset(column, 0, sizeof(column));
         for (z = 0; z < 64; z++)
-            cube[AT(x, y, z)][3] = 255;
+            column[z][3] = 255;
 
         z = 0;
         while (true) {
@@ -87,12 +87,12 @@ static int vxl_import(const char *path)
             top_color_end = v[2];
 
             for (i = z; i < top_color_start; i++)
-                cube[AT(x, y, i)][3] = 0;
+                column[i][3] = 0;
 
             color = (uint32_t*)(v + 4);
             for (z = top_color_start; z <= top_color_end; z++) {
                 CHECK(z >= 0 && z < d);
-                swap_color(*color++, cube[AT(x, y, z)]);
+                swap_color(*color++, column[z]);
             }
 
             len_bottom = top_color_end - top_color_start + 1;
@@ -116,32 +116,23 @@ static int vxl_import(const char *path)
             bottom_color_start = bottom_color_end - len_top;
 
             for(z = bottom_color_start; z < bottom_color_end; z++)
-                swap_color(*color++, cube[AT(x, y, z)]);
+                swap_color(*color++, column[z]);
         }
-    }
 
-    mesh_blit(goxel.image->active_layer->mesh, (uint8_t*)cube,
-              -w / 2, -h / 2, -d / 2, w, h, d, NULL);
+        for (z = 0; z < d; z++) {
+            mesh_sink_set(sink, (int[3]){
+                    w - 1 - x - w / 2, y - h / 2, d - 1 - z - d / 2},
+                    column[z]);
+        }
+    }
+    mesh_sink_delete(sink);
     if (box_is_null(goxel.image->box)) {
         bbox_from_extents(goxel.image->box, vec3_zero, w / 2, h / 2, d / 2);
     }
-    free(cube);
     free(data);
     return ret;
 }
 
-static int is_surface(int x, int y, int z, uint8_t map[512][512][64])
-{
-   if (map[x][y][z]==0) return 0;
-   if (x   >   0 && map[x-1][y][z]==0) return 1;
-   if (x+1 < 512 && map[x+1][y][z]==0) return 1;
-   if (y   >   0 && map[x][y-1][z]==0) return 1;
-   if (y+1 < 512 && map[x][y+1][z]==0) return 1;
-   if (z   >   0 && map[x][y][z-1]==0) return 1;
-   if (z+1 <  64 && map[x][y][z+1]==0) return 1;
-   return 0;
-}
-
 static void write_color(FILE *f, uint32_t color)
 {
     uint8_t c[4];
@@ -153,15 +144,79 @@ static void write_color(FILE *f, uint32_t color)
 }
 
 #define MAP_Z  64
-void write_map(const char *filename,
-               uint8_t map[512][512][64],
-               uint32_t color[512][512][64])
+
+/*
+ * Return the bit mask of the surface voxels of a column: the solid voxels
+ * with at least one empty neighbor inside the map.
+ *
+ * Parameters:
+ *   solid  - Bit mask of the solid voxels of each column.
+ *   i, j   - The column position.
+ */
+static uint64_t get_surface(uint64_t solid[512][512], int i, int j)
+{
+    uint64_t s = solid[i][j];
+    uint64_t full = s;  // Voxels with all their neighbors solid.
+    if (i > 0)   full &= solid[i - 1][j];
+    if (i < 511) full &= solid[i + 1][j];
+    if (j > 0)   full &= solid[i][j - 1];
+    if (j < 511) full &= solid[i][j + 1];
+    full &= (s << 1) | 1;
+    full &= (s >> 1) | (1ULL << 63);
+    return s & ~full;
+}
+
+// Get the colors of a column directly from the mesh blocks.
+static void get_column_colors(const mesh_t *mesh, mesh_accessor_t *acc,
+                              int i, int j, uint32_t color[64])
+{
+    int k, pos[3], bpos[3], x, y, z;
+    const uint8_t *data = NULL;
+
+    bpos[2] = INT_MIN;
+    pos[0] = 256 - i;
+    pos[1] = j - 256;
+    for (k = 0; k < MAP_Z; k++) {
+        pos[2] = 31 - k;
+        x = pos[0] & (BLOCK_SIZE - 1);
+        y = pos[1] & (BLOCK_SIZE - 1);
+        z = pos[2] & (BLOCK_SIZE - 1);
+        if (bpos[2] != pos[2] - z) {
+            bpos[0] = pos[0] - x;
+            bpos[1] = pos[1] - y;
+            bpos[2] = pos[2] - z;
+            data = mesh_get_block_data(mesh, acc, bpos, NULL);
+        }
+        color[k] = 0;
+        if (!data) continue;
+        memcpy(&color[k],
+               data + ((z * BLOCK_SIZE + y) * BLOCK_SIZE + x) * 4, 4);
+    }
+}
+
+/*
+ * The map is only kept as one bit per voxel.  The surface voxels of each
+ * column are computed with bit operations on the neighbor columns masks,
+ * and the colors are read from the mesh when the column is written.
+ */
+static void write_map(const char *filename, const mesh_t *mesh,
+                      uint64_t solid[512][512])
 {
     int i,j,k;
+    uint64_t map, surface;
+    uint32_t color[64];
+    mesh_accessor_t acc = mesh_get_accessor(mesh);
     FILE *f = fopen(filename, "wb");
 
+#define IS_SOLID(k) ((k) < MAP_Z && ((map >> (k)) & 1))
+#define IS_SURFACE(k) ((k) < MAP_Z && ((surface >> (k)) & 1))
+
+    setvbuf(f, NULL, _IOFBF, 1 << 16);
     for (j = 0; j < 512; ++j) {
         for (i=0; i < 512; ++i) {
+            map = solid[i][j];
+            surface = get_surface(solid, i, j);
+            if (surface) get_column_colors(mesh, &acc, i, j, color);
             k = 0;
             while (k < MAP_Z) {
                 int z;
@@ -176,17 +231,17 @@ void write_map(const char *filename,
 
                 // find the air region
                 air_start = k;
-                while (k < MAP_Z && !map[i][j][k])
+                while (k < MAP_Z && !IS_SOLID(k))
                     ++k;
 
                 // find the top region
                 top_colors_start = k;
-                while (k < MAP_Z && is_surface(i,j,k,map))
+                while (IS_SURFACE(k))
                     ++k;
                 top_colors_end = k;
 
                 // now skip past the solid voxels
-                while (k < MAP_Z && map[i][j][k] && !is_surface(i,j,k,map))
+                while (IS_SOLID(k) && !IS_SURFACE(k))
                     ++k;
 
                 // at the end of the solid voxels, we have colored voxels.
@@ -198,7 +253,7 @@ void write_map(const char *filename,
                 bottom_colors_start = k;
 
                 z = k;
-                while (z < MAP_Z && is_surface(i,j,z,map))
+                while (IS_SURFACE(z))
                     ++z;
 
                 if (z == MAP_Z || 0)
@@ -207,7 +262,7 @@ void write_map(const char *filename,
                 else {
                     // otherwise, these are real bottom colors so we can write
                     // them
-                    while (is_surface(i,j,k,map))
+                    while (IS_SURFACE(k))
                         ++k;
                 }
                 bottom_colors_end = k;
@@ -228,45 +283,47 @@ void write_map(const char *filename,
                 fputc(air_start, f);
 
                 for (z=0; z < top_colors_len; ++z)
-                    write_color(f, color[i][j][top_colors_start + z]);
+                    write_color(f, color[top_colors_start + z]);
                 for (z=0; z < bottom_colors_len; ++z)
-                    write_color(f, color[i][j][bottom_colors_start + z]);
+                    write_color(f, color[bottom_colors_start + z]);
             }
         }
     }
+#undef IS_SOLID
+#undef IS_SURFACE
     fclose(f);
 }
 
 static void export_as_vxl(const char *path)
 {
-    uint8_t (*map)[512][512][64];
-    uint32_t (*color)[512][512][64];
+    uint64_t (*solid)[512][512];
     const mesh_t *mesh = goxel_get_layers_mesh();
-    mesh_iterator_t iter = {0};
-    uint8_t c[4];
-    int x, y, z, pos[3];
-
-    map = calloc(1, sizeof(*map));
-    color = calloc(1, sizeof(*color));
+    mesh_iterator_t iter;
+    const uint8_t *data;
+    int i, j, k, n, bpos[3];
 
     path = path ?: noc_file_dialog_open(NOC_FILE_DIALOG_SAVE,
                     "vxl\0*.vxl\0", NULL, "untitled.vxl");
     if (!path) return;
 
-    for (z = 0; z < 64; z++)
-    for (y = 0; y < 512; y++)
-    for (x = 0; x < 512; x++) {
-        pos[0] = 256 - x;
-        pos[1] = y - 256;
-        pos[2] = 31 - z;
-        mesh_get_at(mesh, &iter, pos, c);
-        if (c[3] <= 127) continue;
-        (*map)[x][y][z] = 1;
-        memcpy(&((*color)[x][y][z]), c, 4);
+    // Only compute the solid voxels mask of the map, from the blocks data.
+    solid = calloc(1, sizeof(*solid));
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        data = mesh_get_block_data(mesh, &iter, bpos, NULL);
+        if (!data) continue;
+        for (n = 0; n < BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE; n++) {
+            if (data[n * 4 + 3] <= 127) continue;
+            i = 256 - (bpos[0] + n % BLOCK_SIZE);
+            j = bpos[1] + (n / BLOCK_SIZE) % BLOCK_SIZE + 256;
+            k = 31 - (bpos[2] + n / (BLOCK_SIZE * BLOCK_SIZE));
+            if (i < 0 || i >= 512 || j < 0 || j >= 512 || k < 0 || k >= MAP_Z)
+                continue;
+            (*solid)[i][j] |= 1ULL << k;
+        }
     }
-    write_map(path, *map, *color);
-    free(map);
-    free(color);
+    write_map(path, mesh, *solid);
+    free(solid);
 }
 
 ACTION_REGISTER(import_vxl,
@@ -17,176 +17,277 @@
  */
 
 #include "goxel.h"
+#include <errno.h>
 
+// Vertex welding key.  The position is in subdivision units, so that the
+// comparison is exact.
 typedef struct {
-    union {
-        struct {
-            float    v[3];
-            uint8_t  c[3];
-        };
-        float vn[3];
-        struct {
-            int  vs[4];
-            int vns[4];
-        };
-    };
-} line_t;
-
-static UT_icd line_icd = {sizeof(line_t), NULL, NULL, NULL};
-
-static int lines_find(UT_array *lines, const line_t *line, int search_nb)
-{
-    int i, len;
-    line_t *l;
-    len = utarray_len(lines);
-    for (i = len - 1; (i >= 0) && (i > len - 1 - search_nb); i--) {
-        l = (line_t*)utarray_eltptr(lines, i);
-        if (memcmp(l, line, sizeof(*line)) == 0) return i + 1;
-    }
-    return 0;
-}
+    int32_t pos[3];
+    uint8_t color[4];   // Last value always zero.
+} vertex_key_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    vertex_key_t    key;
+    int             index;
+} vertex_t;
+
+typedef struct vertex_pool vertex_pool_t;
+struct vertex_pool {
+    vertex_pool_t   *next;
+    int             nb;
+    vertex_t        vertices[4096];
+};
+
+typedef struct {
+    vertex_t        *table;
+    vertex_pool_t   *pools;
+    int             nb;
+} welder_t;
+
+static struct {
+    bool triangles; // Split the quads into triangles.
+    bool binary;    // Binary ply.
+} g_options = {};
 
 /*
- * Function: lines_add
- * Add a line entry into a list and return its index.
+ * Function: weld
+ * Return the index (starting at one) of a vertex, adding it if needed.
  *
  * Parameters:
- *   lines      - The list.
- *   line       - The new line we want to add.
- *   search_nb  - How far into the list we search for a similar line.  If
- *                a similar line is found we just return its index insead
- *                of adding a new one.
+ *   welder - The vertices hash table.
+ *   key    - The vertex we want to add.
+ *   added  - Set to true if the vertex was not in the table yet.
  */
-static int lines_add(UT_array *lines, const line_t *line, int search_nb)
+static int weld(welder_t *welder, const vertex_key_t *key, bool *added)
+{
+    vertex_t *v;
+    vertex_pool_t *pool;
+
+    HASH_FIND(hh, welder->table, key, sizeof(*key), v);
+    *added = !v;
+    if (v) return v->index;
+    pool = welder->pools;
+    if (!pool || pool->nb == ARRAY_SIZE(pool->vertices)) {
+        pool = calloc(1, sizeof(*pool));
+        LL_PREPEND(welder->pools, pool);
+    }
+    v = &pool->vertices[pool->nb++];
+    v->key = *key;
+    v->index = ++welder->nb;
+    HASH_ADD(hh, welder->table, key, sizeof(*key), v);
+    return v->index;
+}
+
+static void welder_release(welder_t *welder)
+{
+    vertex_pool_t *pool, *tmp;
+    HASH_CLEAR(hh, welder->table);
+    LL_FOREACH_SAFE(welder->pools, pool, tmp) free(pool);
+}
+
+// Write a 32 bits value (int or float) in little endian, as declared in the
+// binary ply header.
+static void write_le32(FILE *out, const void *value)
+{
+    uint32_t v;
+    uint8_t buf[4];
+    memcpy(&v, value, 4);
+    buf[0] = v;
+    buf[1] = v >> 8;
+    buf[2] = v >> 16;
+    buf[3] = v >> 24;
+    fwrite(buf, 4, 1, out);
+}
+
+static void write_vertex(FILE *out, const vertex_key_t *v, int subdivide,
+                         bool ply)
+{
+    int i;
+    float pos[3] = {v->pos[0] / (float)subdivide,
+                    v->pos[1] / (float)subdivide,
+                    v->pos[2] / (float)subdivide};
+    if (ply && g_options.binary) {
+        for (i = 0; i < 3; i++) write_le32(out, &pos[i]);
+        fwrite(v->color, 3, 1, out);
+        return;
+    }
+    fprintf(out, "%s%g %g %g %f %f %f\n", ply ? "" : "v ",
+            pos[0], pos[1], pos[2],
+            v->color[0] / 255., v->color[1] / 255., v->color[2] / 255.);
+}
+
+// vs and vns contain size (3 or 4) indices.
+static void write_face(FILE *out, int size, const int *vs, const int *vns,
+                       bool ply)
+{
+    int i;
+    uint8_t n = size;
+    int32_t index;
+
+    if (ply && g_options.binary) {
+        fwrite(&n, 1, 1, out);
+        for (i = 0; i < size; i++) {
+            index = vs[i] - 1;
+            write_le32(out, &index);
+        }
+    } else if (ply) {
+        fprintf(out, "%d", size);
+        for (i = 0; i < size; i++) fprintf(out, " %d", vs[i] - 1);
+        fprintf(out, "\n");
+    } else {
+        fprintf(out, "f");
+        for (i = 0; i < size; i++) fprintf(out, " %d//%d", vs[i], vns[i]);
+        fprintf(out, "\n");
+    }
+}
+
+static void copy_file(FILE *src, FILE *dst)
+{
+    char buf[1 << 14];
+    size_t n;
+    rewind(src);
+    while ((n = fread(buf, 1, sizeof(buf), src)))
+        fwrite(buf, 1, n, dst);
+}
+
+typedef struct {
+    FILE        *out;
+    FILE        *vfile;     // Where we write the vertices.
+    FILE        *ffile;     // Where we write the faces.
+    welder_t    welder_v;
+    welder_t    welder_vn;
+    int         nb_faces;
+    bool        ply;
+} export_ctx_t;
+
+static void export_block(const int bpos[3], const voxel_vertex_t *verts,
+                         int nb_elems, int size, int subdivide, void *user)
 {
-    int idx;
-    idx = lines_find(lines, line, search_nb);
-    if (idx) return idx;
-    utarray_push_back(lines, line);
-    return utarray_len(lines);
+    export_ctx_t *ctx = user;
+    int i, j, k, vs[4], vns[4];
+    bool added;
+    vertex_key_t key;
+    const voxel_vertex_t *vert;
+
+    for (i = 0; i < nb_elems; i++) {
+        for (j = 0; j < size; j++) {
+            vert = &verts[i * size + j];
+            memset(&key, 0, sizeof(key));
+            for (k = 0; k < 3; k++)
+                key.pos[k] = bpos[k] * subdivide + vert->pos[k];
+            memcpy(key.color, vert->color, 3);
+            vs[j] = weld(&ctx->welder_v, &key, &added);
+            if (added) write_vertex(ctx->vfile, &key, subdivide, ctx->ply);
+            if (ctx->ply) continue;
+            memset(&key, 0, sizeof(key));
+            for (k = 0; k < 3; k++) key.pos[k] = vert->normal[k];
+            vns[j] = weld(&ctx->welder_vn, &key, &added);
+            if (added)
+                fprintf(ctx->out, "vn %d %d %d\n",
+                        key.pos[0], key.pos[1], key.pos[2]);
+        }
+        if (size == 4 && g_options.triangles) {
+            write_face(ctx->ffile, 3, vs, vns, ctx->ply);
+            write_face(ctx->ffile, 3, (int[]){vs[2], vs[3], vs[0]},
+                       (int[]){vns[2], vns[3], vns[0]}, ctx->ply);
+            ctx->nb_faces += 2;
+        } else {
+            write_face(ctx->ffile, size, vs, vns, ctx->ply);
+            ctx->nb_faces++;
+        }
+    }
 }
 
 static void export(const mesh_t *mesh, const char *path, bool ply)
 {
     // XXX: Merge faces that can be merged into bigger ones.
-    //      Allow to chose between quads or triangles.
     //      Also export mlt file for the colors.
-    voxel_vertex_t* verts;
-    float v[3];
-    uint8_t c[3];
-    int nb_elems, i, j, bpos[3];
-    float mat[4][4];
     FILE *out;
-    const int N = BLOCK_SIZE;
-    int size = 0, subdivide;
-    UT_array *lines_f, *lines_v, *lines_vn;
-    line_t line, face, *line_ptr = NULL;
-    mesh_iterator_t iter;
-
-    utarray_new(lines_f, &line_icd);
-    utarray_new(lines_v, &line_icd);
-    utarray_new(lines_vn, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    face = (line_t){};
-    iter = mesh_get_iterator(mesh,
-            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-    while (mesh_iter(&iter, bpos)) {
-        mat4_set_identity(mat);
-        mat4_itranslate(mat, bpos[0], bpos[1], bpos[2]);
-        nb_elems = mesh_generate_vertices(mesh, bpos,
-                                    goxel.rend.settings.effects, verts,
-                                    &size, &subdivide);
-        for (i = 0; i < nb_elems; i++) {
-            // Put the vertices.
-            for (j = 0; j < size; j++) {
-                v[0] = verts[i * size + j].pos[0] / (float)subdivide;
-                v[1] = verts[i * size + j].pos[1] / (float)subdivide;
-                v[2] = verts[i * size + j].pos[2] / (float)subdivide;
-                mat4_mul_vec3(mat, v, v);
-                memcpy(c, verts[i * size + j].color, 3);
-                line = (line_t){
-                    .v = {v[0], v[1], v[2]}, .c = {c[0], c[1], c[2]}};
-                // XXX: not sure about the search nb value to use here.
-                face.vs[j] = lines_add(lines_v, &line, 1024);
-            }
-            // Put the normals
-            for (j = 0; j < size; j++) {
-                v[0] = verts[i * size + j].normal[0];
-                v[1] = verts[i * size + j].normal[1];
-                v[2] = verts[i * size + j].normal[2];
-                line = (line_t){.vn = {v[0], v[1], v[2]}};
-                face.vns[j] = lines_add(lines_vn, &line, 512);
-            }
-            lines_add(lines_f, &face, 0);
+    export_ctx_t ctx = {.ply = ply};
+    char vpath[1024], fpath[1024];
+
+    out = fopen(path, "wb");
+    if (!out) {
+        LOG_E("Cannot save to %s: %s", path, strerror(errno));
+        return;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 16);
+    ctx.out = out;
+    // Ply needs the number of vertices and faces in the header, so we
+    // write them into temporary files next to the output first.  We don't
+    // use tmpfile, since on Windows it often fails without admin rights.
+    if (ply) {
+        snprintf(vpath, sizeof(vpath), "%s.v.tmp", path);
+        snprintf(fpath, sizeof(fpath), "%s.f.tmp", path);
+        ctx.vfile = fopen(vpath, "w+b");
+        ctx.ffile = fopen(fpath, "w+b");
+        if (!ctx.vfile || !ctx.ffile) {
+            LOG_E("Cannot create temporary file: %s", strerror(errno));
+            if (ctx.vfile) fclose(ctx.vfile);
+            if (ctx.ffile) fclose(ctx.ffile);
+            remove(vpath);
+            remove(fpath);
+            fclose(out);
+            return;
         }
+    } else {
+        fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
+        ctx.vfile = ctx.ffile = out;
     }
-    out = fopen(path, "w");
+
+    mesh_iter_vertices(mesh, goxel.rend.settings.effects, export_block,
+                       &ctx, NULL);
+
     if (ply) {
         fprintf(out, "ply\n");
-        fprintf(out, "format ascii 1.0\n");
+        fprintf(out, "format %s 1.0\n",
+                g_options.binary ? "binary_little_endian" : "ascii");
         fprintf(out, "comment Generated from Goxel " GOXEL_VERSION_STR "\n");
-        fprintf(out, "element vertex %d\n", utarray_len(lines_v));
+        fprintf(out, "element vertex %d\n", ctx.welder_v.nb);
         fprintf(out, "property float x\n");
         fprintf(out, "property float y\n");
         fprintf(out, "property float z\n");
-        fprintf(out, "property float red\n");
-        fprintf(out, "property float green\n");
-        fprintf(out, "property float blue\n");
-        fprintf(out, "element face %d\n", utarray_len(lines_f));
+        if (g_options.binary) {
+            fprintf(out, "property uchar red\n");
+            fprintf(out, "property uchar green\n");
+            fprintf(out, "property uchar blue\n");
+        } else {
+            fprintf(out, "property float red\n");
+            fprintf(out, "property float green\n");
+            fprintf(out, "property float blue\n");
+        }
+        fprintf(out, "element face %d\n", ctx.nb_faces);
         fprintf(out, "property list uchar int vertex_indices\n");
         fprintf(out, "end_header\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
-            fprintf(out, "%g %g %g %f %f %f\n",
-                    line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
-                    line_ptr->c[0] / 255.,
-                    line_ptr->c[1] / 255.,
-                    line_ptr->c[2] / 255.);
-        }
-        while( (line_ptr = (line_t*)utarray_next(lines_f, line_ptr))) {
-            if (size == 4) {
-                fprintf(out, "4 %d %d %d %d\n", line_ptr->vs[0] - 1,
-                                                line_ptr->vs[1] - 1,
-                                                line_ptr->vs[2] - 1,
-                                                line_ptr->vs[3] - 1);
-            } else {
-                fprintf(out, "3 %d %d %d\n",    line_ptr->vs[0] - 1,
-                                                line_ptr->vs[1] - 1,
-                                                line_ptr->vs[2] - 1);
-            }
-        }
-    } else {
-        fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
-        while( (line_ptr = (line_t*)utarray_next(lines_v, line_ptr))) {
-            fprintf(out, "v %g %g %g %f %f %f\n",
-                    line_ptr->v[0], line_ptr->v[1], line_ptr->v[2],
-                    line_ptr->c[0] / 255.,
-                    line_ptr->c[1] / 255.,
-                    line_ptr->c[2] / 255.);
-        }
-        while( (line_ptr = (line_t*)utarray_next(lines_vn, line_ptr))) {
-            fprintf(out, "vn %g %g %g\n",
-                    line_ptr->vn[0], line_ptr->vn[1], line_ptr->vn[2]);
-        }
-        while( (line_ptr = (line_t*)utarray_next(lines_f, line_ptr))) {
-            if (size == 4) {
-                fprintf(out, "f %d//%d %d//%d %d//%d %d//%d\n",
-                             line_ptr->vs[0], line_ptr->vns[0],
-                             line_ptr->vs[1], line_ptr->vns[1],
-                             line_ptr->vs[2], line_ptr->vns[2],
-                             line_ptr->vs[3], line_ptr->vns[3]);
-            } else {
-                fprintf(out, "f %d//%d %d//%d %d//%d\n",
-                             line_ptr->vs[0], line_ptr->vns[0],
-                             line_ptr->vs[1], line_ptr->vns[1],
-                             line_ptr->vs[2], line_ptr->vns[2]);
-            }
-        }
+        copy_file(ctx.vfile, out);
+        copy_file(ctx.ffile, out);
+        fclose(ctx.vfile);
+        fclose(ctx.ffile);
+        remove(vpath);
+        remove(fpath);
     }
     fclose(out);
-    utarray_free(lines_f);
-    utarray_free(lines_v);
-    utarray_free(lines_vn);
-    free(verts);
+    welder_release(&ctx.welder_v);
+    welder_release(&ctx.welder_vn);
+}
+
+static void export_gui(bool ply)
+{
+    gui_checkbox("Triangles", &g_options.triangles,
+                 "Split the quads into triangles");
+    if (ply)
+        gui_checkbox("Binary", &g_options.binary, NULL);
+}
+
+static void obj_export_gui(void)
+{
+    export_gui(false);
+}
+
+static void ply_export_gui(void)
+{
+    export_gui(true);
 }
 
 void wavefront_export(const mesh_t *mesh, const char *path)
@@ -214,6 +315,7 @@ ACTION_REGISTER(mesh_export_as_obj,
     .file_format = {
         .name = "obj",
         .ext = "*.obj\0",
+        .export_gui = obj_export_gui,
     },
 )
 
@@ -224,6 +326,7 @@ ACTION_REGISTER(export_as_obj,
     .file_format = {
         .name = "obj",
         .ext = "*.obj\0",
+        .export_gui = obj_export_gui,
     },
 )
 
@@ -242,6 +345,7 @@ ACTION_REGISTER(mesh_export_as_ply,
     .file_format = {
         .name = "ply",
         .ext = "*.ply\0",
+        .export_gui = ply_export_gui,
     },
 )
 
@@ -252,5 +356,6 @@ ACTION_REGISTER(export_as_ply,
     .file_format = {
         .name = "ply",
         .ext = "*.ply\0",
+        .export_gui = ply_export_gui,
     },
 )
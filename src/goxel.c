@@ -338,8 +338,10 @@ void goxel_init(void)
 
 void goxel_reset(void)
 {
+    journal_new_document();
     image_delete(goxel.image);
     goxel.image = image_new();
+    goxel.autosave_interval = 300;
     action_exec2("settings_load", "");
 
     // Put plane horizontal at the origin.
@@ -399,6 +401,8 @@ void goxel_reset(void)
 void goxel_release(void)
 {
     pathtracer_stop(&goxel.pathtracer);
+    autosave_release();
+    journal_release();
     gui_release();
 }
 
@@ -431,6 +435,9 @@ int goxel_iter(inputs_t *inputs)
     mat4_copy(camera->view_mat, goxel.rend.view_mat);
     mat4_copy(camera->proj_mat, goxel.rend.proj_mat);
     gui_iter(inputs);
+    image_history_iter(goxel.image);
+    journal_iter(goxel.image);
+    autosave_iter(goxel.image);
 
     if (DEFINED(SOUND) && time - goxel.last_click_time > 0.1) {
         mesh_key = mesh_get_key(goxel_get_render_mesh());
@@ -528,6 +535,7 @@ static int on_pan(const gesture_t *gest, void *user)
         vec3_imul(odelta, camera->dist);
     mat4_translate(goxel.move_origin.camera_mat, -odelta[0], -odelta[1], 0,
                    camera->mat);
+    camera_touch(camera);
     return 0;
 }
 
@@ -613,6 +621,7 @@ void goxel_mouse_in_view(const float viewport[4], const inputs_t *inputs,
         mat4_itranslate(camera->mat, 0, 0,
                 -camera->dist * (1 - pow(1.1, -inputs->mouse_wheel)));
         camera->dist *= pow(1.1, -inputs->mouse_wheel);
+        camera_touch(camera);
         // Auto adjust the camera rotation position.
         if (goxel_unproject_on_mesh(viewport, inputs->touches[0].pos,
                                     goxel_get_layers_mesh(), p, n)) {
@@ -803,10 +812,32 @@ void goxel_render_view(const float viewport[4], bool render_mode)
 
 void image_update(image_t *img);
 
+// Get the list of visible layers meshes.  If active is set, only return
+// the meshes below (active < 0) or above (active > 0) the active layer.
+// Return the number of meshes.
+static int get_visible_meshes(const mesh_t ***meshes, int active)
+{
+    layer_t *layer;
+    int nb = 0, side = -1;
+    DL_FOREACH(goxel.image->layers, layer) {
+        if (layer == goxel.image->active_layer) {
+            side = +1;
+            if (active) continue;
+        }
+        if (active && side != active) continue;
+        if (!layer->visible || !layer->mesh) continue;
+        *meshes = realloc(*meshes, (nb + 1) * sizeof(**meshes));
+        (*meshes)[nb++] = layer->mesh;
+    }
+    return nb;
+}
+
 const mesh_t *goxel_get_layers_mesh(void)
 {
     uint32_t key = 0, k;
     layer_t *layer;
+    const mesh_t **meshes = NULL;
+    int nb;
 
     image_update(goxel.image);
     DL_FOREACH(goxel.image->layers, layer) {
@@ -815,23 +846,22 @@ const mesh_t *goxel_get_layers_mesh(void)
         k = layer_get_key(layer);
         key = crc32(key, (void*)&k, sizeof(k));
     }
-    if (key != goxel.layers_mesh_hash) {
+    if (key != goxel.layers_mesh_hash || !goxel.layers_mesh_.mesh) {
         goxel.layers_mesh_hash = key;
-        if (!goxel.layers_mesh_) goxel.layers_mesh_ = mesh_new();
-        mesh_clear(goxel.layers_mesh_);
-        DL_FOREACH(goxel.image->layers, layer) {
-            if (!layer->visible) continue;
-            mesh_merge(goxel.layers_mesh_, layer->mesh, MODE_OVER, NULL);
-        }
+        // Only the blocks that changed since the last call get merged again.
+        nb = get_visible_meshes(&meshes, 0);
+        mesh_stack_update(&goxel.layers_mesh_, meshes, nb);
+        free(meshes);
     }
-    return goxel.layers_mesh_;
+    return goxel.layers_mesh_.mesh;
 }
 
 const mesh_t *goxel_get_render_mesh(void)
 {
     uint32_t key, k;
-    const mesh_t *mesh;
-    layer_t *layer;
+    const mesh_t **meshes = NULL;
+    const mesh_t *stack[3];
+    int nb;
 
     if (!goxel.tool_mesh)
         return goxel_get_layers_mesh();
@@ -839,26 +869,51 @@ const mesh_t *goxel_get_render_mesh(void)
     key = mesh_get_key(goxel_get_layers_mesh());
     k = mesh_get_key(goxel.tool_mesh);
     key = crc32(key, (void*)&k, sizeof(k));
-    if (key != goxel.render_mesh_hash) {
+    if (key != goxel.render_mesh_hash || !goxel.render_mesh_.mesh) {
         image_update(goxel.image);
         goxel.render_mesh_hash = key;
-        if (!goxel.render_mesh_) goxel.render_mesh_ = mesh_new();
-        mesh_clear(goxel.render_mesh_);
-        DL_FOREACH(goxel.image->layers, layer) {
-            if (!layer->visible) continue;
-            mesh = layer->mesh;
-            if (mesh == goxel.image->active_layer->mesh)
-                mesh = goxel.tool_mesh;
-            mesh_merge(goxel.render_mesh_, mesh, MODE_OVER, NULL);
-        }
+        // The layers below and above the active one don't change during a
+        // tool preview, so we merge them separately, and then only have to
+        // merge below + tool mesh + above on the blocks the tool changed.
+        nb = get_visible_meshes(&meshes, -1);
+        stack[0] = mesh_stack_update(&goxel.render_below_, meshes, nb);
+        nb = get_visible_meshes(&meshes, +1);
+        stack[2] = mesh_stack_update(&goxel.render_above_, meshes, nb);
+        stack[1] = goxel.tool_mesh;
+        // Hidden active layer: skip the tool mesh.
+        if (!goxel.image->active_layer->visible) stack[1] = stack[2];
+        mesh_stack_update(&goxel.render_mesh_, stack,
+                          goxel.image->active_layer->visible ? 3 : 2);
+        free(meshes);
     }
-    return goxel.render_mesh_;
+    return goxel.render_mesh_.mesh;
+}
+
+// Merge a group of layers using the same material into a single layer.
+static void add_render_layers_group(layer_t *group, const mesh_t **meshes,
+                                    int nb, bool with_tool)
+{
+    int i;
+    if (with_tool) {
+        // The group with the tool mesh changes at each preview frame, so
+        // we use a mesh stack to only merge the modified blocks.
+        mesh_set(group->mesh,
+                 mesh_stack_update(&goxel.render_layers_active_, meshes, nb));
+    } else {
+        mesh_set(group->mesh, meshes[0]);
+        for (i = 1; i < nb; i++)
+            mesh_merge(group->mesh, meshes[i], MODE_OVER, NULL);
+    }
+    DL_APPEND(goxel.render_layers, group);
 }
 
 const layer_t *goxel_get_render_layers(bool with_tool_preview)
 {
     uint32_t hash, k;
-    layer_t *l, *layer, *tmp;
+    layer_t *l, *layer, *tmp, *group = NULL;
+    const mesh_t **meshes = NULL;
+    int nb = 0;
+    bool tool = false;
 
     hash = image_get_key(goxel.image);
     if (with_tool_preview && goxel.tool_mesh) {
@@ -878,23 +933,23 @@ const layer_t *goxel_get_render_layers(bool with_tool_preview)
         DL_FOREACH(goxel.image->layers, l) {
             if (!l->visible) continue;
             if (!l->mesh) continue;
-            layer = layer_copy(l);
+            if (!group || group->material != l->material) {
+                if (group) add_render_layers_group(group, meshes, nb, tool);
+                group = layer_copy(l);
+                nb = 0;
+                tool = false;
+            }
+            meshes = realloc(meshes, (nb + 1) * sizeof(*meshes));
+            meshes[nb++] = l->mesh;
             if (    with_tool_preview && goxel.tool_mesh &&
                     l->mesh == goxel.image->active_layer->mesh)
             {
-                mesh_set(layer->mesh, goxel.tool_mesh);
-            }
-
-            if (    goxel.render_layers &&
-                    goxel.render_layers->prev->material == layer->material)
-            {
-                mesh_merge(goxel.render_layers->prev->mesh, layer->mesh,
-                           MODE_OVER, NULL);
-                layer_delete(layer);
-            } else {
-                DL_APPEND(goxel.render_layers, layer);
+                meshes[nb - 1] = goxel.tool_mesh;
+                tool = true;
             }
         }
+        if (group) add_render_layers_group(group, meshes, nb, tool);
+        free(meshes);
     }
     return goxel.render_layers;
 }
@@ -919,6 +974,7 @@ void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp)
     mat4_copy(camera->proj_mat, rend.proj_mat);
     rend.fbo = fbo->framebuffer;
     rend.scale = 1.0;
+    rend.items = NULL;
 
     // XXX: use goxel_get_render_layers!
     render_mesh(&rend, mesh, NULL, 0);
@@ -930,6 +986,41 @@ void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp)
     texture_delete(fbo);
 }
 
+// Render an image from its active camera into an RGB[A] buffer, without
+// using OpenGL.
+void goxel_render_preview(const image_t *img, uint8_t *buf,
+                          int w, int h, int bpp)
+{
+    const camera_t *cam = img->active_camera ?: img->cameras;
+    camera_t *camera = cam ? camera_copy(cam) : camera_new("preview");
+    renderer_t rend = goxel.rend;
+    const layer_t *layer;
+    const mesh_t *mesh;
+    mesh_t *merged = NULL;
+
+    // For the current image we can use the cached layers mesh.
+    if (img == goxel.image) {
+        mesh = goxel_get_layers_mesh();
+    } else {
+        merged = mesh_new();
+        DL_FOREACH(img->layers, layer) {
+            if (!layer->visible || !layer->mesh) continue;
+            mesh_merge(merged, layer->mesh, MODE_OVER, NULL);
+        }
+        mesh = merged;
+    }
+
+    camera->aspect = (float)w / h;
+    camera_update(camera);
+    mat4_copy(camera->view_mat, rend.view_mat);
+    mat4_copy(camera->proj_mat, rend.proj_mat);
+    rend.items = NULL;
+    soft_render(&rend, mesh, w, h, bpp,
+                (bpp == 3) ? goxel.back_color : NULL, buf);
+    camera_delete(camera);
+    mesh_delete(merged);
+}
+
 
 static void export_as(const char *type, const char *path)
 {
@@ -989,6 +1080,7 @@ void goxel_import_image_plane(const char *path)
     sprintf(layer->name, "img");
     layer->image = tex;
     mat4_iscale(layer->mat, layer->image->w, layer->image->h, 1);
+    layer_touch(layer);
 }
 
 void goxel_on_low_memory(void)
@@ -1012,6 +1104,7 @@ static int goxel_import_file(const char *path)
 {
     const action_t *a = NULL;
     if (str_endswith(path, ".gox")) {
+        journal_new_document();
         load_from_file(path);
         return 0;
     }
@@ -1160,6 +1253,7 @@ static int view_default(const action_t *a, lua_State *l)
     mat4_set_identity(camera->mat);
     mat4_irotate(camera->mat, M_PI / 4, 1, 0, 0);
     mat4_itranslate(camera->mat, 0, 0, dist);
+    camera_touch(camera);
     return 0;
 }
 
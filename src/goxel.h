@@ -31,6 +31,7 @@
 
 #include "action.h"
 #include "assets.h"
+#include "autosave.h"
 #include "block_def.h"
 #include "camera.h"
 #include "gesture.h"
@@ -38,6 +39,7 @@
 #include "gui.h"
 #include "image.h"
 #include "inputs.h"
+#include "journal.h"
 #include "layer.h"
 #include "log.h"
 #include "luagoxel.h"
@@ -50,6 +52,7 @@
 #include "pathtracer.h"
 #include "render.h"
 #include "shape.h"
+#include "soft_render.h"
 #include "system.h"
 #include "theme.h"
 #include "tools.h"
@@ -57,6 +60,7 @@
 #include "uthash.h"
 #include "utlist.h"
 
+#include "utils/arena.h"
 #include "utils/box.h"
 #include "utils/cache.h"
 #include "utils/gl.h"
@@ -457,14 +461,19 @@ typedef struct goxel
     // during render.
     mesh_t     *tool_mesh;
 
-    mesh_t     *layers_mesh_;
+    mesh_stack_t layers_mesh_;
     uint32_t   layers_mesh_hash;
 
-    mesh_t     *render_mesh_; // All the layers + tool mesh.
+    mesh_stack_t render_mesh_; // All the layers + tool mesh.
     uint32_t   render_mesh_hash;
+    // Merge of the layers below and above the active layer, so that during
+    // a tool preview we only merge below + tool mesh + above.
+    mesh_stack_t render_below_;
+    mesh_stack_t render_above_;
 
     layer_t    *render_layers;
     uint32_t   render_layers_hash;
+    mesh_stack_t render_layers_active_; // Group of the tool mesh.
 
     struct     {
         mesh_t *mesh;
@@ -517,6 +526,7 @@ typedef struct goxel
     bool       quit;        // Set to true to quit the application.
 
     int        view_effects; // EFFECT_WIREFRAME | EFFECT_GRID | EFFECT_EDGES
+    int        autosave_interval; // In seconds, 0 to disable autosave.
 
     struct {
         gesture_t drag;
@@ -586,7 +596,19 @@ void goxel_import_image_plane(const char *path);
 // Render the view into an RGB[A] buffer.
 void goxel_render_to_buf(uint8_t *buf, int w, int h, int bpp);
 
-void save_to_file(const image_t *img, const char *path, bool with_preview);
+// Render a preview of an image from its active camera, using the CPU
+// renderer (no GL needed).  Must be called from the main thread.
+void goxel_render_preview(const image_t *img, uint8_t *buf,
+                          int w, int h, int bpp);
+
+// Return -1 in case of error.
+int save_to_file(const image_t *img, const char *path, bool with_preview);
+
+// Same as save_to_file, but optionally report the fraction of blocks
+// written in progress.  Can be used from a background thread on a copy of
+// the image, without preview.
+int gox_write(const image_t *img, const char *path, bool with_preview,
+              float *progress);
 int load_from_file(const char *path);
 
 // Iter info of a gox file, without actually reading it.
@@ -596,6 +618,13 @@ int gox_iter_infos(const char *path,
                                    void *value, void *user),
                    void *user);
 
+// Iter the layers of a gox file, without reading the blocks.
+// The iteration stops if the callback returns a non zero value.
+int gox_iter_layers(const char *path,
+                    int (*callback)(int index, const char *name,
+                                    int nb_blocks, void *user),
+                    void *user);
+
 void wavefront_export(const mesh_t *mesh, const char *path);
 void ply_export(const mesh_t *mesh, const char *path);
 
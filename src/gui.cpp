@@ -1518,8 +1518,9 @@ bool gui_layer_item(int i, int icon, bool *visible, bool *edit,
         ImGui::PushStyleVar(ImGuiStyleVar_FramePadding,
                             ImVec2(theme->sizes.item_padding_h,
                             (theme->sizes.icons_height - font_size) / 2));
-        ImGui::InputText("##name_edit", name, len,
-                         ImGuiInputTextFlags_AutoSelectAll);
+        if (ImGui::InputText("##name_edit", name, len,
+                             ImGuiInputTextFlags_AutoSelectAll))
+            ret = true;
         if (!start_edit && !ImGui::IsItemActive()) edit_name = NULL;
         start_edit = false;
         ImGui::PopStyleVar();
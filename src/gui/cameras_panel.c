@@ -23,11 +23,14 @@ void gui_cameras_panel(void)
     camera_t *cam;
     int i = 0;
     bool current;
+    char name[sizeof(cam->name)];
     gui_group_begin(NULL);
     DL_FOREACH(goxel.image->cameras, cam) {
         current = goxel.image->active_camera == cam;
+        strcpy(name, cam->name);
         if (gui_layer_item(i, -1, NULL, &current, cam->name, sizeof(cam->name))) {
-            goxel.image->active_camera = cam;
+            if (current) goxel.image->active_camera = cam;
+            if (strcmp(name, cam->name) != 0) camera_touch(cam);
         }
         i++;
     }
@@ -44,7 +47,8 @@ void gui_cameras_panel(void)
 
 
     cam = goxel.image->active_camera;
-    gui_input_float("dist", &cam->dist, 10.0, 0, 0, NULL);
+    if (gui_input_float("dist", &cam->dist, 10.0, 0, 0, NULL))
+        camera_touch(cam);
 
     /*
     gui_group_begin("Offset");
@@ -55,7 +59,8 @@ void gui_cameras_panel(void)
 
     gui_quat("Rotation", cam->rot);
     */
-    gui_checkbox("Ortho", &cam->ortho, NULL);
+    if (gui_checkbox("Ortho", &cam->ortho, NULL))
+        camera_touch(cam);
 
     gui_group_begin("Set");
     gui_action_button("view_left", "left", 0.5, ""); gui_same_line();
@@ -18,21 +18,52 @@
 
 #include "goxel.h"
 
+// Show the memory used by each undo history state.
+static void gui_history_mem(void)
+{
+    const image_t *img = goxel.image, *hist;
+    uint64_t total = 0;
+    bool compressed;
+    int i = 0;
+
+    DL_FOREACH2(img->history, hist, history_next) {
+        if (hist == img) continue;
+        total += image_history_get_mem(hist, NULL);
+    }
+    gui_text("History mem: %dK", (int)(total / (1 << 10)));
+    DL_FOREACH2(img->history, hist, history_next) {
+        if (hist == img) {
+            gui_text("%d: current", i++);
+            continue;
+        }
+        gui_text("%d: %dK%s", i++,
+                 (int)(image_history_get_mem(hist, &compressed) / (1 << 10)),
+                 compressed ? " (compressed)" : "");
+    }
+}
+
 void gui_debug_panel(void)
 {
     mesh_global_stats_t stats;
+    render_stats_t render_stats;
 
     gui_text("FPS: %d", (int)round(goxel.fps));
     mesh_get_global_stats(&stats);
     gui_text("Nb meshes: %d", stats.nb_meshes);
     gui_text("Nb blocks: %d", stats.nb_blocks);
     gui_text("Mem: %dM", (int)(stats.mem / (1 << 20)));
+    render_get_stats(&render_stats);
+    gui_text("Render items: %d", render_stats.nb_items);
+    gui_text("Render items mem max: %dK",
+             (int)(render_stats.items_mem_max / (1 << 10)));
 
     if (!DEFINED(GLES2)) {
         gui_checkbox_flag("Show wireframe", &goxel.view_effects,
                           EFFECT_WIREFRAME, NULL);
     }
 
+    gui_history_mem();
+
     if (gui_button("Clear undo history", -1, 0)) {
         image_history_resize(goxel.image, 0);
     }
@@ -30,6 +30,7 @@ typedef struct {
  * somehow. */
 static const format_t FORMATS[] = {
     {"glTF (.gltf)", "export_as_gltf"},
+    {"glTF binary (.glb)", "export_as_glb"},
     {"Wavefront (.obj)", "export_as_obj"},
     {"Stanford (.pny)", "export_as_ply"},
     {"Png", "export_as_png"},
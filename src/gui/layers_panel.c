@@ -29,8 +29,10 @@ static void toggle_layer_only_visible(layer_t *layer)
             break;
         }
     }
-    DL_FOREACH(goxel.image->layers, other)
+    DL_FOREACH(goxel.image->layers, other) {
         other->visible = others_all_invisible;
+        layer_touch(other);
+    }
     layer->visible = true;
 }
 
@@ -41,19 +43,24 @@ void gui_layers_panel(void)
     material_t *material;
     int i = 0, icon, bbox[2][3];
     bool current, visible, bounded;
+    char name[sizeof(layer->name)];
 
     gui_group_begin(NULL);
     DL_FOREACH(goxel.image->layers, layer) {
         current = goxel.image->active_layer == layer;
         visible = layer->visible;
         icon = layer->base_id ? ICON_LINK : layer->shape ? ICON_SHAPE : -1;
+        strcpy(name, layer->name);
         gui_layer_item(i, icon, &visible, &current,
                        layer->name, sizeof(layer->name));
+        // Only selecting the layer should not change the image key.
+        if (strcmp(name, layer->name) != 0) layer_touch(layer);
         if (current && goxel.image->active_layer != layer) {
             goxel.image->active_layer = layer;
         }
         if (visible != layer->visible) {
             layer->visible = visible;
+            layer_touch(layer);
             if (gui_is_key_down(KEY_LEFT_SHIFT))
                 toggle_layer_only_visible(layer);
         }
@@ -107,19 +114,22 @@ void gui_layers_panel(void)
         } else {
             mat4_copy(mat4_zero, layer->box);
         }
+        layer_touch(layer);
     }
 
     if (layer->shape) {
         tool_gui_drag_mode(&goxel.tool_drag_mode);
-        tool_gui_shape(&layer->shape);
-        gui_color("##color", layer->color);
+        if (tool_gui_shape(&layer->shape)) layer_touch(layer);
+        if (gui_color("##color", layer->color)) layer_touch(layer);
     }
 
     gui_text("Material");
     if (gui_combo_begin("##material", layer->material)) {
         DL_FOREACH(goxel.image->materials, material) {
-            if (gui_combo_item(material->name, material == layer->material))
+            if (gui_combo_item(material->name, material == layer->material)) {
                 layer->material = material;
+                layer_touch(layer);
+            }
         }
         gui_combo_end();
     }
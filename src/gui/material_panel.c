@@ -23,18 +23,21 @@ void gui_material_panel(void)
     material_t *mat = NULL;
     int i = 0;
     bool is_current;
+    char name[sizeof(mat->name)];
     float base_color_e, emission_e, emission;
 
     gui_group_begin(NULL);
     DL_FOREACH(goxel.image->materials, mat) {
         is_current = goxel.image->active_material == mat;
+        strcpy(name, mat->name);
         if (gui_layer_item(i, -1, NULL, &is_current, mat->name,
                            sizeof(mat->name))) {
             if (is_current) {
                 goxel.image->active_material = mat;
-            } else {
+            } else if (goxel.image->active_material == mat) {
                 goxel.image->active_material = NULL;
             }
+            if (strcmp(name, mat->name) != 0) material_touch(mat);
         }
         i++;
     }
@@ -48,8 +51,10 @@ void gui_material_panel(void)
     if (!mat) return;
 
     gui_group_begin(NULL);
-    gui_input_float("Metallic", &mat->metallic, 0.1, 0, 1, NULL);
-    gui_input_float("Roughness", &mat->roughness, 0.1, 0, 1, NULL);
+    if (gui_input_float("Metallic", &mat->metallic, 0.1, 0, 1, NULL))
+        material_touch(mat);
+    if (gui_input_float("Roughness", &mat->roughness, 0.1, 0, 1, NULL))
+        material_touch(mat);
     gui_group_end();
 
     // Internally the material has an emission color independant of the
@@ -63,11 +68,14 @@ void gui_material_panel(void)
 
     if (gui_color_small_f3("Color", mat->base_color)) {
         vec3_mul(mat->base_color, emission, mat->emission);
+        material_touch(mat);
     }
 
     if (gui_input_float("Emission", &emission, 0.1, 0, 10, NULL)) {
         vec3_mul(mat->base_color, emission, mat->emission);
+        material_touch(mat);
     }
 
-    gui_input_float("Opacity", &mat->base_color[3], 0.1, 0, 1, NULL);
+    if (gui_input_float("Opacity", &mat->base_color[3], 0.1, 0, 1, NULL))
+        material_touch(mat);
 }
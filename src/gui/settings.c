@@ -58,6 +58,9 @@ bool gui_settings_popup(void *data)
 
     free(names);
 
+    gui_text("Autosave interval (seconds, 0 to disable)");
+    gui_input_int("##autosave", &goxel.autosave_interval, 0, 24 * 3600);
+
     // For the moment I disable the theme editor!
 #if 0
     int group;
@@ -108,6 +111,11 @@ static int settings_ini_handler(void *user, const char *section,
             theme_set(value);
         }
     }
+    if (strcmp(section, "autosave") == 0) {
+        if (strcmp(name, "interval") == 0) {
+            goxel.autosave_interval = atoi(value);
+        }
+    }
     if (strcmp(section, "shortcuts") == 0) {
         if ((a = action_get(name, false))) {
             strncpy(a->shortcut, value, sizeof(a->shortcut) - 1);
@@ -146,6 +154,8 @@ static void settings_save(void)
     file = fopen(path, "w");
     fprintf(file, "[ui]\n");
     fprintf(file, "theme=%s\n", theme_get()->name);
+    fprintf(file, "[autosave]\n");
+    fprintf(file, "interval=%d\n", goxel.autosave_interval);
 
     fprintf(file, "[shortcuts]\n");
     actions_iter(shortcut_save_callback, file);
@@ -53,6 +53,8 @@ static int gui_mode_select(void)
 
 void gui_top_bar(void)
 {
+    float progress;
+
     gui_action_button("undo", NULL, 0, "");
     gui_same_line();
     gui_action_button("redo", NULL, 0, "");
@@ -62,6 +64,11 @@ void gui_top_bar(void)
     gui_mode_select();
     gui_same_line();
     gui_color("##color", goxel.painter.color);
+    progress = autosave_get_progress();
+    if (progress >= 0) {
+        gui_same_line();
+        gui_text("Autosave %d%%", (int)(progress * 100));
+    }
 }
 
 #endif // GUI_CUSTOM_TOPBAR
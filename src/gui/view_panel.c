@@ -68,4 +68,6 @@ void gui_view_panel(void)
         gui_checkbox_flag("Smooth Colors", &goxel.rend.settings.effects,
                           EFFECT_MC_SMOOTH, NULL);
     }
+    gui_checkbox_flag("Ray marching",
+                &goxel.rend.settings.effects, EFFECT_VOLUME, NULL);
 }
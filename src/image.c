@@ -18,7 +18,17 @@
 
 #include "goxel.h"
 
-#include <zlib.h> // For crc32
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define N BLOCK_SIZE
+
+static uint64_t g_version = 0; // Global images version counter.
+
+#ifndef HISTORY_MEM_BUDGET
+#   define HISTORY_MEM_BUDGET (512 * MB)
+#endif
 
 /* History
     the images undo history is stored in a linked list.  Every time we call
@@ -47,6 +57,10 @@
     |        |       |        |       |        |     |        |
     +--------+       +--------+       +--------+     +--------+
 
+    The snapshots share their blocks with the image, so they only use
+    memory for the blocks that changed.  When this memory is bigger than
+    HISTORY_MEM_BUDGET, we compress the unique blocks of the oldest
+    snapshots (see image_history_iter), and decompress them on undo.
 
 */
 
@@ -125,23 +139,37 @@ static layer_t *layer_clone(layer_t *other)
     layer->material = other->material;
     layer->mesh = mesh_copy(other->mesh);
     mat4_set_identity(layer->mat);
+    layer_touch(layer);
     layer->base_id = other->id;
     layer->base_mesh_key = mesh_get_key(other->mesh);
+    layer->base_mesh = mesh_copy(other->mesh);
+    mat4_set_identity(layer->base_mat);
     return layer;
 }
 
 // Make sure the layer mesh is up to date.
 void image_update(image_t *img)
 {
-    painter_t painter = {};
     uint32_t key;
     layer_t *layer, *base;
 
     DL_FOREACH(img->layers, layer) {
         base = img_get_layer(img, layer->base_id);
         if (base && layer->base_mesh_key != mesh_get_key(base->mesh)) {
-            mesh_set(layer->mesh, base->mesh);
-            mesh_move(layer->mesh, layer->mat);
+            // Only update the parts of the clone that depend on the base
+            // blocks modified since the last update.
+            if (    layer->base_mesh &&
+                    memcmp(layer->base_mat, layer->mat, sizeof(layer->mat))
+                    == 0) {
+                mesh_move_update(layer->mesh, base->mesh, layer->base_mesh,
+                                 layer->mat);
+                mesh_set(layer->base_mesh, base->mesh);
+            } else {
+                mesh_move_update(layer->mesh, base->mesh, NULL, layer->mat);
+                mesh_delete(layer->base_mesh);
+                layer->base_mesh = mesh_copy(base->mesh);
+                mat4_copy(layer->mat, layer->base_mat);
+            }
             layer->base_mesh_key = mesh_get_key(base->mesh);
         }
         if (layer->shape) {
@@ -149,12 +177,8 @@ void image_update(image_t *img)
             key = crc32(key, (void*)layer->shape, sizeof(layer->shape));
             key = crc32(key, (void*)layer->color, sizeof(layer->color));
             if (key != layer->shape_key) {
-                painter.mode = MODE_OVER;
-                painter.shape = layer->shape;
-                painter.box = &goxel.image->box;
-                vec4_copy(layer->color, painter.color);
-                mesh_clear(layer->mesh);
-                mesh_op(layer->mesh, &painter, layer->mat);
+                mesh_rasterize_shape(layer->mesh, layer->shape, layer->mat,
+                                     layer->color, img->box);
                 layer->shape_key = key;
             }
         }
@@ -229,9 +253,17 @@ static image_t *image_snap(image_t *other)
     }
 
     img->history = img->history_next = img->history_prev = NULL;
+    img->history_mem_dirty = true;
     return img;
 }
 
+image_t *image_copy(image_t *img)
+{
+    return image_snap(img);
+}
+
+
+static void snap_pack_finish(void);
 
 void image_delete(image_t *img)
 {
@@ -241,6 +273,8 @@ void image_delete(image_t *img)
     material_t *mat;
 
     if (!img) return;
+    // Make sure we are not compressing one of the snapshots.
+    if (img->history) snap_pack_finish();
 
     while ((layer = img->layers)) {
         DL_DELETE(img->layers, layer);
@@ -283,8 +317,10 @@ layer_t *image_add_layer(image_t *img, layer_t *layer)
     layer->visible = true;
     layer->id = img_get_new_id(img);
     layer->material = img->active_material;
+    layer_touch(layer);
     DL_APPEND(img->layers, layer);
     img->active_layer = layer;
+    image_touch(img);
     return layer;
 }
 
@@ -303,9 +339,11 @@ layer_t *image_add_shape_layer(image_t *img)
         vec3_copy(img->box[3], layer->mat[3]);
         mat4_iscale(layer->mat, 4, 4, 4);
     }
+    layer_touch(layer);
     layer->id = img_get_new_id(img);
     DL_APPEND(img->layers, layer);
     img->active_layer = layer;
+    image_touch(img);
     return layer;
 }
 
@@ -332,6 +370,7 @@ void image_delete_layer(image_t *img, layer_t *layer)
         DL_APPEND(img->layers, layer);
     }
     if (!img->active_layer) img->active_layer = img->layers->prev;
+    image_touch(img);
 }
 
 void image_move_layer(image_t *img, layer_t *layer, int d)
@@ -349,6 +388,7 @@ void image_move_layer(image_t *img, layer_t *layer, int d)
     if (!other || !layer) return;
     DL_DELETE(img->layers, layer);
     DL_PREPEND_ELEM(img->layers, other, layer);
+    image_touch(img);
 }
 
 static void image_move_layer_up(image_t *img, layer_t *layer)
@@ -368,9 +408,11 @@ layer_t *image_duplicate_layer(image_t *img, layer_t *other)
     other = other ?: img->active_layer;
     layer = layer_copy(other);
     layer->visible = true;
+    layer_touch(layer);
     layer->id = img_get_new_id(img);
     DL_APPEND(img->layers, layer);
     img->active_layer = layer;
+    image_touch(img);
     return layer;
 }
 
@@ -384,6 +426,7 @@ layer_t *image_clone_layer(image_t *img, layer_t *other)
     layer->id = img_get_new_id(img);
     DL_APPEND(img->layers, layer);
     img->active_layer = layer;
+    image_touch(img);
     return layer;
 }
 
@@ -392,7 +435,11 @@ void image_unclone_layer(image_t *img, layer_t *layer)
     img = img ?: goxel.image;
     layer = layer ?: img->active_layer;
     layer->base_id = 0;
+    mesh_delete(layer->base_mesh);
+    layer->base_mesh = NULL;
     layer->shape = NULL;
+    layer_touch(layer);
+    image_touch(img);
 }
 
 void image_select_parent_layer(image_t *img, layer_t *layer)
@@ -417,6 +464,7 @@ void image_merge_visible_layers(image_t *img)
         last = layer;
     }
     if (last) img->active_layer = last;
+    image_touch(img);
 }
 
 
@@ -430,6 +478,7 @@ camera_t *image_add_camera(image_t *img, camera_t *cam)
     }
     DL_APPEND(img->cameras, cam);
     img->active_camera = cam;
+    image_touch(img);
     return cam;
 }
 
@@ -442,6 +491,7 @@ void image_delete_camera(image_t *img, camera_t *cam)
     if (cam == img->active_camera)
         img->active_camera = img->cameras;
     camera_delete(cam);
+    image_touch(img);
 }
 
 void image_move_camera(image_t *img, camera_t *cam, int d)
@@ -461,6 +511,7 @@ void image_move_camera(image_t *img, camera_t *cam, int d)
     if (!other || !cam) return;
     DL_DELETE(img->cameras, cam);
     DL_PREPEND_ELEM(img->cameras, other, cam);
+    image_touch(img);
 }
 
 static void image_move_camera_up(image_t *img, camera_t *cam)
@@ -484,6 +535,7 @@ material_t *image_add_material(image_t *img, material_t *mat)
     assert(!mat->prev);
     DL_APPEND(img->materials, mat);
     img->active_material = mat;
+    image_touch(img);
     return mat;
 }
 
@@ -497,8 +549,13 @@ void image_delete_material(image_t *img, material_t *mat)
     DL_DELETE(img->materials, mat);
     if (mat == img->active_material) img->active_material = NULL;
     material_delete(mat);
-    DL_FOREACH(img->layers, layer)
-        if (layer->material == mat) layer->material = NULL;
+    DL_FOREACH(img->layers, layer) {
+        if (layer->material == mat) {
+            layer->material = NULL;
+            layer_touch(layer);
+        }
+    }
+    image_touch(img);
 }
 
 void image_set(image_t *img, image_t *other)
@@ -514,6 +571,7 @@ void image_set(image_t *img, image_t *other)
         if (other_layer == other->active_layer)
             img->active_layer = layer;
     }
+    image_touch(img);
 }
 
 #if 0 // For debugging purpose.
@@ -532,8 +590,12 @@ static void debug_print_history(image_t *img) {}
 
 void image_history_push(image_t *img)
 {
-    image_t *snap = image_snap(img);
-    image_t *hist;
+    image_t *snap, *hist;
+
+    snap_pack_finish();
+    // Make sure each undo state is a transaction in the journal.
+    journal_record(img, NULL);
+    snap = image_snap(img);
 
     // Discard previous undo.
     while ((hist = img->history_next)) {
@@ -542,35 +604,303 @@ void image_history_push(image_t *img)
         image_delete(hist);
     }
 
+    // The blocks the previous snapshot shared with the image might now be
+    // unique to it.
+    if (img->history != img) img->history_prev->history_mem_dirty = true;
     DL_DELETE2(img->history, img,  history_prev, history_next);
     DL_APPEND2(img->history, snap, history_prev, history_next);
     DL_APPEND2(img->history, img,  history_prev, history_next);
+    img->history_dirty = true;
     debug_print_history(img);
 }
 
+static void history_drop_oldest(image_t *img)
+{
+    image_t *hist = img->history;
+
+    snap_pack_finish();
+    assert(hist != img);
+    DL_DELETE2(img->history, hist, history_prev, history_next);
+    // The snapshot is not linked to the history anymore, so image_delete
+    // only releases its layers, cameras and materials.
+    assert(!hist->history);
+    image_delete(hist);
+    img->history->history_mem_dirty = true;
+}
+
+// Drop the redo state the furthest from the image.
+static void history_drop_last_redo(image_t *img)
+{
+    image_t *hist = img->history->history_prev; // Tail of the list.
+
+    snap_pack_finish();
+    assert(hist != img);
+    DL_DELETE2(img->history, hist, history_prev, history_next);
+    assert(!hist->history);
+    image_delete(hist);
+    img->history->history_prev->history_mem_dirty = true;
+}
+
 void image_history_resize(image_t *img, int size)
 {
     int i, nb = 0;
     image_t *hist;
-    layer_t *layer, *layer_tmp;
 
     // First cound the size of the history to compute how many we are going
     // to remove.
     for (hist = img->history; hist != img; hist = hist->history_next) nb++;
     nb = max(0, nb - size);
-    for (i = 0; i < nb; i++) {
-        hist = img->history;
+    for (i = 0; i < nb; i++) history_drop_oldest(img);
+}
 
-        // XXX: do that in a function!
-        DL_FOREACH_SAFE(hist->layers, layer, layer_tmp) {
-            DL_DELETE(hist->layers, layer);
-            layer_delete(layer);
+// Block record in the packed snapshots data.
+typedef struct {
+    int32_t pos[3];
+    uint8_t voxels[N * N * N][4];
+} packed_block_t;
+
+// Unique blocks of a layer, being compressed in the background.
+typedef struct {
+    layer_t     *layer;
+    mesh_t      *blocks;
+    uint8_t     *packed;
+    size_t      packed_size;
+} pack_entry_t;
+
+// History snapshot compression job.  There is at most one running at a
+// time, and all the functions that could touch the snapshot first wait
+// for it to finish.
+static struct {
+    image_t         *snap;      // The snapshot being packed, or NULL.
+    pack_entry_t    *entries;
+    int             nb;
+    bool            threaded;
+    pthread_t       thread;
+    volatile bool   done;
+} g_pack = {};
+
+// Compress some data into a growing buffer.
+static void deflate_data(z_stream *z, uint8_t **out, size_t *capacity,
+                         const void *data, size_t size, int flush)
+{
+    size_t used;
+    int r;
+
+    z->next_in = (void*)data;
+    z->avail_in = size;
+    while (true) {
+        used = z->next_out - *out;
+        if (used == *capacity) {
+            *capacity *= 2;
+            *out = realloc(*out, *capacity);
+        }
+        z->next_out = *out + used;
+        z->avail_out = min(*capacity - used, (size_t)UINT_MAX);
+        r = deflate(z, flush);
+        if (flush == Z_FINISH) {
+            if (r == Z_STREAM_END) break;
+        } else if (z->avail_in == 0 && z->avail_out != 0) {
+            break;
         }
-        DL_DELETE2(img->history, hist, history_prev, history_next);
-        free(hist);
     }
 }
 
+// Compress all the blocks of a mesh.  Called from the pack thread.
+static uint8_t *pack_blocks(const mesh_t *blocks, size_t *size)
+{
+    z_stream z = {};
+    size_t capacity = 1 << 16;
+    uint8_t *out = malloc(capacity);
+    mesh_iterator_t iter;
+    int bpos[3];
+    int32_t pos[3];
+    const void *data;
+
+    deflateInit(&z, Z_DEFAULT_COMPRESSION);
+    z.next_out = out;
+    iter = mesh_get_iterator(blocks, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        data = mesh_get_block_data(blocks, &iter, bpos, NULL);
+        pos[0] = bpos[0];
+        pos[1] = bpos[1];
+        pos[2] = bpos[2];
+        deflate_data(&z, &out, &capacity, pos, sizeof(pos), Z_NO_FLUSH);
+        deflate_data(&z, &out, &capacity, data, N * N * N * 4, Z_NO_FLUSH);
+    }
+    deflate_data(&z, &out, &capacity, NULL, 0, Z_FINISH);
+    *size = z.next_out - out;
+    deflateEnd(&z);
+    return realloc(out, *size);
+}
+
+// Decompress blocks packed with pack_blocks back into a mesh.
+static void unpack_blocks(mesh_t *mesh, const uint8_t *packed, size_t size)
+{
+    z_stream z = {};
+    packed_block_t *rec = malloc(sizeof(*rec));
+    mesh_t *blocks = mesh_new();
+    size_t remaining = size;
+    int r = Z_OK;
+
+    inflateInit(&z);
+    z.next_in = (uint8_t*)packed;
+    while (r == Z_OK) {
+        z.next_out = (uint8_t*)rec;
+        z.avail_out = sizeof(*rec);
+        while (z.avail_out && r == Z_OK) {
+            if (!z.avail_in) {
+                z.avail_in = min(remaining, (size_t)UINT_MAX);
+                remaining -= z.avail_in;
+            }
+            r = inflate(&z, Z_NO_FLUSH);
+        }
+        if (z.avail_out) break;
+        mesh_set_block(blocks, rec->pos, (uint8_t*)rec->voxels);
+    }
+    assert(r == Z_STREAM_END);
+    inflateEnd(&z);
+    free(rec);
+    mesh_restore_blocks(mesh, blocks);
+    mesh_delete(blocks);
+}
+
+static void *pack_thread(void *arg)
+{
+    int i;
+    pack_entry_t *entry;
+    for (i = 0; i < g_pack.nb; i++) {
+        entry = &g_pack.entries[i];
+        entry->packed = pack_blocks(entry->blocks, &entry->packed_size);
+    }
+    __atomic_store_n(&g_pack.done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Start to compress the unique blocks of all the layers of a snapshot.
+static void snap_pack_start(image_t *snap)
+{
+    layer_t *layer;
+    mesh_t *blocks;
+
+    assert(!g_pack.snap);
+    DL_FOREACH(snap->layers, layer) {
+        if (!layer->mesh || layer->packed) continue;
+        blocks = mesh_extract_unique_blocks(layer->mesh);
+        if (!blocks) continue;
+        g_pack.entries = realloc(g_pack.entries,
+                                 (g_pack.nb + 1) * sizeof(*g_pack.entries));
+        g_pack.entries[g_pack.nb++] = (pack_entry_t) {
+            .layer = layer,
+            .blocks = blocks,
+        };
+    }
+    g_pack.snap = snap;
+    g_pack.done = false;
+    g_pack.threaded =
+        pthread_create(&g_pack.thread, NULL, pack_thread, NULL) == 0;
+    if (!g_pack.threaded) pack_thread(NULL);
+}
+
+// Wait for the running snapshot compression, if any, and put the packed
+// data into the snapshot layers.
+static void snap_pack_finish(void)
+{
+    int i;
+    pack_entry_t *entry;
+
+    if (!g_pack.snap) return;
+    if (g_pack.threaded) pthread_join(g_pack.thread, NULL);
+    for (i = 0; i < g_pack.nb; i++) {
+        entry = &g_pack.entries[i];
+        entry->layer->packed = entry->packed;
+        entry->layer->packed_size = entry->packed_size;
+        // The blocks data is released here, from the main thread.
+        mesh_delete(entry->blocks);
+    }
+    g_pack.snap->history_mem_dirty = true;
+    free(g_pack.entries);
+    g_pack.entries = NULL;
+    g_pack.nb = 0;
+    g_pack.snap = NULL;
+}
+
+static void snap_unpack(image_t *snap)
+{
+    layer_t *layer;
+
+    DL_FOREACH(snap->layers, layer) {
+        if (!layer->packed) continue;
+        unpack_blocks(layer->mesh, layer->packed, layer->packed_size);
+        free(layer->packed);
+        layer->packed = NULL;
+        layer->packed_size = 0;
+    }
+}
+
+static bool snap_is_packed(const image_t *snap)
+{
+    const layer_t *layer;
+    DL_FOREACH(snap->layers, layer) {
+        if (layer->packed) return true;
+    }
+    return false;
+}
+
+static uint64_t snap_compute_mem(const image_t *snap)
+{
+    const layer_t *layer;
+    uint64_t ret = 0;
+    DL_FOREACH(snap->layers, layer) {
+        if (layer->mesh) ret += mesh_get_unique_mem(layer->mesh);
+        ret += layer->packed_size;
+    }
+    return ret;
+}
+
+uint64_t image_history_get_mem(const image_t *snap, bool *compressed)
+{
+    if (compressed) *compressed = snap_is_packed(snap);
+    return snap->history_mem;
+}
+
+void image_history_iter(image_t *img)
+{
+    image_t *hist;
+    uint64_t total = 0;
+
+    if (g_pack.snap) {
+        if (!__atomic_load_n(&g_pack.done, __ATOMIC_ACQUIRE)) return;
+        snap_pack_finish();
+    }
+    if (!img->history_dirty) return;
+    DL_FOREACH2(img->history, hist, history_next) {
+        if (hist == img) continue;
+        if (hist->history_mem_dirty) {
+            hist->history_mem = snap_compute_mem(hist);
+            hist->history_mem_dirty = false;
+        }
+        total += hist->history_mem;
+    }
+    if (total <= HISTORY_MEM_BUDGET) {
+        img->history_dirty = false;
+        return;
+    }
+
+    // Compress the oldest uncompressed snapshot in the background, and
+    // check again once it's done.  Only drop states if all of them are
+    // already compressed, starting with the undo states.
+    DL_FOREACH2(img->history, hist, history_next) {
+        if (hist == img) continue;
+        if (!snap_is_packed(hist) && hist->history_mem) {
+            snap_pack_start(hist);
+            return;
+        }
+    }
+    if (img->history != img) history_drop_oldest(img);
+    else if (img->history_next) history_drop_last_redo(img);
+    else img->history_dirty = false;
+}
+
 // XXX: not clear what this is doing.  We should try to remove it.
 // It swap the content of two images without touching their pointer or
 // history.
@@ -582,6 +912,15 @@ static void swap(image_t *a, image_t *b)
     SWAP(a->history_prev, b->history_prev);
 }
 
+// Mark the memory of the snapshots around the image as dirty, since they
+// might share different blocks with it after an undo or redo.
+static void image_history_touch_neighbours(image_t *img)
+{
+    if (img->history != img) img->history_prev->history_mem_dirty = true;
+    if (img->history_next) img->history_next->history_mem_dirty = true;
+    img->history_dirty = true;
+}
+
 void image_undo(image_t *img)
 {
     image_t *prev = img->history_prev;
@@ -589,9 +928,12 @@ void image_undo(image_t *img)
         LOG_D("No more undo");
         return;
     }
+    snap_pack_finish();
+    snap_unpack(prev);
     DL_DELETE2(img->history, img, history_prev, history_next);
     DL_PREPEND_ELEM2(img->history, prev, img, history_prev, history_next);
     swap(img, prev);
+    image_history_touch_neighbours(img);
     debug_print_history(img);
 }
 
@@ -602,9 +944,12 @@ void image_redo(image_t *img)
         LOG_D("No more redo");
         return;
     }
+    snap_pack_finish();
+    snap_unpack(next);
     DL_DELETE2(img->history, next, history_prev, history_next);
     DL_PREPEND_ELEM2(img->history, img, next, history_prev, history_next);
     swap(img, next);
+    image_history_touch_neighbours(img);
     debug_print_history(img);
 }
 
@@ -629,30 +974,24 @@ bool image_layer_can_edit(const image_t *img, const layer_t *layer)
     return !layer->base_id && !layer->image && !layer->shape;
 }
 
+void image_touch(image_t *img)
+{
+    img->version = ++g_version;
+}
+
 /*
  * Function: image_get_key
  * Return a value that is garantied to change when the image change.
  */
 uint32_t image_get_key(const image_t *img)
 {
-    uint32_t key = 0, k;
-    layer_t *layer;
-    camera_t *camera;
-    material_t *material;
+    uint64_t v[2] = {img->version, 0};
+    const layer_t *layer;
 
-    DL_FOREACH(img->layers, layer) {
-        k = layer_get_key(layer);
-        key = crc32(key, (void*)&k, sizeof(k));
-    }
-    DL_FOREACH(img->cameras, camera) {
-        k = camera_get_key(camera);
-        key = crc32(key, (void*)&k, sizeof(k));
-    }
-    DL_FOREACH(img->materials, material) {
-        k = material_get_hash(material);
-        key = crc32(key, (void*)&k, sizeof(k));
-    }
-    return key;
+    // The layers meshes are modified without touching the image.
+    DL_FOREACH(img->layers, layer)
+        v[1] = v[1] * 31 + mesh_get_key(layer->mesh);
+    return crc32(0, (void*)v, sizeof(v));
 }
 
 /*
@@ -685,6 +1024,8 @@ static void image_image_layer_to_mesh(image_t *img, layer_t *layer)
     }
     texture_delete(layer->image);
     layer->image = NULL;
+    layer_touch(layer);
+    image_touch(img);
     free(data);
 }
 
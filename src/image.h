@@ -42,6 +42,8 @@ struct image {
 
     float    box[4][4];
 
+    uint64_t version;       // Changed by image_touch.
+
     // For saving.
     // XXX: I think those should be persistend data of export code instead.
     char     *path;
@@ -52,10 +54,23 @@ struct image {
 
     image_t *history;
     image_t *history_next, *history_prev;
+    uint64_t history_mem;   // Memory used by a snapshot unique blocks.
+    bool     history_mem_dirty; // Set when history_mem needs to be updated.
+    bool     history_dirty; // Set when we need to check the history memory.
 };
 
 image_t *image_new(void);
 void image_delete(image_t *img);
+
+/*
+ * Function: image_copy
+ * Create a copy of an image, without the history.
+ *
+ * The layers meshes are copy on write, so this is fast and doesn't use
+ * much memory.  The copy shares its path with the original image, and
+ * should be deleted with image_delete.
+ */
+image_t *image_copy(image_t *img);
 layer_t *image_add_layer(image_t *img, layer_t *layer);
 void image_delete_layer(image_t *img, layer_t *layer);
 void image_move_layer(image_t *img, layer_t *layer, int d);
@@ -67,6 +82,26 @@ void image_undo(image_t *img);
 void image_redo(image_t *img);
 void image_history_resize(image_t *img, int size);
 
+/*
+ * Function: image_history_iter
+ * Keep the undo history memory under budget.
+ *
+ * Should be called once per frame.  When the history uses too much memory
+ * we compress the unique blocks of the oldest snapshots, one snapshot per
+ * call, and only drop the oldest states if this is not enough.
+ */
+void image_history_iter(image_t *img);
+
+/*
+ * Function: image_history_get_mem
+ * Return the memory used by an history snapshot.
+ *
+ * Parameters:
+ *   snap       - An image snapshot from the history list.
+ *   compressed - Set to true if the snapshot is compressed.  Can be NULL.
+ */
+uint64_t image_history_get_mem(const image_t *snap, bool *compressed);
+
 bool image_layer_can_edit(const image_t *img, const layer_t *layer);
 
 material_t *image_add_material(image_t *img, material_t *mat);
@@ -75,9 +110,21 @@ void image_delete_material(image_t *img, material_t *mat);
 camera_t *image_add_camera(image_t *img, camera_t *cam);
 void image_delete_camera(image_t *img, camera_t *cam);
 
+/*
+ * Function: image_touch
+ * Give a new version to an image.
+ *
+ * Must be called after any change to the image other than a layer mesh
+ * modification.  The image functions and the layers, cameras and materials
+ * touch functions already do it.
+ */
+void image_touch(image_t *img);
+
 /*
  * Function: image_get_key
  * Return a value that is guarantied to change when the image change.
+ *
+ * The key only depends on the image version and the layers meshes keys.
  */
 uint32_t image_get_key(const image_t *img);
 
@@ -0,0 +1,824 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include <pthread.h>
+#include <zlib.h>
+
+/*
+ * Journal file format:
+ *
+ *   "GOXJ" + int32 version
+ *   records: char type[4], int32 size, data[size]
+ *
+ * A transaction is a list of MATE, CAMR, LAYR and BLCK records, followed by
+ * a COMT record.  Incomplete transactions at the end of the file (if we
+ * crashed while writing) are ignored.  The data is written in the native
+ * byte order, since the journal is only meant to be used on the machine
+ * that created it.
+ */
+
+#define JOURNAL_VERSION 1
+// Time we wait after a change before we record it (seconds).
+#define RECORD_DELAY 2.0
+
+#define N BLOCK_SIZE
+
+// Same as in gox.c: snprintf without truncation warnings.
+#define copy_string(dst, src) ({ \
+    int r = snprintf(dst, sizeof(dst), "%s", src); \
+    if (r >= sizeof(dst)) LOG_W("String truncated"); \
+})
+
+typedef struct {
+    char    type[4];
+    int32_t size;
+} record_header_t;
+
+typedef struct {
+    char    name[128];
+    float   metallic;
+    float   roughness;
+    float   base_color[4];
+    float   emission[3];
+} material_record_t;
+
+typedef struct {
+    char    name[128];
+    int32_t ortho;
+    int32_t active;
+    float   dist;
+    float   fovy;
+    float   mat[4][4];
+} camera_record_t;
+
+typedef struct {
+    int32_t id;
+    int32_t base_id;
+    int32_t material;   // Index of the material, or -1.
+    int32_t shape;      // Index in SHAPES + 1, or 0.
+    int32_t visible;
+    uint8_t color[4];
+    char    name[256];
+    float   mat[4][4];
+    float   box[4][4];
+} layer_record_t;
+
+// Followed by the zlib compressed voxels, or nothing if the block has been
+// removed.
+typedef struct {
+    int32_t layer_id;
+    int32_t pos[3];
+} block_record_t;
+
+typedef struct {
+    float   box[4][4];
+    int32_t active_layer;
+    char    action[64];
+} commit_record_t;
+
+enum {
+    JOB_CREATE,
+    JOB_APPEND,
+    JOB_DELETE,
+};
+
+typedef struct {
+    uint8_t *data;
+    int     size;
+    int     capacity;
+} buffer_t;
+
+// Meshes of a layer to record in a transaction.  We compute the modified
+// blocks and compress them in the writer thread.  The meshes are copies,
+// and must be deleted from the main thread.
+typedef struct {
+    int     id;
+    mesh_t  *mesh;  // The layer mesh.
+    mesh_t  *base;  // The layer mesh at the previous transaction, or NULL.
+} job_layer_t;
+
+typedef struct job job_t;
+struct job {
+    job_t           *next, *prev;
+    int             type;
+    char            *path;
+    uint8_t         *data;
+    int             size;
+    job_layer_t     *layers;    // Blocks to add before the commit record.
+    int             nb_layers;
+    commit_record_t commit;
+};
+
+// Copy of a layer mesh at the time of the last transaction.
+typedef struct {
+    int     id;
+    mesh_t  *mesh;
+} base_layer_t;
+
+static struct {
+    image_t         *img;
+    char            path[1024];
+    uint32_t        key;            // Image key at the last transaction.
+    double          change_time;    // Time we noticed the change, or 0.
+    base_layer_t    *layers;
+    int             nb_layers;
+    bool            need_header;    // Set if the file doesn't exist yet.
+    bool            recovering;     // Waiting for the user choice.
+    bool            replaying;
+    bool            new_document;   // Set by journal_new_document.
+
+    // Writer thread.
+    int             thread_state;   // 0: not started, 1: running, -1: error.
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    job_t           *jobs;
+    job_t           *done;          // Finished jobs, to delete.
+    bool            stop;           // Set to stop the thread once idle.
+} g_journal = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const shape_t *SHAPES[] = {
+    &shape_sphere,
+    &shape_cube,
+    &shape_cylinder,
+};
+
+static void buffer_add_record(buffer_t *buf, const char *type,
+                              const void *data, int size,
+                              const void *extra, int extra_size);
+static void record_blocks(buffer_t *buf, const job_layer_t *layer);
+
+// Can be called from the writer thread.
+static void run_job(job_t *job)
+{
+    FILE *file;
+    buffer_t buf;
+    int i;
+
+    if (job->type == JOB_DELETE) {
+        remove(job->path);
+        return;
+    }
+    buf = (buffer_t) {job->data, job->size, job->size};
+    for (i = 0; i < job->nb_layers; i++)
+        record_blocks(&buf, &job->layers[i]);
+    buffer_add_record(&buf, "COMT", &job->commit, sizeof(job->commit),
+                      NULL, 0);
+    job->data = buf.data;
+    job->size = buf.size;
+
+    file = fopen(job->path, job->type == JOB_CREATE ? "wb" : "ab");
+    if (file) {
+        fwrite(job->data, job->size, 1, file);
+        fclose(file);
+    } else {
+        LOG_E("Cannot write journal %s", job->path);
+    }
+}
+
+// Must be called from the main thread, since it deletes the meshes.
+static void job_delete(job_t *job)
+{
+    int i;
+    for (i = 0; i < job->nb_layers; i++) {
+        mesh_delete(job->layers[i].mesh);
+        mesh_delete(job->layers[i].base);
+    }
+    free(job->layers);
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+static void release_done_jobs(void)
+{
+    job_t *jobs, *job, *tmp;
+    pthread_mutex_lock(&g_journal.mutex);
+    jobs = g_journal.done;
+    g_journal.done = NULL;
+    pthread_mutex_unlock(&g_journal.mutex);
+    DL_FOREACH_SAFE(jobs, job, tmp) {
+        DL_DELETE(jobs, job);
+        job_delete(job);
+    }
+}
+
+static void *writer_thread(void *arg)
+{
+    job_t *job;
+    while (true) {
+        pthread_mutex_lock(&g_journal.mutex);
+        while (!g_journal.jobs && !g_journal.stop)
+            pthread_cond_wait(&g_journal.cond, &g_journal.mutex);
+        if (!g_journal.jobs) {
+            pthread_mutex_unlock(&g_journal.mutex);
+            break;
+        }
+        job = g_journal.jobs;
+        DL_DELETE(g_journal.jobs, job);
+        pthread_mutex_unlock(&g_journal.mutex);
+        run_job(job);
+        pthread_mutex_lock(&g_journal.mutex);
+        DL_APPEND(g_journal.done, job);
+        pthread_mutex_unlock(&g_journal.mutex);
+    }
+    return NULL;
+}
+
+static job_t *job_new(int type, const char *path, buffer_t *buf)
+{
+    job_t *job = calloc(1, sizeof(*job));
+    job->type = type;
+    job->path = strdup(path);
+    if (buf) {
+        job->data = buf->data;
+        job->size = buf->size;
+        memset(buf, 0, sizeof(*buf));
+    }
+    return job;
+}
+
+static void queue_job(job_t *job)
+{
+    if (g_journal.thread_state == 0) {
+        g_journal.thread_state = pthread_create(&g_journal.thread, NULL,
+                writer_thread, NULL) == 0 ? 1 : -1;
+    }
+    // If we couldn't start the thread, write directly.
+    if (g_journal.thread_state == -1) {
+        run_job(job);
+        job_delete(job);
+        return;
+    }
+    pthread_mutex_lock(&g_journal.mutex);
+    DL_APPEND(g_journal.jobs, job);
+    pthread_cond_signal(&g_journal.cond);
+    pthread_mutex_unlock(&g_journal.mutex);
+}
+
+static void add_job(int type, const char *path, buffer_t *buf)
+{
+    queue_job(job_new(type, path, buf));
+}
+
+static void buffer_add(buffer_t *buf, const void *data, int size)
+{
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = max(buf->capacity * 2, buf->size + size);
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void buffer_add_record(buffer_t *buf, const char *type,
+                              const void *data, int size,
+                              const void *extra, int extra_size)
+{
+    record_header_t header;
+    memcpy(header.type, type, 4);
+    header.size = size + extra_size;
+    buffer_add(buf, &header, sizeof(header));
+    buffer_add(buf, data, size);
+    if (extra_size) buffer_add(buf, extra, extra_size);
+}
+
+static void get_journal_path(const image_t *img, char *out, int len)
+{
+    const char *dir;
+    if (img->path) {
+        snprintf(out, len, "%s.journal", img->path);
+        return;
+    }
+    dir = sys_get_user_dir();
+    if (dir && *dir) snprintf(out, len, "%s/unsaved.journal", dir);
+    else *out = '\0';
+}
+
+// Key of the image, without the cameras, since we don't want a new
+// transaction each time the view moves.
+static uint32_t get_image_key(const image_t *img)
+{
+    uint32_t key = 0, k;
+    const layer_t *layer;
+    const material_t *material;
+
+    DL_FOREACH(img->layers, layer) {
+        k = layer_get_key(layer);
+        key = crc32(key, (void*)&k, sizeof(k));
+    }
+    DL_FOREACH(img->materials, material) {
+        k = material_get_hash(material);
+        key = crc32(key, (void*)&k, sizeof(k));
+    }
+    key = crc32(key, (void*)&img->box, sizeof(img->box));
+    return key;
+}
+
+static void clear_base(void)
+{
+    int i;
+    for (i = 0; i < g_journal.nb_layers; i++)
+        mesh_delete(g_journal.layers[i].mesh);
+    g_journal.nb_layers = 0;
+}
+
+static void set_base(image_t *img)
+{
+    layer_t *layer;
+
+    clear_base();
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->mesh) continue;
+        g_journal.layers = realloc(g_journal.layers,
+                (g_journal.nb_layers + 1) * sizeof(*g_journal.layers));
+        g_journal.layers[g_journal.nb_layers++] = (base_layer_t) {
+            .id = layer->id,
+            .mesh = mesh_copy(layer->mesh),
+        };
+    }
+    g_journal.img = img;
+    g_journal.key = get_image_key(img);
+    g_journal.change_time = 0;
+}
+
+// Remove a mesh from the base state and return it.
+static mesh_t *take_base_mesh(int id)
+{
+    int i;
+    mesh_t *ret;
+    for (i = 0; i < g_journal.nb_layers; i++) {
+        if (g_journal.layers[i].id != id) continue;
+        ret = g_journal.layers[i].mesh;
+        g_journal.layers[i].mesh = NULL;
+        return ret;
+    }
+    return NULL;
+}
+
+// Add the records of the blocks that changed since the base mesh.
+// Called from the writer thread.
+static void record_blocks(buffer_t *buf, const job_layer_t *layer)
+{
+    const mesh_t *base = layer->base;
+    mesh_iterator_t iter;
+    int bpos[3];
+    uint64_t id1, id2 = 0;
+    const uint8_t *data;
+    uint8_t *packed;
+    uLongf packed_size;
+    block_record_t rec;
+
+    if (base && mesh_get_key(base) == mesh_get_key(layer->mesh)) return;
+    iter = base ? mesh_get_union_iterator(layer->mesh, base, MESH_ITER_BLOCKS)
+                : mesh_get_iterator(layer->mesh, MESH_ITER_BLOCKS);
+    packed = malloc(compressBound(N * N * N * 4));
+    while (mesh_iter(&iter, bpos)) {
+        id1 = mesh_get_block_id(layer->mesh, NULL, bpos);
+        if (base) id2 = mesh_get_block_id(base, NULL, bpos);
+        if (id1 == id2) continue;
+        rec = (block_record_t) {
+            .layer_id = layer->id,
+            .pos = {bpos[0], bpos[1], bpos[2]},
+        };
+        if (!id1) {
+            buffer_add_record(buf, "BLCK", &rec, sizeof(rec), NULL, 0);
+            continue;
+        }
+        data = mesh_get_block_data(layer->mesh, NULL, bpos, NULL);
+        packed_size = compressBound(N * N * N * 4);
+        compress(packed, &packed_size, data, N * N * N * 4);
+        buffer_add_record(buf, "BLCK", &rec, sizeof(rec),
+                          packed, packed_size);
+    }
+    free(packed);
+}
+
+static int get_material_index(const image_t *img, const material_t *mat)
+{
+    const material_t *m;
+    int i = 0;
+    DL_FOREACH(img->materials, m) {
+        if (m == mat) return i;
+        i++;
+    }
+    return -1;
+}
+
+void journal_record(image_t *img, const char *action)
+{
+    buffer_t buf = {};
+    const layer_t *layer;
+    const material_t *mat;
+    const camera_t *cam;
+    material_record_t mat_rec;
+    camera_record_t cam_rec;
+    layer_record_t layer_rec;
+    commit_record_t commit = {};
+    job_t *job;
+    int i;
+
+    if (img != goxel.image || img != g_journal.img) return;
+    if (g_journal.recovering || g_journal.replaying) return;
+    if (!*g_journal.path) return;
+    if (get_image_key(img) == g_journal.key) return;
+
+    if (g_journal.need_header) {
+        buffer_add(&buf, "GOXJ", 4);
+        buffer_add(&buf, &(int32_t){JOURNAL_VERSION}, 4);
+    }
+
+    DL_FOREACH(img->materials, mat) {
+        mat_rec = (material_record_t) {
+            .metallic = mat->metallic,
+            .roughness = mat->roughness,
+        };
+        copy_string(mat_rec.name, mat->name);
+        memcpy(mat_rec.base_color, mat->base_color, sizeof(mat->base_color));
+        memcpy(mat_rec.emission, mat->emission, sizeof(mat->emission));
+        buffer_add_record(&buf, "MATE", &mat_rec, sizeof(mat_rec), NULL, 0);
+    }
+    DL_FOREACH(img->cameras, cam) {
+        cam_rec = (camera_record_t) {
+            .ortho = cam->ortho,
+            .active = cam == img->active_camera,
+            .dist = cam->dist,
+            .fovy = cam->fovy,
+        };
+        copy_string(cam_rec.name, cam->name);
+        mat4_copy(cam->mat, cam_rec.mat);
+        buffer_add_record(&buf, "CAMR", &cam_rec, sizeof(cam_rec), NULL, 0);
+    }
+    DL_FOREACH(img->layers, layer) {
+        layer_rec = (layer_record_t) {
+            .id = layer->id,
+            .base_id = layer->base_id,
+            .material = get_material_index(img, layer->material),
+            .visible = layer->visible,
+        };
+        for (i = 0; i < ARRAY_SIZE(SHAPES); i++) {
+            if (layer->shape == SHAPES[i]) layer_rec.shape = i + 1;
+        }
+        memcpy(layer_rec.color, layer->color, 4);
+        copy_string(layer_rec.name, layer->name);
+        mat4_copy(layer->mat, layer_rec.mat);
+        mat4_copy(layer->box, layer_rec.box);
+        buffer_add_record(&buf, "LAYR", &layer_rec, sizeof(layer_rec),
+                          NULL, 0);
+    }
+    mat4_copy(img->box, commit.box);
+    commit.active_layer = img->active_layer ? img->active_layer->id : 0;
+    if (action) copy_string(commit.action, action);
+
+    // The blocks are compared and compressed in the writer thread, from
+    // copies of the meshes (cheap, since they share their blocks).
+    job = job_new(g_journal.need_header ? JOB_CREATE : JOB_APPEND,
+                  g_journal.path, &buf);
+    job->commit = commit;
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->mesh) continue;
+        job->layers = realloc(job->layers,
+                              (job->nb_layers + 1) * sizeof(*job->layers));
+        job->layers[job->nb_layers++] = (job_layer_t) {
+            .id = layer->id,
+            .mesh = mesh_copy(layer->mesh),
+            .base = take_base_mesh(layer->id),
+        };
+    }
+    queue_job(job);
+    g_journal.need_header = false;
+    set_base(img);
+}
+
+void journal_reset(image_t *img)
+{
+    char path[1024];
+    if (img != goxel.image) return;
+    get_journal_path(img, path, sizeof(path));
+    if (*g_journal.path && strcmp(path, g_journal.path) != 0)
+        add_job(JOB_DELETE, g_journal.path, NULL);
+    if (*path) add_job(JOB_DELETE, path, NULL);
+    copy_string(g_journal.path, path);
+    g_journal.need_header = true;
+    g_journal.recovering = false;
+    set_base(img);
+}
+
+// Check if a journal file contains at least one record.
+static bool journal_has_data(const char *path)
+{
+    FILE *file;
+    long size;
+    file = fopen(path, "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fclose(file);
+    return size > 8 + (long)sizeof(record_header_t);
+}
+
+static void apply_material(image_t *img, int idx,
+                           const material_record_t *rec)
+{
+    material_t *mat;
+    int i = 0;
+    DL_FOREACH(img->materials, mat) {
+        if (i++ == idx) break;
+    }
+    if (!mat) mat = image_add_material(img, NULL);
+    copy_string(mat->name, rec->name);
+    mat->metallic = rec->metallic;
+    mat->roughness = rec->roughness;
+    memcpy(mat->base_color, rec->base_color, sizeof(mat->base_color));
+    memcpy(mat->emission, rec->emission, sizeof(mat->emission));
+    material_touch(mat);
+}
+
+static void apply_camera(image_t *img, int idx, const camera_record_t *rec)
+{
+    camera_t *cam;
+    int i = 0;
+    DL_FOREACH(img->cameras, cam) {
+        if (i++ == idx) break;
+    }
+    if (!cam) cam = image_add_camera(img, NULL);
+    copy_string(cam->name, rec->name);
+    cam->ortho = rec->ortho;
+    cam->dist = rec->dist;
+    cam->fovy = rec->fovy;
+    mat4_copy(rec->mat, cam->mat);
+    camera_touch(cam);
+    if (rec->active) img->active_camera = cam;
+}
+
+static void apply_layer(image_t *img, layer_t **layers,
+                        const layer_record_t *rec)
+{
+    layer_t *layer;
+    material_t *mat;
+    int i = 0;
+
+    DL_FOREACH(img->layers, layer) {
+        if (layer->id == rec->id) break;
+    }
+    if (layer) DL_DELETE(img->layers, layer);
+    else layer = layer_new(NULL);
+    DL_APPEND(*layers, layer);
+
+    layer->id = rec->id;
+    layer->base_id = rec->base_id;
+    layer->visible = rec->visible;
+    layer->shape = (rec->shape > 0 && rec->shape <= ARRAY_SIZE(SHAPES)) ?
+                   SHAPES[rec->shape - 1] : NULL;
+    memcpy(layer->color, rec->color, 4);
+    copy_string(layer->name, rec->name);
+    mat4_copy(rec->mat, layer->mat);
+    mat4_copy(rec->box, layer->box);
+    layer->material = NULL;
+    DL_FOREACH(img->materials, mat) {
+        if (i++ == rec->material) layer->material = mat;
+    }
+    layer_touch(layer);
+}
+
+static void apply_block(image_t *img, const block_record_t *rec,
+                        const uint8_t *data, int size)
+{
+    layer_t *layer;
+    uint8_t *voxels;
+    uLongf voxels_size = N * N * N * 4;
+
+    DL_FOREACH(img->layers, layer) {
+        if (layer->id == rec->layer_id) break;
+    }
+    if (!layer || !layer->mesh) return;
+    if (!size) {
+        mesh_set_block(layer->mesh, rec->pos, NULL);
+        return;
+    }
+    voxels = malloc(voxels_size);
+    if (uncompress(voxels, &voxels_size, data, size) == Z_OK &&
+            voxels_size == N * N * N * 4)
+        mesh_set_block(layer->mesh, rec->pos, voxels);
+    free(voxels);
+}
+
+// Apply a single transaction to the image.
+static void apply_transaction(image_t *img, const uint8_t *data, int size)
+{
+    const record_header_t *header;
+    const uint8_t *payload;
+    const commit_record_t *commit;
+    layer_t *layers = NULL, *layer, *tmp;
+    material_t *mat, *mat_tmp;
+    camera_t *cam, *cam_tmp;
+    int nb_mats = 0, nb_cams = 0, i;
+    bool has_layers = false;
+
+    image_history_push(img);
+    while (size >= sizeof(*header)) {
+        header = (const void*)data;
+        payload = data + sizeof(*header);
+        if (strncmp(header->type, "MATE", 4) == 0)
+            apply_material(img, nb_mats++, (const void*)payload);
+        if (strncmp(header->type, "CAMR", 4) == 0)
+            apply_camera(img, nb_cams++, (const void*)payload);
+        if (strncmp(header->type, "LAYR", 4) == 0) {
+            apply_layer(img, &layers, (const void*)payload);
+            has_layers = true;
+        }
+        if (strncmp(header->type, "BLCK", 4) == 0) {
+            if (has_layers) {
+                // All the layers are set: delete the ones not in the list.
+                DL_FOREACH_SAFE(img->layers, layer, tmp) {
+                    DL_DELETE(img->layers, layer);
+                    layer_delete(layer);
+                }
+                img->layers = layers;
+                has_layers = false;
+            }
+            apply_block(img, (const void*)payload,
+                        payload + sizeof(block_record_t),
+                        header->size - sizeof(block_record_t));
+        }
+        if (strncmp(header->type, "COMT", 4) == 0) {
+            if (has_layers) {
+                DL_FOREACH_SAFE(img->layers, layer, tmp) {
+                    DL_DELETE(img->layers, layer);
+                    layer_delete(layer);
+                }
+                img->layers = layers;
+            }
+            commit = (const void*)payload;
+            mat4_copy(commit->box, img->box);
+            img->active_layer = img->layers;
+            DL_FOREACH(img->layers, layer) {
+                if (layer->id == commit->active_layer)
+                    img->active_layer = layer;
+            }
+            if (*commit->action) LOG_D("Replay action %s", commit->action);
+        }
+        data += sizeof(*header) + header->size;
+        size -= sizeof(*header) + header->size;
+    }
+
+    // Remove the materials and cameras not in the transaction.
+    i = 0;
+    DL_FOREACH_SAFE(img->materials, mat, mat_tmp) {
+        if (i++ >= nb_mats) image_delete_material(img, mat);
+    }
+    i = 0;
+    DL_FOREACH_SAFE(img->cameras, cam, cam_tmp) {
+        if (i++ >= nb_cams) image_delete_camera(img, cam);
+    }
+    image_touch(img);
+}
+
+int journal_replay(image_t *img, const char *path)
+{
+    FILE *file;
+    long size;
+    uint8_t *data;
+    const record_header_t *header;
+    int ofs, start, nb = 0;
+
+    file = fopen(path, "rb");
+    if (!file) return -1;
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data = malloc(size);
+    if (fread(data, size, 1, file) != 1 || size < 8 ||
+            strncmp((char*)data, "GOXJ", 4) != 0 ||
+            *(int32_t*)(data + 4) != JOURNAL_VERSION) {
+        LOG_E("Cannot read journal %s", path);
+        fclose(file);
+        free(data);
+        return -1;
+    }
+    fclose(file);
+
+    g_journal.replaying = true;
+    start = ofs = 8;
+    while (ofs + (long)sizeof(*header) <= size) {
+        header = (const void*)(data + ofs);
+        if (header->size < 0 || ofs + sizeof(*header) + header->size > size)
+            break; // Truncated record.
+        ofs += sizeof(*header) + header->size;
+        if (strncmp(header->type, "COMT", 4) == 0) {
+            apply_transaction(img, data + start, ofs - start);
+            start = ofs;
+            nb++;
+        }
+    }
+    g_journal.replaying = false;
+    free(data);
+    LOG_I("Replayed %d transactions from %s", nb, path);
+    return nb;
+}
+
+static bool recover_popup(void *data)
+{
+    // The document has been closed before the user made a choice.
+    if (!g_journal.recovering) return true;
+    gui_text("Unsaved changes have been found for this image.");
+    gui_text("Do you want to recover them?");
+    if (gui_button("Recover", 0, 0)) {
+        g_journal.recovering = false;
+        journal_replay(g_journal.img, g_journal.path);
+        // Keep the journal, new changes are appended to it.
+        g_journal.need_header = false;
+        set_base(g_journal.img);
+        return true;
+    }
+    gui_same_line();
+    if (gui_button("Discard", 0, 0)) {
+        journal_reset(g_journal.img);
+        return true;
+    }
+    return false;
+}
+
+void journal_iter(image_t *img)
+{
+    char path[1024];
+    double time = sys_get_time();
+
+    release_done_jobs();
+    get_journal_path(img, path, sizeof(path));
+    if (g_journal.new_document || strcmp(path, g_journal.path) != 0) {
+        // New document or new file.
+        g_journal.new_document = false;
+        copy_string(g_journal.path, path);
+        set_base(img);
+        g_journal.need_header = true;
+        g_journal.recovering = false;
+        if (*path && journal_has_data(path)) {
+            g_journal.recovering = true;
+            gui_open_popup("Recover", 0, NULL, recover_popup);
+        }
+        return;
+    }
+    if (g_journal.recovering) return;
+    if (get_image_key(img) == g_journal.key) {
+        g_journal.change_time = 0;
+        return;
+    }
+    if (!g_journal.change_time) g_journal.change_time = time;
+    if (time - g_journal.change_time > RECORD_DELAY)
+        journal_record(img, NULL);
+}
+
+void journal_new_document(void)
+{
+    // The changes of the previous document have been discarded, unless
+    // we were still waiting for the user to recover them.
+    if (*g_journal.path && !g_journal.recovering)
+        add_job(JOB_DELETE, g_journal.path, NULL);
+    *g_journal.path = '\0';
+    g_journal.img = NULL;
+    g_journal.recovering = false;
+    g_journal.new_document = true;
+    clear_base();
+}
+
+void journal_release(void)
+{
+    if (*g_journal.path && !g_journal.recovering)
+        add_job(JOB_DELETE, g_journal.path, NULL);
+    if (g_journal.thread_state == 1) {
+        pthread_mutex_lock(&g_journal.mutex);
+        g_journal.stop = true;
+        pthread_cond_signal(&g_journal.cond);
+        pthread_mutex_unlock(&g_journal.mutex);
+        pthread_join(g_journal.thread, NULL);
+        g_journal.thread_state = 0;
+        g_journal.stop = false;
+    }
+    release_done_jobs();
+    clear_base();
+    free(g_journal.layers);
+    g_journal.layers = NULL;
+    *g_journal.path = '\0';
+    g_journal.img = NULL;
+}
@@ -0,0 +1,93 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Edit journal, for crash recovery.
+ *
+ * While editing an image, we append all the changes since the last save
+ * into a journal file next to the gox file (or in the user directory for
+ * unsaved images).  Each transaction contains the modified blocks of each
+ * layer, and the full list of layers, materials and cameras attributes.
+ *
+ * The file is written from a background thread, and removed when we save
+ * the image.  When we open an image that has a journal, we ask the user if
+ * we should replay it.  Each transaction of the journal is replayed as a
+ * new undo history state.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "image.h"
+
+/*
+ * Function: journal_iter
+ * Should be called once per frame.
+ *
+ * Detect when the image changed (new image or new path) and check for
+ * existing journals, and record the pending changes after a small delay.
+ */
+void journal_iter(image_t *img);
+
+/*
+ * Function: journal_record
+ * Add a transaction with all the changes since the last one.
+ *
+ * Parameters:
+ *   img    - The image.  Only goxel.image is journaled.
+ *   action - Optional id of the action that changed the image.
+ */
+void journal_record(image_t *img, const char *action);
+
+/*
+ * Function: journal_reset
+ * Remove the journal and use the current image as new base state.
+ *
+ * Should be called after the image has been saved.
+ */
+void journal_reset(image_t *img);
+
+/*
+ * Function: journal_new_document
+ * Notify the journal that goxel.image is about to be replaced by a new
+ * document.
+ *
+ * The journal of the previous document is removed, since its changes have
+ * been discarded.
+ */
+void journal_new_document(void);
+
+/*
+ * Function: journal_release
+ * Flush the pending writes and stop the writer thread.
+ *
+ * Should be called when we quit the application.  The journal of the
+ * current image is removed.
+ */
+void journal_release(void);
+
+/*
+ * Function: journal_replay
+ * Apply all the transactions of a journal file to an image.
+ *
+ * Returns:
+ *   The number of transactions replayed, or -1 in case of error.
+ */
+int journal_replay(image_t *img, const char *path);
+
+#endif // JOURNAL_H
@@ -20,6 +20,8 @@
 
 #include <zlib.h> // For crc32
 
+static uint64_t g_version = 0; // Global layers version counter.
+
 layer_t *layer_new(const char *name)
 {
     layer_t *layer;
@@ -27,33 +29,36 @@ layer_t *layer_new(const char *name)
     if (name) strncpy(layer->name, name, sizeof(layer->name) - 1);
     layer->mesh = mesh_new();
     mat4_set_identity(layer->mat);
+    // Not layer_touch: the layer is not part of an image yet.
+    layer->version = ++g_version;
     return layer;
 }
 
 void layer_delete(layer_t *layer)
 {
     mesh_delete(layer->mesh);
+    mesh_delete(layer->base_mesh);
     texture_delete(layer->image);
+    free(layer->packed);
     free(layer);
 }
 
 uint32_t layer_get_key(const layer_t *layer)
 {
-    uint32_t key;
-    key = mesh_get_key(layer->mesh);
-    key = crc32(key, (void*)&layer->visible, sizeof(layer->visible));
-    key = crc32(key, (void*)&layer->name, sizeof(layer->name));
-    key = crc32(key, (void*)&layer->box, sizeof(layer->box));
-    key = crc32(key, (void*)&layer->mat, sizeof(layer->mat));
-    key = crc32(key, (void*)&layer->shape, sizeof(layer->shape));
-    key = crc32(key, (void*)&layer->color, sizeof(layer->color));
-    key = crc32(key, (void*)&layer->material, sizeof(layer->material));
-    return key;
+    const uint64_t v[2] = {layer->version, mesh_get_key(layer->mesh)};
+    return crc32(0, (void*)v, sizeof(v));
+}
+
+void layer_touch(layer_t *layer)
+{
+    layer->version = ++g_version;
+    if (goxel.image) image_touch(goxel.image);
 }
 
 layer_t *layer_copy(layer_t *other)
 {
     layer_t *layer;
+    assert(!other->packed);
     layer = calloc(1, sizeof(*layer));
     memcpy(layer->name, other->name, sizeof(layer->name));
     layer->visible = other->visible;
@@ -63,8 +68,11 @@ layer_t *layer_copy(layer_t *other)
     mat4_copy(other->box, layer->box);
     mat4_copy(other->mat, layer->mat);
     layer->id = other->id;
+    layer->version = other->version;
     layer->base_id = other->base_id;
     layer->base_mesh_key = other->base_mesh_key;
+    layer->base_mesh = other->base_mesh ? mesh_copy(other->base_mesh) : NULL;
+    mat4_copy(other->base_mat, layer->base_mat);
     layer->shape = other->shape;
     layer->shape_key = other->shape_key;
     memcpy(layer->color, other->color, sizeof(layer->color));
@@ -31,6 +31,7 @@ struct layer {
     mesh_t      *mesh;
     const material_t  *material;
     int         id;         // Uniq id in the image (for clones).
+    uint64_t    version;    // Changed by layer_touch.
     bool        visible;
     char        name[256];  // 256 chars max.
     float       box[4][4];  // Bounding box.
@@ -40,15 +41,31 @@ struct layer {
     // For clone layers:
     int         base_id;
     uint64_t    base_mesh_key;
+    mesh_t      *base_mesh;     // Copy of the base mesh of the last update.
+    float       base_mat[4][4]; // Matrix of the last update.
     // For shape layers.
     const shape_t *shape;
     uint32_t    shape_key;
     uint8_t     color[4];
+    // For compressed history snapshots: the zlib compressed unique blocks
+    // of the mesh.
+    uint8_t     *packed;
+    size_t      packed_size;
 };
 
 layer_t *layer_new(const char *name);
 void layer_delete(layer_t *layer);
 uint32_t layer_get_key(const layer_t *layer);
+
+/*
+ * Function: layer_touch
+ * Give a new version to a layer, and to the current image.
+ *
+ * Must be called after changing any of the layer attributes (except the
+ * mesh, that has its own key), so that the caches depending on the layer
+ * get updated.
+ */
+void layer_touch(layer_t *layer);
 layer_t *layer_copy(layer_t *other);
 
 #endif // LAYER_H
@@ -17,18 +17,21 @@
  */
 
 
-#include "material.h"
+#include "goxel.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <zlib.h>
 
+static uint64_t g_version = 0; // Global materials version counter.
 
 material_t *material_new(const char *name)
 {
     material_t *m = calloc(1, sizeof(*m));
     *m = MATERIAL_DEFAULT;
     if (name) snprintf(m->name, sizeof(m->name), "%s", name);
+    // Not material_touch: the material is not part of an image yet.
+    m->version = ++g_version;
     return m;
 }
 
@@ -47,9 +50,11 @@ material_t *material_copy(const material_t *other)
 
 uint32_t material_get_hash(const material_t *m)
 {
-    uint32_t ret = 0;
-    ret = crc32(ret, (void*)&m->metallic, sizeof(m->metallic));
-    ret = crc32(ret, (void*)&m->roughness, sizeof(m->roughness));
-    ret = crc32(ret, (void*)&m->base_color, sizeof(m->base_color));
-    return ret;
+    return crc32(0, (void*)&m->version, sizeof(m->version));
+}
+
+void material_touch(material_t *m)
+{
+    m->version = ++g_version;
+    if (goxel.image) image_touch(goxel.image);
 }
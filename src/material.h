@@ -28,6 +28,7 @@ struct material {
     float roughness;
     float base_color[4];
     float emission[3];
+    uint64_t version; // Changed by material_touch.
     material_t *next, *prev; // List of materials in an image.
 };
 
@@ -42,4 +43,12 @@ void material_delete(material_t *m);
 material_t *material_copy(const material_t *mat);
 uint32_t material_get_hash(const material_t *m);
 
+/*
+ * Function: material_touch
+ * Give a new version to a material, and to the current image.
+ *
+ * Must be called after changing any of the material attributes.
+ */
+void material_touch(material_t *m);
+
 #endif // MATERIAL_H
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 
 #define min(a, b) ({ \
       __typeof__ (a) _a = (a); \
@@ -41,12 +42,20 @@ enum {
     MESH_ITER_MESH2                     = 1 << 11,
 };
 
+typedef uint8_t voxel_t[4];
+
 typedef struct block_data block_data_t;
 struct block_data
 {
     int         ref;
     uint64_t    id;
-    uint8_t     voxels[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE][4]; // RGBA voxels.
+    voxel_t     *voxels;    // RGBA voxels, NULL until loaded.
+
+    // Set for the blocks whose voxels are loaded on first access.
+    void        (*load)(void *user, int index, uint8_t *voxels);
+    void        (*release)(void *user);
+    void        *user;
+    int         index;
 };
 
 struct block
@@ -66,6 +75,9 @@ struct mesh
 
 static uint64_t g_uid = 2; // Global id counter.
 
+// Protects the lazy blocks loading, that can happen from any thread.
+static pthread_mutex_t g_lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static mesh_global_stats_t g_global_stats = {};
 
 #define N BLOCK_SIZE
@@ -78,7 +90,10 @@ static mesh_global_stats_t g_global_stats = {};
         for (y = 0; y < N; y++) \
             for (x = 0; x < N; x++)
 
-#define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
+// Memory used by a block data.
+#define DATA_MEM (sizeof(block_data_t) + N * N * N * sizeof(voxel_t))
+
+#define DATA_AT(d, x, y, z) (data_get_voxels(d)[x + y * N + z * N * N])
 #define BLOCK_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
 
 static void mat4_mul_vec4(float mat[4][4], const float v[4], float out[4])
@@ -129,11 +144,59 @@ static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
     }
 }
 
+// Allocate a new block data, with the voxels stored right after it.
+static block_data_t *block_data_new(void)
+{
+    block_data_t *data;
+    data = calloc(1, DATA_MEM);
+    data->voxels = (voxel_t*)(data + 1);
+    return data;
+}
+
+static void block_data_release(block_data_t *data)
+{
+    data->ref--;
+    if (data->ref) return;
+    if (data->release) {
+        pthread_mutex_lock(&g_lazy_mutex);
+        data->release(data->user);
+        pthread_mutex_unlock(&g_lazy_mutex);
+    }
+    if (data->voxels != (voxel_t*)(data + 1)) free(data->voxels);
+    free(data);
+    g_global_stats.nb_blocks--;
+    g_global_stats.mem -= DATA_MEM;
+}
+
+static voxel_t *block_data_load(block_data_t *data)
+{
+    voxel_t *voxels;
+    pthread_mutex_lock(&g_lazy_mutex);
+    voxels = data->voxels;
+    if (!voxels) {
+        voxels = calloc(N * N * N, sizeof(*voxels));
+        data->load(data->user, data->index, (uint8_t*)voxels);
+        data->release(data->user);
+        data->load = NULL;
+        data->release = NULL;
+        data->user = NULL;
+        __atomic_store_n(&data->voxels, voxels, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_lazy_mutex);
+    return voxels;
+}
+
+static inline voxel_t *data_get_voxels(block_data_t *data)
+{
+    voxel_t *voxels = __atomic_load_n(&data->voxels, __ATOMIC_ACQUIRE);
+    return voxels ?: block_data_load(data);
+}
+
 static block_data_t *get_empty_data(void)
 {
     static block_data_t *data = NULL;
     if (!data) {
-        data = calloc(1, sizeof(*data));
+        data = block_data_new();
         data->ref = 1;
         data->id = 0;
     }
@@ -165,12 +228,7 @@ static block_t *block_new(const int pos[3])
 
 static void block_delete(block_t *block)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        g_global_stats.nb_blocks--;
-        g_global_stats.mem -= sizeof(*block->data);
-    }
+    block_data_release(block->data);
     free(block);
 }
 
@@ -186,33 +244,29 @@ static block_t *block_copy(const block_t *other)
 
 static void block_set_data(block_t *block, block_data_t *data)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        g_global_stats.nb_blocks--;
-        g_global_stats.mem -= sizeof(*block->data);
-    }
-    block->data = data;
     data->ref++;
+    block_data_release(block->data);
+    block->data = data;
 }
 
 // Copy the data if there are any other blocks having reference to it.
 static void block_prepare_write(block_t *block)
 {
+    block_data_t *data;
     if (block->data->ref == 1) {
+        data_get_voxels(block->data);
         block->data->id = ++g_uid;
         return;
     }
     block->data->ref--;
-    block_data_t *data;
-    data = calloc(1, sizeof(*block->data));
-    memcpy(data->voxels, block->data->voxels, N * N * N * 4);
+    data = block_data_new();
+    memcpy(data->voxels, data_get_voxels(block->data), N * N * N * 4);
     data->ref = 1;
     block->data = data;
     block->data->id = ++g_uid;
 
     g_global_stats.nb_blocks++;
-    g_global_stats.mem += sizeof(*block->data);
+    g_global_stats.mem += DATA_MEM;
 }
 
 static void block_get_at(const block_t *block, const int pos[3],
@@ -685,7 +739,22 @@ void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *iter,
         HASH_FIND(hh, mesh->blocks, bpos, sizeof(iter->pos), block);
     }
     if (id) *id = block ? block->data->id : 0;
-    return block ? block->data->voxels : NULL;
+    return block ? data_get_voxels(block->data) : NULL;
+}
+
+uint64_t mesh_get_block_id(const mesh_t *mesh, mesh_accessor_t *iter,
+                           const int bpos[3])
+{
+    block_t *block = NULL;
+    if (    iter &&
+            iter->block_id &&
+            iter->block_id == get_block_id(iter->block) &&
+            memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
+        block = iter->block;
+    } else {
+        HASH_FIND(hh, mesh->blocks, bpos, sizeof(iter->pos), block);
+    }
+    return block ? block->data->id : 0;
 }
 
 uint8_t mesh_get_alpha_at(const mesh_t *mesh, mesh_iterator_t *iter,
@@ -707,6 +776,93 @@ void mesh_copy_block(const mesh_t *src, const int src_pos[3],
     block_set_data(b2, b1->data);
 }
 
+void mesh_set_block(mesh_t *mesh, const int bpos[3], const uint8_t *data)
+{
+    block_t *block;
+    mesh_clear_block(mesh, bpos);
+    if (!data) return;
+    block = mesh_add_block(mesh, bpos);
+    block_prepare_write(block);
+    memcpy(block->data->voxels, data, N * N * N * sizeof(voxel_t));
+}
+
+void mesh_set_block_lazy(mesh_t *mesh, const int bpos[3],
+                         void (*load)(void *user, int index, uint8_t *voxels),
+                         void (*release)(void *user),
+                         void *user, int index)
+{
+    block_t *block;
+    block_data_t *data;
+    mesh_clear_block(mesh, bpos);
+    block = mesh_add_block(mesh, bpos);
+    data = calloc(1, sizeof(*data));
+    data->id = ++g_uid;
+    data->load = load;
+    data->release = release;
+    data->user = user;
+    data->index = index;
+    block_set_data(block, data);
+    g_global_stats.nb_blocks++;
+    g_global_stats.mem += DATA_MEM;
+}
+
+static bool block_is_unique(const mesh_t *mesh, const block_t *block)
+{
+    return *mesh->ref == 1 && block->data->ref == 1 && block->data->id;
+}
+
+uint64_t mesh_get_unique_mem(const mesh_t *mesh)
+{
+    const block_t *block;
+    uint64_t ret = 0;
+    for (block = mesh->blocks; block; block = block->hh.next) {
+        if (block_is_unique(mesh, block)) ret += DATA_MEM;
+    }
+    return ret;
+}
+
+mesh_t *mesh_extract_unique_blocks(mesh_t *mesh)
+{
+    block_t *block, *tmp;
+    mesh_t *ret = NULL;
+
+    // The blocks are moved to the new mesh, without copying their data.
+    HASH_ITER(hh, mesh->blocks, block, tmp) {
+        if (!block_is_unique(mesh, block)) continue;
+        if (!ret) ret = mesh_new();
+        HASH_DEL(mesh->blocks, block);
+        HASH_ADD(hh, ret->blocks, pos, sizeof(block->pos), block);
+    }
+    if (ret) ret->key = g_uid++;
+    return ret;
+}
+
+void mesh_restore_blocks(mesh_t *mesh, mesh_t *blocks)
+{
+    block_t *block, *tmp;
+
+    assert(*mesh->ref == 1);
+    assert(*blocks->ref == 1);
+    HASH_ITER(hh, blocks->blocks, block, tmp) {
+        assert(!mesh_get_block_at(mesh, block->pos, NULL));
+        HASH_DEL(blocks->blocks, block);
+        HASH_ADD(hh, mesh->blocks, pos, sizeof(block->pos), block);
+    }
+    // The mesh key is not changed, since it has the same value as before
+    // the extraction.
+    blocks->key = 1;
+}
+
+void mesh_clear_block(mesh_t *mesh, const int bpos[3])
+{
+    block_t *block;
+    mesh_prepare_write(mesh);
+    HASH_FIND(hh, mesh->blocks, bpos, sizeof(block->pos), block);
+    if (!block) return;
+    HASH_DEL(mesh->blocks, block);
+    block_delete(block);
+}
+
 void mesh_read(const mesh_t *mesh,
                const int pos[3], const int size[3],
                uint8_t *data)
@@ -737,7 +893,7 @@ void mesh_read(const mesh_t *mesh,
         dy = y + 1;
         dz = z + 1;
         memcpy(&data[(dz * size[1] * size[0] + dy * size[0] + dx) * 4],
-               &block->data->voxels[z * N * N + y * N + x],
+               &DATA_AT(block->data, x, y, z),
                4);
     }
 
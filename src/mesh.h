@@ -197,10 +197,99 @@ uint64_t mesh_get_key(const mesh_t *mesh);
 void *mesh_get_block_data(const mesh_t *mesh, mesh_accessor_t *accessor,
                           const int bpos[3], uint64_t *id);
 
+/*
+ * Function: mesh_get_block_id
+ * Return the id of the data of a block, without loading it.
+ *
+ * Blocks with the same data id have the same content.  Returns zero if
+ * there is no block at this position.
+ */
+uint64_t mesh_get_block_id(const mesh_t *mesh, mesh_accessor_t *accessor,
+                           const int bpos[3]);
+
 // Maybe replace this with a generic mesh_copy_part function?
 void mesh_copy_block(const mesh_t *src, const int src_pos[3],
                      mesh_t *dst, const int dst_pos[3]);
 
+/*
+ * Function: mesh_clear_block
+ * Remove a single block from a mesh.
+ *
+ * Inputs:
+ *   mesh - The mesh.
+ *   bpos - Position of the block.
+ */
+void mesh_clear_block(mesh_t *mesh, const int bpos[3]);
+
+/*
+ * Function: mesh_set_block
+ * Set all the voxels of a block.
+ *
+ * Inputs:
+ *   mesh - The mesh.
+ *   bpos - Position of the block.
+ *   data - RGBA voxels of the block, in the x, y, z order.  If NULL the
+ *          block is removed.
+ */
+void mesh_set_block(mesh_t *mesh, const int bpos[3], const uint8_t *data);
+
+/*
+ * Function: mesh_set_block_lazy
+ * Set a block whose voxels are only loaded the first time they are
+ * accessed.
+ *
+ * The loading can happen from any thread, but the load and release
+ * callbacks are never called concurrently.
+ *
+ * Inputs:
+ *   mesh    - The mesh.
+ *   bpos    - Position of the block.
+ *   load    - Function called to fill the RGBA voxels of the block.
+ *   release - Called when the block doesn't need the user data anymore,
+ *             either after it got loaded or when it is deleted.
+ *   user    - User data passed to the callbacks.
+ *   index   - Index passed to the load callback.
+ */
+void mesh_set_block_lazy(mesh_t *mesh, const int bpos[3],
+                         void (*load)(void *user, int index, uint8_t *voxels),
+                         void (*release)(void *user),
+                         void *user, int index);
+
+/*
+ * Function: mesh_get_unique_mem
+ * Return the memory used by the blocks data that are not shared with any
+ * other mesh.
+ */
+uint64_t mesh_get_unique_mem(const mesh_t *mesh);
+
+/*
+ * Function: mesh_extract_unique_blocks
+ * Move all the blocks of a mesh whose data is not shared with any other
+ * mesh into a new mesh.
+ *
+ * This is used to compress the undo history.  The blocks data is not
+ * copied, and the returned mesh doesn't share anything with other meshes,
+ * so it can be read from any thread.  The mesh key is not changed, so the
+ * mesh should not be used until we put the blocks back with
+ * <mesh_restore_blocks>.
+ *
+ * Returns:
+ *   A new mesh, or NULL if there was no unique block.
+ */
+mesh_t *mesh_extract_unique_blocks(mesh_t *mesh);
+
+/*
+ * Function: mesh_restore_blocks
+ * Move back into a mesh the blocks extracted with
+ * <mesh_extract_unique_blocks>, without changing the mesh key.
+ *
+ * Parameters:
+ *   mesh   - The mesh the blocks were extracted from.
+ *   blocks - Mesh with the blocks to add back, it will be empty after
+ *            the call.  None of the blocks must already be in mesh.
+ */
+void mesh_restore_blocks(mesh_t *mesh, mesh_t *blocks);
+
 void mesh_read(const mesh_t *mesh,
                const int pos[3], const int size[3],
                uint8_t *data);
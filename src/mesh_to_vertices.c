@@ -18,6 +18,8 @@
 
 
 #include "goxel.h"
+#include <pthread.h>
+#include <unistd.h>
 
 static const int N = BLOCK_SIZE;
 
@@ -282,3 +284,147 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
     return nb;
 }
 
+
+#define MAX_THREADS 16
+
+typedef struct {
+    voxel_vertex_t  *verts;
+    int             nb;
+    int             size;
+    int             subdivide;
+    bool            done;
+} vertices_job_t;
+
+typedef struct {
+    const mesh_t    *mesh;
+    int             effects;
+    int             (*blocks)[3];
+    vertices_job_t  *jobs;
+    int             nb;
+    int             nb_started;
+    int             nb_consumed;
+    int             capacity;   // Max number of jobs ahead of the consumer.
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} vertices_pool_t;
+
+static void vertices_job_run(vertices_pool_t *pool, int i,
+                             voxel_vertex_t *tmp)
+{
+    vertices_job_t *job = &pool->jobs[i];
+    job->nb = mesh_generate_vertices(pool->mesh, pool->blocks[i],
+                                     pool->effects, tmp, &job->size,
+                                     &job->subdivide);
+    if (!job->nb) return;
+    job->verts = malloc(job->nb * job->size * sizeof(*tmp));
+    memcpy(job->verts, tmp, job->nb * job->size * sizeof(*tmp));
+}
+
+static void *vertices_thread(void *arg)
+{
+    vertices_pool_t *pool = arg;
+    voxel_vertex_t *tmp;
+    int i;
+
+    tmp = calloc(N * N * N * 6 * 4, sizeof(*tmp));
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        while (pool->nb_started < pool->nb &&
+               pool->nb_started >= pool->nb_consumed + pool->capacity)
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        if (pool->nb_started == pool->nb) break;
+        i = pool->nb_started++;
+        pthread_mutex_unlock(&pool->mutex);
+        vertices_job_run(pool, i, tmp);
+        pthread_mutex_lock(&pool->mutex);
+        pool->jobs[i].done = true;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    free(tmp);
+    return NULL;
+}
+
+static int get_nb_threads(void)
+{
+    int ret = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    ret = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return clamp(ret, 1, MAX_THREADS);
+}
+
+void mesh_iter_vertices(const mesh_t *mesh, int effects,
+                        void (*f)(const int block_pos[3],
+                                  const voxel_vertex_t *verts, int nb,
+                                  int size, int subdivide, void *user),
+                        void *user, float *progress)
+{
+    vertices_pool_t pool = {};
+    vertices_job_t *job;
+    pthread_t threads[MAX_THREADS];
+    voxel_vertex_t *tmp;
+    mesh_iterator_t iter;
+    int i, nb_threads = 0, bpos[3];
+
+    // The workers read from a copy, so that the mesh can't change under
+    // them.  This is cheap since the blocks data are shared.
+    pool.mesh = mesh_copy(mesh);
+    pool.effects = effects;
+    iter = mesh_get_iterator(pool.mesh,
+            MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
+    while (mesh_iter(&iter, bpos)) {
+        if (pool.nb % 256 == 0)
+            pool.blocks = realloc(pool.blocks,
+                                  (pool.nb + 256) * sizeof(*pool.blocks));
+        memcpy(pool.blocks[pool.nb++], bpos, sizeof(bpos));
+    }
+    pool.jobs = calloc(max(pool.nb, 1), sizeof(*pool.jobs));
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    for (i = 0; i < get_nb_threads() - 1; i++) {
+        if (pthread_create(&threads[i], NULL, vertices_thread, &pool))
+            break;
+        nb_threads++;
+    }
+    pool.capacity = 4 * (nb_threads + 1);
+
+    // Consume the jobs in order, running them ourself if no worker took
+    // them yet.
+    tmp = calloc(N * N * N * 6 * 4, sizeof(*tmp));
+    for (i = 0; i < pool.nb; i++) {
+        job = &pool.jobs[i];
+        pthread_mutex_lock(&pool.mutex);
+        if (pool.nb_started == i) {
+            pool.nb_started++;
+            pthread_mutex_unlock(&pool.mutex);
+            vertices_job_run(&pool, i, tmp);
+            pthread_mutex_lock(&pool.mutex);
+            job->done = true;
+        }
+        while (!job->done)
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        pthread_mutex_unlock(&pool.mutex);
+
+        if (job->nb)
+            f(pool.blocks[i], job->verts, job->nb, job->size,
+              job->subdivide, user);
+        free(job->verts);
+        job->verts = NULL;
+
+        pthread_mutex_lock(&pool.mutex);
+        pool.nb_consumed++;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.mutex);
+        if (progress) *progress = (float)(i + 1) / pool.nb;
+    }
+
+    for (i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.cond);
+    free(tmp);
+    free(pool.jobs);
+    free(pool.blocks);
+    mesh_delete((mesh_t*)pool.mesh);
+}
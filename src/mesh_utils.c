@@ -201,6 +201,116 @@ void mesh_blit(mesh_t *mesh, const uint8_t *data,
     mesh_remove_empty_blocks(mesh, false);
 }
 
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    int             count;      // Number of voxels set.
+    int             needed;     // Number of voxels to set to be complete.
+    uint8_t         mask[N * N * N / 8];
+    uint8_t         voxels[N * N * N][4];
+} sink_block_t;
+
+struct mesh_sink {
+    mesh_t          *mesh;
+    int             aabb[2][3];
+    bool            has_aabb;
+    sink_block_t    *blocks;
+    sink_block_t    *last;      // Last accessed block, for fast access.
+};
+
+mesh_sink_t *mesh_sink_new(mesh_t *mesh, const int aabb[2][3])
+{
+    mesh_sink_t *sink = calloc(1, sizeof(*sink));
+    sink->mesh = mesh;
+    if (aabb) {
+        memcpy(sink->aabb, aabb, sizeof(sink->aabb));
+        sink->has_aabb = true;
+    }
+    return sink;
+}
+
+static sink_block_t *sink_get_block(mesh_sink_t *sink, const int bpos[3])
+{
+    sink_block_t *block;
+    int i, size;
+
+    HASH_FIND(hh, sink->blocks, bpos, sizeof(block->pos), block);
+    if (block) return block;
+    block = calloc(1, sizeof(*block));
+    memcpy(block->pos, bpos, sizeof(block->pos));
+    block->needed = 1;
+    for (i = 0; i < 3; i++) {
+        size = N;
+        if (sink->has_aabb) {
+            size = min(bpos[i] + N, sink->aabb[1][i]) -
+                   max(bpos[i], sink->aabb[0][i]);
+        }
+        block->needed *= max(size, 0);
+    }
+    HASH_ADD(hh, sink->blocks, pos, sizeof(block->pos), block);
+    return block;
+}
+
+// Write a block into the mesh, keeping the voxels we didn't set.
+static void sink_flush_block(mesh_sink_t *sink, sink_block_t *block)
+{
+    const uint8_t *data;
+    bool empty = true;
+    int i;
+
+    data = mesh_get_block_data(sink->mesh, NULL, block->pos, NULL);
+    for (i = 0; i < N * N * N; i++) {
+        if (data && !(block->mask[i / 8] & (1 << (i % 8))))
+            memcpy(block->voxels[i], data + i * 4, 4);
+        if (block->voxels[i][3]) empty = false;
+    }
+    if (!empty || data) {
+        mesh_set_block(sink->mesh, block->pos,
+                       empty ? NULL : (uint8_t*)block->voxels);
+    }
+    HASH_DEL(sink->blocks, block);
+    if (sink->last == block) sink->last = NULL;
+    free(block);
+}
+
+void mesh_sink_set(mesh_sink_t *sink, const int pos[3], const uint8_t v[4])
+{
+    sink_block_t *block = sink->last;
+    int bpos[3] = {pos[0] & ~(N - 1), pos[1] & ~(N - 1), pos[2] & ~(N - 1)};
+    int i;
+
+    if (!block || memcmp(block->pos, bpos, sizeof(bpos)) != 0) {
+        block = sink_get_block(sink, bpos);
+        sink->last = block;
+    }
+    i = (pos[0] - bpos[0]) + (pos[1] - bpos[1]) * N +
+        (pos[2] - bpos[2]) * N * N;
+    memcpy(block->voxels[i], v, 4);
+    if (block->mask[i / 8] & (1 << (i % 8))) return;
+    block->mask[i / 8] |= 1 << (i % 8);
+    block->count++;
+    if (block->count == N * N * N || block->count == block->needed)
+        sink_flush_block(sink, block);
+}
+
+void mesh_sink_set_span(mesh_sink_t *sink, const int pos[3], int axis,
+                        int len, const uint8_t v[4])
+{
+    int i, p[3] = {pos[0], pos[1], pos[2]};
+    for (i = 0; i < len; i++, p[axis]++)
+        mesh_sink_set(sink, p, v);
+}
+
+void mesh_sink_delete(mesh_sink_t *sink)
+{
+    sink_block_t *block, *tmp;
+    if (!sink) return;
+    HASH_ITER(hh, sink->blocks, block, tmp) {
+        sink_flush_block(sink, block);
+    }
+    free(sink);
+}
+
 void mesh_shift_alpha(mesh_t *mesh, int v)
 {
     mesh_iterator_t iter;
@@ -372,6 +482,137 @@ void mesh_op(mesh_t *mesh, const painter_t *painter, const float box[4][4])
     cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
 }
 
+static bool shape_contains(const shape_t *shape, const float mat[4][4],
+                           const float size[3], const float clip[4][4],
+                           int x, int y, int z)
+{
+    float p[3] = {x + 0.5, y + 0.5, z + 0.5};
+    if (clip && !bbox_contains_vec(clip, p)) return false;
+    mat4_mul_vec3(mat, p, p);
+    return shape->func(p, size, 0) >= 0;
+}
+
+// Data shared by all the lazy blocks of a rasterized shape.
+typedef struct {
+    int             ref;        // Number of blocks not rasterized yet.
+    const shape_t   *shape;
+    float           mat[4][4];  // Transformation to the shape unit space.
+    float           size[3];
+    float           clip[4][4];
+    bool            has_clip;
+    uint8_t         value[4];
+    int             origin[3];  // Position of the first block.
+    int             nb[2];      // Number of blocks along x and y.
+} shape_raster_t;
+
+// Lazy block load callback: rasterize the block at a given index.
+static void shape_raster_load(void *user, int index, uint8_t *voxels)
+{
+    const shape_raster_t *r = user;
+    int x, y, z, bpos[3];
+
+    bpos[0] = r->origin[0] + (index % r->nb[0]) * N;
+    bpos[1] = r->origin[1] + (index / r->nb[0] % r->nb[1]) * N;
+    bpos[2] = r->origin[2] + (index / r->nb[0] / r->nb[1]) * N;
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        if (shape_contains(r->shape, r->mat, r->size,
+                           r->has_clip ? r->clip : NULL,
+                           bpos[0] + x, bpos[1] + y, bpos[2] + z))
+            memcpy(&voxels[(x + y * N + z * N * N) * 4], r->value, 4);
+    }
+}
+
+static void shape_raster_release(void *user)
+{
+    shape_raster_t *r = user;
+    if (--r->ref == 0) free(r);
+}
+
+void mesh_rasterize_shape(mesh_t *mesh, const shape_t *shape,
+                          const float box[4][4], const uint8_t color[4],
+                          const float clip[4][4])
+{
+    int aabb[2][3], clip_aabb[2][3], bpos[3], nb[3], i, n, index;
+    float bbox[4][4];
+    uint8_t (*voxels)[4];
+    mesh_t *full = NULL; // Single block filled with the shape color.
+    shape_raster_t *r;
+
+    mesh_clear(mesh);
+    if (box_is_null(box)) return;
+    if (clip && box_is_null(clip)) clip = NULL;
+
+    r = calloc(1, sizeof(*r));
+    combine((uint8_t[4]){0}, color, MODE_OVER, r->value);
+    if (!r->value[3]) {
+        free(r);
+        return;
+    }
+    r->shape = shape;
+    box_get_size(box, r->size);
+    mat4_copy(box, r->mat);
+    mat4_iscale(r->mat, 1 / r->size[0], 1 / r->size[1], 1 / r->size[2]);
+    mat4_invert(r->mat, r->mat);
+    if (clip) {
+        mat4_copy(clip, r->clip);
+        r->has_clip = true;
+    }
+
+    // Only consider the blocks in both the shape and the clip bounding
+    // boxes.
+    box_get_bbox(box, bbox);
+    bbox_to_aabb(bbox, aabb);
+    if (clip) {
+        box_get_bbox(clip, bbox);
+        bbox_to_aabb(bbox, clip_aabb);
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = max(aabb[0][i], clip_aabb[0][i]);
+            aabb[1][i] = min(aabb[1][i], clip_aabb[1][i]);
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        r->origin[i] = (aabb[0][i] - 1) & ~(N - 1);
+        nb[i] = (aabb[1][i] - r->origin[i]) / N + 1;
+        if (aabb[1][i] < aabb[0][i]) nb[i] = 0;
+    }
+    r->nb[0] = nb[0];
+    r->nb[1] = nb[1];
+
+    for (index = 0; index < nb[0] * nb[1] * nb[2]; index++) {
+        bpos[0] = r->origin[0] + (index % nb[0]) * N;
+        bpos[1] = r->origin[1] + (index / nb[0] % nb[1]) * N;
+        bpos[2] = r->origin[2] + (index / nb[0] / nb[1]) * N;
+        // All the shapes and the clip box are convex, so if the eight
+        // corner voxels are inside the block is full.
+        for (i = 0, n = 0; i < 8; i++) {
+            n += shape_contains(shape, r->mat, r->size, clip,
+                                bpos[0] + ((i >> 0) & 1) * (N - 1),
+                                bpos[1] + ((i >> 1) & 1) * (N - 1),
+                                bpos[2] + ((i >> 2) & 1) * (N - 1));
+        }
+        if (n == 8) {
+            if (!full) {
+                voxels = malloc(N * N * N * sizeof(*voxels));
+                for (i = 0; i < N * N * N; i++)
+                    memcpy(voxels[i], r->value, 4);
+                full = mesh_new();
+                mesh_set_block(full, (int[3]){0, 0, 0}, (void*)voxels);
+                free(voxels);
+            }
+            mesh_copy_block(full, (int[3]){0, 0, 0}, mesh, bpos);
+            continue;
+        }
+        // Surface block: only rasterized when first accessed.
+        r->ref++;
+        mesh_set_block_lazy(mesh, bpos, shape_raster_load,
+                            shape_raster_release, r, index);
+    }
+    if (!r->ref) free(r);
+    mesh_delete(full);
+}
+
 // XXX: remove this function!
 void mesh_get_box(const mesh_t *mesh, bool exact, float box[4][4])
 {
@@ -391,8 +632,8 @@ static void block_merge(mesh_t *mesh, const mesh_t *other, const int pos[3],
     static cache_t *cache = NULL;
     mesh_accessor_t a1, a2, a3;
 
-    mesh_get_block_data(mesh,  NULL, pos, &id1);
-    mesh_get_block_data(other, NULL, pos, &id2);
+    id1 = mesh_get_block_id(mesh,  NULL, pos);
+    id2 = mesh_get_block_id(other, NULL, pos);
 
     // XXX: cleanup this code!
 
@@ -487,6 +728,187 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
     cache_add(cache, &key, sizeof(key), mesh_copy(mesh), 1, mesh_del);
 }
 
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+} dirty_block_t;
+
+static void add_dirty_block(dirty_block_t **dirty, const int bpos[3])
+{
+    dirty_block_t *block;
+    HASH_FIND(hh, *dirty, bpos, sizeof(block->pos), block);
+    if (block) return;
+    block = calloc(1, sizeof(*block));
+    memcpy(block->pos, bpos, sizeof(block->pos));
+    HASH_ADD(hh, *dirty, pos, sizeof(block->pos), block);
+}
+
+// Add the positions of all the blocks that differ between two meshes.
+static void add_dirty_blocks(dirty_block_t **dirty,
+                             const mesh_t *m1, const mesh_t *m2)
+{
+    mesh_iterator_t iter;
+    int bpos[3];
+    uint64_t id1, id2;
+
+    iter = mesh_get_union_iterator(m1, m2, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        id1 = mesh_get_block_id(m1, NULL, bpos);
+        id2 = mesh_get_block_id(m2, NULL, bpos);
+        if (id1 == id2) continue;
+        add_dirty_block(dirty, bpos);
+    }
+}
+
+// Remove the blocks of a list that have no visible voxels.
+static void remove_empty_blocks(mesh_t *mesh, dirty_block_t **blocks)
+{
+    dirty_block_t *block, *tmp;
+    const uint8_t *data;
+    int i;
+
+    HASH_ITER(hh, *blocks, block, tmp) {
+        data = mesh_get_block_data(mesh, NULL, block->pos, NULL);
+        if (data) {
+            for (i = 0; i < BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE; i++) {
+                if (data[i * 4 + 3]) break;
+            }
+            if (i == BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE)
+                mesh_clear_block(mesh, block->pos);
+        }
+        HASH_DEL(*blocks, block);
+        free(block);
+    }
+}
+
+const mesh_t *mesh_stack_update(mesh_stack_t *stack,
+                                const mesh_t **meshes, int nb)
+{
+    int i;
+    dirty_block_t *dirty = NULL, *block, *tmp;
+
+    if (!stack->mesh) stack->mesh = mesh_new();
+
+    if (nb != stack->nb) {
+        // The list of meshes changed, just merge everything again.
+        mesh_clear(stack->mesh);
+        for (i = 0; i < nb; i++)
+            mesh_merge(stack->mesh, meshes[i], MODE_OVER, NULL);
+    } else {
+        for (i = 0; i < nb; i++) {
+            if (mesh_get_key(meshes[i]) == mesh_get_key(stack->sources[i]))
+                continue;
+            add_dirty_blocks(&dirty, meshes[i], stack->sources[i]);
+        }
+        HASH_ITER(hh, dirty, block, tmp) {
+            mesh_clear_block(stack->mesh, block->pos);
+            for (i = 0; i < nb; i++)
+                block_merge(stack->mesh, meshes[i], block->pos,
+                            MODE_OVER, NULL);
+            HASH_DEL(dirty, block);
+            free(block);
+        }
+    }
+
+    for (i = 0; i < stack->nb; i++) mesh_delete(stack->sources[i]);
+    stack->sources = realloc(stack->sources, nb * sizeof(*stack->sources));
+    for (i = 0; i < nb; i++) stack->sources[i] = mesh_copy(meshes[i]);
+    stack->nb = nb;
+    return stack->mesh;
+}
+
+// Check if a matrix is a pure translation by a multiple of the block size,
+// in which case moving a mesh is just a matter of moving its blocks.
+static bool get_block_translation(const float mat[4][4], int t[3])
+{
+    int i, j;
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 4; j++) {
+            if (mat[i][j] != (i == j ? 1 : 0)) return false;
+        }
+        if (mat[3][i] != (int)mat[3][i]) return false;
+        t[i] = mat[3][i];
+        if (t[i] % BLOCK_SIZE) return false;
+    }
+    return mat[3][3] == 1;
+}
+
+void mesh_move_update(mesh_t *mesh, const mesh_t *src, const mesh_t *prev,
+                      const float mat[4][4])
+{
+    int t[3], bpos[3], pos[3], i;
+    float box[4][4], imat[4][4];
+    uint8_t color[4];
+    dirty_block_t *dirty = NULL, *touched = NULL, *block, *tmp;
+    mesh_iterator_t iter;
+    mesh_accessor_t accessor;
+
+    if (!get_block_translation(mat, t)) {
+        if (!prev) {
+            mesh_set(mesh, src);
+            mesh_move(mesh, mat);
+            return;
+        }
+        // Only resample the region covered by the transformed dirty blocks,
+        // with a one voxel margin for the rounding.
+        mat4_invert(mat, imat);
+        add_dirty_blocks(&dirty, src, prev);
+        accessor = mesh_get_accessor(mesh);
+        HASH_ITER(hh, dirty, block, tmp) {
+            bbox_from_extents(box, VEC(block->pos[0] + BLOCK_SIZE / 2.0f,
+                                       block->pos[1] + BLOCK_SIZE / 2.0f,
+                                       block->pos[2] + BLOCK_SIZE / 2.0f),
+                              BLOCK_SIZE / 2.0f + 1,
+                              BLOCK_SIZE / 2.0f + 1,
+                              BLOCK_SIZE / 2.0f + 1);
+            mat4_mul(mat, box, box);
+            box_get_bbox(box, box);
+            iter = mesh_get_box_iterator(mesh, box, 0);
+            while (mesh_iter(&iter, pos)) {
+                mesh_move_get_color(pos, color, USER_PASS(src, &imat));
+                mesh_set_at(mesh, &accessor, pos, color);
+            }
+            iter = mesh_get_box_iterator(mesh, box, MESH_ITER_BLOCKS);
+            while (mesh_iter(&iter, bpos)) add_dirty_block(&touched, bpos);
+            HASH_DEL(dirty, block);
+            free(block);
+        }
+        // Like mesh_move, don't keep the blocks that became empty.
+        remove_empty_blocks(mesh, &touched);
+        return;
+    }
+
+    // Block aligned translation: the blocks data are shared with the source.
+    if (!prev) {
+        mesh_clear(mesh);
+        iter = mesh_get_iterator(src, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            for (i = 0; i < 3; i++) pos[i] = bpos[i] + t[i];
+            mesh_copy_block(src, bpos, mesh, pos);
+        }
+        return;
+    }
+    add_dirty_blocks(&dirty, src, prev);
+    HASH_ITER(hh, dirty, block, tmp) {
+        for (i = 0; i < 3; i++) pos[i] = block->pos[i] + t[i];
+        if (mesh_get_block_id(src, NULL, block->pos))
+            mesh_copy_block(src, block->pos, mesh, pos);
+        else
+            mesh_clear_block(mesh, pos);
+        HASH_DEL(dirty, block);
+        free(block);
+    }
+}
+
+void mesh_stack_release(mesh_stack_t *stack)
+{
+    int i;
+    for (i = 0; i < stack->nb; i++) mesh_delete(stack->sources[i]);
+    free(stack->sources);
+    mesh_delete(stack->mesh);
+    memset(stack, 0, sizeof(*stack));
+}
+
 void mesh_crop(mesh_t *mesh, const float box[4][4])
 {
     painter_t painter = {
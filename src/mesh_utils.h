@@ -130,8 +130,62 @@ void mesh_blit(mesh_t *mesh, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
                mesh_iterator_t *iter);
 
+/*
+ * Type: mesh_sink_t
+ * Put voxels into a mesh block per block.
+ *
+ * The voxels can be set in any order.  They are buffered per block, and
+ * each block is written into the mesh as soon as all its voxels inside
+ * the sink box have been set, so that importers never need to allocate
+ * the full volume.  The result is the same as with <mesh_blit>.
+ */
+typedef struct mesh_sink mesh_sink_t;
+
+/*
+ * Function: mesh_sink_new
+ * Create a new sink writing into a mesh.
+ *
+ * Parameters:
+ *   mesh - The mesh we write into.
+ *   aabb - The box of all the voxels that will be set, or NULL if
+ *          unknown.  Without box the blocks are only written when full
+ *          or when the sink is deleted.
+ */
+mesh_sink_t *mesh_sink_new(mesh_t *mesh, const int aabb[2][3]);
+
+// Set a voxel.
+void mesh_sink_set(mesh_sink_t *sink, const int pos[3], const uint8_t v[4]);
+
+// Set a span of voxels along an axis (0, 1 or 2) to the same value.
+void mesh_sink_set_span(mesh_sink_t *sink, const int pos[3], int axis,
+                        int len, const uint8_t v[4]);
+
+// Write all the remaining voxels into the mesh and delete the sink.
+void mesh_sink_delete(mesh_sink_t *sink);
+
 void mesh_move(mesh_t *mesh, const float mat[4][4]);
 
+/*
+ * Function: mesh_move_update
+ * Incrementally update a transformed copy of a mesh.
+ *
+ * After the call, mesh is equal to the result of mesh_move applied to a
+ * copy of src.  If prev is set, mesh must already be the transformed
+ * version of prev, and only the regions that depend on the blocks that
+ * differ between src and prev are computed again.
+ *
+ * If the matrix is a translation by a multiple of the block size, the
+ * blocks data are shared with the source mesh instead of being resampled.
+ *
+ * Parameters:
+ *   mesh   - The destination mesh.
+ *   src    - The source mesh.
+ *   prev   - The source mesh used for the previous update, or NULL.
+ *   mat    - The transformation matrix.
+ */
+void mesh_move_update(mesh_t *mesh, const mesh_t *src, const mesh_t *prev,
+                      const float mat[4][4]);
+
 void mesh_shift_alpha(mesh_t *mesh, int v);
 
 // Compute the selection mask for a given condition.
@@ -143,6 +197,27 @@ int mesh_select(const mesh_t *mesh,
                             void *user),
                 void *user, mesh_t *selection);
 
+/*
+ * Function: mesh_rasterize_shape
+ * Set a mesh to the voxels of a shape.
+ *
+ * The result is the same as clearing the mesh and then calling mesh_op
+ * in MODE_OVER with no smoothness, except that it can contain some empty
+ * blocks.  The blocks fully inside the shape all share the same data, and
+ * the blocks on the surface are lazily rasterized the first time their
+ * voxels are accessed (render, merge, export or edit).
+ *
+ * Parameters:
+ *   mesh   - The destination mesh.
+ *   shape  - The shape, must be convex.
+ *   box    - Box of the shape.
+ *   color  - Color of the shape.
+ *   clip   - Optional bounding box to clip the shape to.  Can be NULL.
+ */
+void mesh_rasterize_shape(mesh_t *mesh, const shape_t *shape,
+                          const float box[4][4], const uint8_t color[4],
+                          const float clip[4][4]);
+
 /*
  * Function: mesh_merge
  * Merge a mesh into an other using a given blending function.
@@ -157,6 +232,41 @@ int mesh_select(const mesh_t *mesh,
 void mesh_merge(mesh_t *mesh, const mesh_t *other, int mode,
                 const uint8_t color[4]);
 
+/*
+ * Type: mesh_stack_t
+ * Incrementally updated merge of a list of meshes.
+ *
+ * The stack keeps a copy of the meshes used for the last update, so that
+ * when only some blocks of the meshes changed, we only need to merge the
+ * meshes again at the position of those blocks.
+ */
+typedef struct mesh_stack {
+    mesh_t  *mesh;      // The merged mesh.
+    int     nb;         // Number of meshes of the last update.
+    mesh_t  **sources;  // Copy of the meshes of the last update.
+} mesh_stack_t;
+
+/*
+ * Function: mesh_stack_update
+ * Update a mesh stack from a list of meshes merged with MODE_OVER.
+ *
+ * Parameters:
+ *   stack  - The mesh stack.
+ *   meshes - The list of meshes, from bottom to top.
+ *   nb     - Number of meshes.
+ *
+ * Returns:
+ *   The merged mesh, owned by the stack.
+ */
+const mesh_t *mesh_stack_update(mesh_stack_t *stack,
+                                const mesh_t **meshes, int nb);
+
+/*
+ * Function: mesh_stack_release
+ * Release all the memory used by a mesh stack.
+ */
+void mesh_stack_release(mesh_stack_t *stack);
+
 /*
  * Function: mesh_generate_vertices
  * Generate a vertice array for rendering a mesh block.
@@ -177,6 +287,29 @@ int mesh_generate_vertices(const mesh_t *mesh, const int block_pos[3],
                            int effects, voxel_vertex_t *out,
                            int *size, int *subdivide);
 
+/*
+ * Function: mesh_iter_vertices
+ * Generate the vertices of all the blocks of a mesh, using all the cores.
+ *
+ * The vertices of each block are generated in a pool of threads, from a
+ * copy of the mesh, and passed to a callback from the calling thread.  The
+ * callback is called in the blocks iteration order, so the result does not
+ * depend on the number of threads.  Blocks without vertices are skipped.
+ *
+ * Parameters:
+ *   mesh       - Input mesh.
+ *   effects    - Effect flags.
+ *   f          - Callback, with the same arguments as the
+ *                <mesh_generate_vertices> outputs.
+ *   user       - Data passed to the callback.
+ *   progress   - Optional output of the fraction of blocks done.
+ */
+void mesh_iter_vertices(const mesh_t *mesh, int effects,
+                        void (*f)(const int block_pos[3],
+                                  const voxel_vertex_t *verts, int nb,
+                                  int size, int subdivide, void *user),
+                        void *user, float *progress);
+
 // XXX: use int[2][3] for the box?
 void mesh_crop(mesh_t *mesh, const float box[4][4]);
 
@@ -136,20 +136,11 @@ static int get_material_id(pathtracer_t *pt, const material_t *mat,
 }
 
 static yocto_shape create_shape_for_block(
-        const mesh_t *mesh, const int block_pos[3])
+        const voxel_vertex_t *vertices, int nb, int size, int subdivide)
 {
-    voxel_vertex_t* vertices;
-    int i, nb, size, subdivide;
+    int i;
     yocto_shape shape = {};
 
-    vertices = (voxel_vertex_t*)calloc(
-                BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
-                sizeof(*vertices));
-    nb = mesh_generate_vertices(mesh, block_pos,
-                                goxel.rend.settings.effects,
-                                vertices, &size, &subdivide);
-    if (!nb) goto end;
-
     // Set vertices data.
     shape.positions.resize(nb * size);
     shape.colors.resize(nb * size);
@@ -177,22 +168,41 @@ static yocto_shape create_shape_for_block(
         for (i = 0; i < nb; i++)
             shape.triangles[i] = {i * 3 + 0, i * 3 + 1, i * 3 + 2};
     }
-
-end:
-    free(vertices);
     return shape;
 }
 
-static int sync_mesh(pathtracer_t *pt, int w, int h, bool force)
+typedef struct {
+    pathtracer_t    *pt;
+    const layer_t   *layer;
+    int             *changed;
+} sync_block_ctx_t;
+
+static void sync_block(const int block_pos[3], const voxel_vertex_t *verts,
+                       int nb, int size, int subdivide, void *user)
 {
-    uint32_t key = 0, k;
-    mesh_iterator_t iter;
-    const mesh_t *mesh;
-    int block_pos[3], i, changed = 0;
+    sync_block_ctx_t *ctx = (sync_block_ctx_t*)user;
+    pathtracer_internal_t *p = ctx->pt->p;
     yocto_shape shape;
     yocto_instance instance;
+
+    shape = create_shape_for_block(verts, nb, size, subdivide);
+    shape.material = get_material_id(ctx->pt, ctx->layer->material,
+                                     ctx->changed);
+    p->scene.shapes.push_back(shape);
+    instance.name = shape.name;
+    instance.shape = p->scene.shapes.size() - 1;
+    instance.frame = make_translation_frame(vec3f(
+                            block_pos[0], block_pos[1], block_pos[2]));
+    p->scene.instances.push_back(instance);
+}
+
+static int sync_mesh(pathtracer_t *pt, int w, int h, bool force)
+{
+    uint32_t key = 0, k;
+    int i, changed = 0;
     pathtracer_internal_t *p = pt->p;
     const layer_t *layers, *layer;
+    sync_block_ctx_t ctx;
 
     layers = goxel_get_render_layers(false);
     DL_FOREACH(layers, layer) {
@@ -219,20 +229,9 @@ static int sync_mesh(pathtracer_t *pt, int w, int h, bool force)
 
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->mesh) continue;
-        mesh = layer->mesh;
-        iter = mesh_get_iterator(mesh,
-                        MESH_ITER_BLOCKS | MESH_ITER_INCLUDES_NEIGHBORS);
-        while (mesh_iter(&iter, block_pos)) {
-            shape = create_shape_for_block(mesh, block_pos);
-            shape.material = get_material_id(pt, layer->material, &changed);
-            if (shape.positions.empty()) continue;
-            p->scene.shapes.push_back(shape);
-            instance.name = shape.name;
-            instance.shape = p->scene.shapes.size() - 1;
-            instance.frame = make_translation_frame(vec3f(
-                                    block_pos[0], block_pos[1], block_pos[2]));
-            p->scene.instances.push_back(instance);
-        }
+        ctx = {pt, layer, &changed};
+        mesh_iter_vertices(layer->mesh, goxel.rend.settings.effects,
+                           sync_block, &ctx, NULL);
     }
 
     return changed;
@@ -75,8 +75,11 @@ struct render_item_t
     int         subdivide;      // Unit per voxel (usually 1).
 };
 
-// The buffered item hash table.  For the moment it is only used of the blocks.
-// static render_item_t *g_items = NULL;
+// The render items are allocated from a per-frame arena, that we reset once
+// all the pending items of all the renderers have been submitted.
+static arena_t *g_items_arena = NULL;
+static int g_nb_pending_items = 0;
+static int g_nb_submitted_items = 0;
 
 // The cache of the g_items.
 static cache_t   *g_items_cache;
@@ -331,6 +334,13 @@ void render_deinit(void)
 // A global buffer large enough to contain all the vertices for any block.
 static voxel_vertex_t* g_vertices_buffer = NULL;
 
+static render_item_t *item_new(void)
+{
+    if (!g_items_arena) g_items_arena = arena_create(64 * KB);
+    g_nb_pending_items++;
+    return arena_alloc(g_items_arena, sizeof(render_item_t));
+}
+
 // Used for the cache.
 static int item_delete(void *item_)
 {
@@ -362,7 +372,7 @@ static render_item_t *get_item_for_block(
         p[0] = block_pos[0] + x * BLOCK_SIZE;
         p[1] = block_pos[1] + y * BLOCK_SIZE;
         p[2] = block_pos[2] + z * BLOCK_SIZE;
-        mesh_get_block_data(mesh, NULL, p, &block_data_id);
+        block_data_id = mesh_get_block_id(mesh, NULL, p);
         key.ids[i] = block_data_id;
     }
 
@@ -546,6 +556,337 @@ static void compute_shadow_map_box(
     }
 }
 
+/*
+ * Volume rendering (EFFECT_VOLUME).
+ *
+ * Instead of generating the faces of each block, we upload the blocks
+ * voxels into a 2D texture atlas.  Each block is stored as a 64x64 tile,
+ * using the same layout as the block data, so that we can upload it
+ * directly.  For each mesh we also create a blocks table texture that gives
+ * the position of each block tile in the atlas, with the alpha channel used
+ * as an occupancy grid.
+ *
+ * The mesh is then rendered as a single box, and the fragment shader walks
+ * the ray through the blocks, skipping the empty ones.
+ *
+ * The tiles are indexed by block data id, so only the blocks that changed
+ * since the last frame need to be uploaded.
+ */
+
+#define VOLUME_TILE_SIZE 64
+#define VOLUME_MAX_BLOCK_STEPS 256 // Must match the value in volume.glsl.
+
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        id;         // Block data id.
+    int             slot;       // Index of the tile in the atlas.
+    int             last_used;  // Last frame the tile was used.
+} volume_tile_t;
+
+typedef struct {
+    uint64_t    mesh_key;
+    int         generation; // Atlas generation when we created the table.
+    int         pos[3];     // Position of the first block.
+    int         size[3];    // Size of the table in blocks.
+    GLuint      tex;
+} volume_table_t;
+
+static struct {
+    GLuint          atlas;
+    int             size;       // Number of tiles per side of the atlas.
+    int             max_tex_size;
+    volume_tile_t   *tiles;     // Hash table of block data id -> tile.
+    volume_tile_t   **slots;    // The tile at each slot of the atlas.
+    int             *free_slots;
+    int             nb_free;
+    int             frame;
+    int             generation; // Increased each time we evict tiles.
+    GLuint          box_buffer;
+    volume_table_t  tables[8];  // Small cache of blocks tables.
+    int             tables_next;
+} g_volume = {};
+
+static void volume_init(void)
+{
+    int i, f, v;
+    float vertices[6 * 6][3];
+    const int QUAD[6] = {0, 1, 2, 2, 3, 0};
+
+    GL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &g_volume.max_tex_size));
+    g_volume.size = min(g_volume.max_tex_size, 4096) / VOLUME_TILE_SIZE;
+    g_volume.slots = calloc(g_volume.size * g_volume.size,
+                            sizeof(*g_volume.slots));
+    g_volume.free_slots = calloc(g_volume.size * g_volume.size,
+                                 sizeof(*g_volume.free_slots));
+    for (i = 0; i < g_volume.size * g_volume.size; i++)
+        g_volume.free_slots[i] = g_volume.size * g_volume.size - 1 - i;
+    g_volume.nb_free = g_volume.size * g_volume.size;
+
+    GL(glGenTextures(1, &g_volume.atlas));
+    GL(glActiveTexture(GL_TEXTURE0));
+    GL(glBindTexture(GL_TEXTURE_2D, g_volume.atlas));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
+                    g_volume.size * VOLUME_TILE_SIZE,
+                    g_volume.size * VOLUME_TILE_SIZE,
+                    0, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+
+    // Unit cube, with the same faces orientation as the blocks.
+    for (f = 0; f < 6; f++) for (i = 0; i < 6; i++) {
+        v = FACES_VERTICES[f][QUAD[i]];
+        vec3_set(vertices[f * 6 + i], VERTICES_POSITIONS[v][0],
+                 VERTICES_POSITIONS[v][1], VERTICES_POSITIONS[v][2]);
+    }
+    GL(glGenBuffers(1, &g_volume.box_buffer));
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_volume.box_buffer));
+    GL(glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices,
+                    GL_STATIC_DRAW));
+}
+
+// Remove all the tiles not used in the current frame.
+static void volume_evict_tiles(void)
+{
+    volume_tile_t *tile, *tmp;
+    HASH_ITER(hh, g_volume.tiles, tile, tmp) {
+        if (tile->last_used == g_volume.frame) continue;
+        HASH_DEL(g_volume.tiles, tile);
+        g_volume.slots[tile->slot] = NULL;
+        g_volume.free_slots[g_volume.nb_free++] = tile->slot;
+        free(tile);
+    }
+    g_volume.generation++;
+}
+
+// Return the number of slots we can get after evicting the unused tiles.
+static int volume_nb_available(void)
+{
+    int ret = g_volume.nb_free;
+    volume_tile_t *tile;
+    for (tile = g_volume.tiles; tile; tile = tile->hh.next) {
+        if (tile->last_used != g_volume.frame) ret++;
+    }
+    return ret;
+}
+
+// Upload a new tile.  Return NULL if the atlas is full.
+static volume_tile_t *volume_add_tile(uint64_t id, const void *data)
+{
+    volume_tile_t *tile;
+    int slot;
+
+    if (!g_volume.nb_free) volume_evict_tiles();
+    if (!g_volume.nb_free) return NULL;
+    slot = g_volume.free_slots[--g_volume.nb_free];
+    tile = calloc(1, sizeof(*tile));
+    tile->id = id;
+    tile->slot = slot;
+    tile->last_used = g_volume.frame;
+    g_volume.slots[slot] = tile;
+    HASH_ADD(hh, g_volume.tiles, id, sizeof(tile->id), tile);
+
+    GL(glBindTexture(GL_TEXTURE_2D, g_volume.atlas));
+    GL(glTexSubImage2D(GL_TEXTURE_2D, 0,
+                       (slot % g_volume.size) * VOLUME_TILE_SIZE,
+                       (slot / g_volume.size) * VOLUME_TILE_SIZE,
+                       VOLUME_TILE_SIZE, VOLUME_TILE_SIZE,
+                       GL_RGBA, GL_UNSIGNED_BYTE, data));
+    return tile;
+}
+
+static void volume_clear(void)
+{
+    int i;
+    volume_tile_t *tile, *tmp;
+    HASH_ITER(hh, g_volume.tiles, tile, tmp) {
+        HASH_DEL(g_volume.tiles, tile);
+        g_volume.slots[tile->slot] = NULL;
+        free(tile);
+    }
+    for (i = 0; i < g_volume.size * g_volume.size; i++)
+        g_volume.free_slots[i] = g_volume.size * g_volume.size - 1 - i;
+    g_volume.nb_free = g_volume.size * g_volume.size;
+    g_volume.generation++;
+}
+
+/*
+ * Make sure all the blocks of a mesh are in the atlas, and return the
+ * blocks table texture.  Return NULL if the mesh cannot be rendered with
+ * ray marching, so that we fallback to the normal rendering.
+ */
+static const volume_table_t *volume_prepare_mesh(const mesh_t *mesh)
+{
+    int bpos[3], aabb[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                               {INT_MIN, INT_MIN, INT_MIN}};
+    int i, nb_blocks = 0, nb_missing = 0, w, h, x, y, z;
+    uint64_t id;
+    uint8_t *data;
+    mesh_iterator_t iter;
+    volume_tile_t *tile;
+    volume_table_t *table;
+    uint8_t (*texels)[4];
+
+    if (!g_volume.atlas) volume_init();
+
+    // First pass: mark the tiles already in the atlas as used, so that we
+    // won't evict them while uploading the new ones.
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        id = mesh_get_block_id(mesh, &iter, bpos);
+        if (id == 0) continue;
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = min(aabb[0][i], bpos[i]);
+            aabb[1][i] = max(aabb[1][i], bpos[i] + BLOCK_SIZE);
+        }
+        nb_blocks++;
+        HASH_FIND(hh, g_volume.tiles, &id, sizeof(id), tile);
+        if (tile) tile->last_used = g_volume.frame;
+        else nb_missing++;
+    }
+    if (!nb_blocks) return NULL;
+    if (nb_blocks > g_volume.size * g_volume.size) return NULL;
+
+    // The atlas is shared by all the meshes rendered in the frame, so we
+    // might not have enough room left for this one.
+    if (nb_missing > g_volume.nb_free && nb_missing > volume_nb_available())
+        return NULL;
+
+    // Second pass: upload the missing tiles.
+    if (nb_missing) {
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            id = mesh_get_block_id(mesh, &iter, bpos);
+            if (id == 0) continue;
+            HASH_FIND(hh, g_volume.tiles, &id, sizeof(id), tile);
+            if (tile) continue;
+            data = mesh_get_block_data(mesh, &iter, bpos, NULL);
+            if (!volume_add_tile(id, data)) return NULL;
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(g_volume.tables); i++) {
+        table = &g_volume.tables[i];
+        if (    table->tex && table->mesh_key == mesh_get_key(mesh) &&
+                table->generation == g_volume.generation)
+            return table;
+    }
+
+    table = &g_volume.tables[g_volume.tables_next];
+    g_volume.tables_next = (g_volume.tables_next + 1) %
+                           ARRAY_SIZE(g_volume.tables);
+    for (i = 0; i < 3; i++) {
+        table->pos[i] = aabb[0][i];
+        table->size[i] = (aabb[1][i] - aabb[0][i]) / BLOCK_SIZE;
+    }
+    w = table->size[0] * table->size[2];
+    h = table->size[1];
+    if (    w > g_volume.max_tex_size || h > g_volume.max_tex_size ||
+            table->size[0] + table->size[1] + table->size[2] >
+                VOLUME_MAX_BLOCK_STEPS) {
+        table->mesh_key = 0;
+        return NULL;
+    }
+
+    texels = calloc(w * h, sizeof(*texels));
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        id = mesh_get_block_id(mesh, &iter, bpos);
+        if (id == 0) continue;
+        HASH_FIND(hh, g_volume.tiles, &id, sizeof(id), tile);
+        assert(tile);
+        x = (bpos[0] - table->pos[0]) / BLOCK_SIZE;
+        y = (bpos[1] - table->pos[1]) / BLOCK_SIZE;
+        z = (bpos[2] - table->pos[2]) / BLOCK_SIZE;
+        i = y * w + x + z * table->size[0];
+        texels[i][0] = tile->slot % g_volume.size;
+        texels[i][1] = tile->slot / g_volume.size;
+        texels[i][3] = 255;
+    }
+    if (!table->tex) GL(glGenTextures(1, &table->tex));
+    GL(glBindTexture(GL_TEXTURE_2D, table->tex));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+    GL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+    GL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0,
+                    GL_RGBA, GL_UNSIGNED_BYTE, texels));
+    free(texels);
+    table->mesh_key = mesh_get_key(mesh);
+    table->generation = g_volume.generation;
+    return table;
+}
+
+static void volume_shader_init(gl_shader_t *shader)
+{
+    shader_init(shader);
+    gl_update_uniform(shader, "u_atlas_tex", 0);
+    gl_update_uniform(shader, "u_table_tex", 1);
+}
+
+/*
+ * Render a mesh with ray marching.  Return false if this is not possible,
+ * in which case we should fallback to the normal rendering.
+ */
+static bool render_volume_(renderer_t *rend, const mesh_t *mesh,
+                           const material_t *material, int effects)
+{
+    gl_shader_t *shader;
+    const volume_table_t *table;
+    float camera[4][4], light_dir[3], ortho_dir[3] = {0, 0, 0};
+
+    if (material->base_color[3] < 1) return false;
+    if (effects & (EFFECT_SEMI_TRANSPARENT | EFFECT_SEE_BACK)) return false;
+    table = volume_prepare_mesh(mesh);
+    if (!table) return false;
+
+    shader = shader_get("volume", NULL, volume_shader_init);
+    get_light_dir(rend, light_dir);
+    mat4_invert(rend->view_mat, camera);
+    if (rend->proj_mat[3][3] == 1) // Orthographic projection.
+        vec3_neg(camera[2], ortho_dir);
+
+    GL(glEnable(GL_DEPTH_TEST));
+    GL(glDepthFunc(GL_LESS));
+    // Render the back faces, so that it still works when we are inside
+    // the box.
+    GL(glEnable(GL_CULL_FACE));
+    GL(glCullFace(GL_FRONT));
+    GL(glDisable(GL_BLEND));
+    GL(glActiveTexture(GL_TEXTURE0));
+    GL(glBindTexture(GL_TEXTURE_2D, g_volume.atlas));
+    GL(glActiveTexture(GL_TEXTURE1));
+    GL(glBindTexture(GL_TEXTURE_2D, table->tex));
+
+    GL(glUseProgram(shader->prog));
+    gl_update_uniform(shader, "u_proj", rend->proj_mat);
+    gl_update_uniform(shader, "u_view", rend->view_mat);
+    gl_update_uniform(shader, "u_camera", camera[3]);
+    gl_update_uniform(shader, "u_ortho_dir", ortho_dir);
+    gl_update_uniform(shader, "u_box_pos",
+            VEC(table->pos[0], table->pos[1], table->pos[2]));
+    gl_update_uniform(shader, "u_table_size",
+            VEC(table->size[0], table->size[1], table->size[2]));
+    gl_update_uniform(shader, "u_atlas_size",
+                      (float)(g_volume.size * VOLUME_TILE_SIZE));
+    gl_update_uniform(shader, "u_l_dir", light_dir);
+    gl_update_uniform(shader, "u_l_int", rend->light.intensity);
+    gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
+    gl_update_uniform(shader, "u_m_metallic", material->metallic);
+    gl_update_uniform(shader, "u_m_roughness", material->roughness);
+    gl_update_uniform(shader, "u_m_base_color", material->base_color);
+    gl_update_uniform(shader, "u_m_emissive_factor", material->emission);
+
+    GL(glBindBuffer(GL_ARRAY_BUFFER, g_volume.box_buffer));
+    GL(glEnableVertexAttribArray(0));
+    GL(glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0));
+    GL(glDrawArrays(GL_TRIANGLES, 0, 36));
+    GL(glDisableVertexAttribArray(0));
+    GL(glCullFace(GL_BACK));
+    return true;
+}
+
 static void render_mesh_(renderer_t *rend, mesh_t *mesh,
                          const material_t *material, int effects,
                          const float shadow_mvp[4][4])
@@ -563,6 +904,13 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh,
     if (effects & EFFECT_MARCHING_CUBES)
         effects &= ~EFFECT_BORDERS;
 
+    if (    (effects & EFFECT_VOLUME) &&
+            !(effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP |
+                         EFFECT_MARCHING_CUBES | EFFECT_GRID | EFFECT_EDGES |
+                         EFFECT_WIREFRAME | EFFECT_UNLIT)) &&
+            render_volume_(rend, mesh, material, effects))
+        return;
+
     if (effects & EFFECT_RENDER_POS)
         shader = shader_get("pos_data", NULL, shader_init);
     else if (effects & EFFECT_SHADOW_MAP)
@@ -690,7 +1038,7 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
     const material_t default_material = MATERIAL_DEFAULT;
 
     material = material ?: &default_material;
-    item = calloc(1, sizeof(*item));
+    item = item_new();
     item->type = ITEM_MESH;
     item->mesh = mesh_copy(mesh);
     item->material = *material;
@@ -703,7 +1051,7 @@ void render_mesh(renderer_t *rend, const mesh_t *mesh,
     DL_APPEND(rend->items, item);
 
     if (effects & (EFFECT_GRID | EFFECT_EDGES)) {
-        item = calloc(1, sizeof(*item));
+        item = item_new();
         item->type = ITEM_MESH;
         item->mesh = mesh_copy(mesh);
         item->effects = effects | EFFECT_BORDERS;
@@ -757,7 +1105,7 @@ static void render_grid_item(renderer_t *rend, const render_item_t *item)
 void render_grid(renderer_t *rend, const float plane[4][4],
                  const uint8_t color[4], const float clip_box[4][4])
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = item_new();
     item->type = ITEM_GRID;
     mat4_copy(plane, item->mat);
     mat4_iscale(item->mat, 8, 8, 1);
@@ -770,7 +1118,7 @@ void render_grid(renderer_t *rend, const float plane[4][4],
 void render_img(renderer_t *rend, texture_t *tex, const float mat[4][4],
                 int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = item_new();
     item->type = ITEM_MODEL3D;
     mat ? mat4_copy(mat, item->mat) : mat4_set_identity(item->mat);
     item->proj_screen = !mat || (effects & EFFECT_PROJ_SCREEN);
@@ -787,7 +1135,7 @@ void render_img2(renderer_t *rend,
 {
     // Experimental for the moment!
     // Same as render_img, but we flip the texture!
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = item_new();
     item->type = ITEM_MODEL3D;
     mat ? mat4_copy(mat, item->mat) : mat4_set_identity(item->mat);
     mat4_iscale(item->mat, 1, -1, 1);
@@ -803,7 +1151,7 @@ void render_img2(renderer_t *rend,
 
 void render_rect(renderer_t *rend, const float plane[4][4], int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = item_new();
     assert((effects & EFFECT_STRIP) == effects);
     item->type = ITEM_MODEL3D;
     mat4_copy(plane, item->mat);
@@ -826,7 +1174,7 @@ static void line_create_plane(const float a[3], const float b[3],
 void render_line(renderer_t *rend, const float a[3], const float b[3],
                  const uint8_t color[4], int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = item_new();
     item->type = ITEM_MODEL3D;
     item->model3d = g_line_model;
     line_create_plane(a, b, item->mat);
@@ -839,7 +1187,7 @@ void render_line(renderer_t *rend, const float a[3], const float b[3],
 void render_box(renderer_t *rend, const float box[4][4],
                 const uint8_t color[4], int effects)
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = item_new();
     assert((effects & (EFFECT_STRIP | EFFECT_WIREFRAME | EFFECT_SEE_BACK |
                        EFFECT_GRID)) == effects);
     item->type = ITEM_MODEL3D;
@@ -853,29 +1201,48 @@ void render_box(renderer_t *rend, const float box[4][4],
 
 void render_sphere(renderer_t *rend, const float mat[4][4])
 {
-    render_item_t *item = calloc(1, sizeof(*item));
+    render_item_t *item = item_new();
     item->type = ITEM_MODEL3D;
     mat4_copy(mat, item->mat);
     item->model3d = g_sphere_model;
     DL_APPEND(rend->items, item);
 }
 
-static float item_sort_value(const render_item_t *a)
+// Render order of the items, from first to last.
+enum {
+    ITEM_PRIORITY_DEFAULT = 0,
+    ITEM_PRIORITY_MESH = 0,
+    ITEM_PRIORITY_MESH_TRANSPARENT,
+    ITEM_PRIORITY_MODEL3D,
+    ITEM_PRIORITY_GRID,
+    ITEM_PRIORITY_PROJ_SCREEN,
+    ITEM_PRIORITY_WIREFRAME,
+};
+
+static uint32_t item_sort_priority(const render_item_t *a)
 {
-    if (a->effects & EFFECT_WIREFRAME) return 20;
-    if (a->proj_screen)     return 10;
+    if (a->effects & EFFECT_WIREFRAME) return ITEM_PRIORITY_WIREFRAME;
+    if (a->proj_screen)     return ITEM_PRIORITY_PROJ_SCREEN;
     switch (a->type) {
         // XXX: probably need to sort mesh objects by distance too.
-        case ITEM_MESH:     return a->material.base_color[3] == 1 ? 0 : 0.5;
-        case ITEM_MODEL3D:  return 1;
-        case ITEM_GRID:     return 2;
-        default:            return 0;
+        case ITEM_MESH:
+            return a->material.base_color[3] == 1 ?
+                   ITEM_PRIORITY_MESH : ITEM_PRIORITY_MESH_TRANSPARENT;
+        case ITEM_MODEL3D:  return ITEM_PRIORITY_MODEL3D;
+        case ITEM_GRID:     return ITEM_PRIORITY_GRID;
+        default:            return ITEM_PRIORITY_DEFAULT;
     }
 }
 
-static int item_sort_cmp(const render_item_t *a, const render_item_t *b)
+typedef struct {
+    uint64_t        key;    // Priority in the high bits, then index.
+    render_item_t   *item;
+} item_sort_entry_t;
+
+static int item_sort_cmp(const void *a, const void *b)
 {
-    return cmp(item_sort_value(a), item_sort_value(b));
+    return cmp(((const item_sort_entry_t*)a)->key,
+               ((const item_sort_entry_t*)b)->key);
 }
 
 
@@ -983,12 +1350,15 @@ static void render_background(renderer_t *rend, const uint8_t col[4])
 void render_submit(renderer_t *rend, const float viewport[4],
                    const uint8_t clear_color[4])
 {
-    render_item_t *item, *tmp;
+    render_item_t *item;
+    item_sort_entry_t *entries;
+    int i, nb;
     float shadow_mvp[4][4];
     const float s = rend->scale;
     bool shadow = rend->settings.shadow &&
         !(rend->settings.effects & (EFFECT_RENDER_POS | EFFECT_SHADOW_MAP));
 
+    g_volume.frame++;
     if (shadow) {
         GL(glDisable(GL_SCISSOR_TEST));
         render_shadow_map(rend, shadow_mvp);
@@ -1003,31 +1373,53 @@ void render_submit(renderer_t *rend, const float viewport[4],
     GL(glLineWidth(rend->scale));
     render_background(rend, clear_color);
 
-    DL_SORT(rend->items, item_sort_cmp);
-    DL_FOREACH_SAFE(rend->items, item, tmp) {
+    // Sort the items using an array of keys.  The index of the item is part
+    // of the key so that the order of equal items is kept.
+    DL_COUNT(rend->items, item, nb);
+    entries = nb ? arena_alloc(g_items_arena, nb * sizeof(*entries)) : NULL;
+    i = 0;
+    DL_FOREACH(rend->items, item) {
+        entries[i].key = ((uint64_t)item_sort_priority(item) << 32) | i;
+        entries[i].item = item;
+        i++;
+    }
+    qsort(entries, nb, sizeof(*entries), item_sort_cmp);
+    rend->items = NULL;
+
+    for (i = 0; i < nb; i++) {
+        item = entries[i].item;
         switch (item->type) {
         case ITEM_MESH:
             render_mesh_(rend, item->mesh, &item->material, item->effects,
                          shadow_mvp);
-            DL_DELETE(rend->items, item);
             mesh_delete(item->mesh);
             break;
         case ITEM_MODEL3D:
             render_model_item(rend, item, viewport);
-            DL_DELETE(rend->items, item);
             break;
         case ITEM_GRID:
             render_grid_item(rend, item);
-            DL_DELETE(rend->items, item);
             break;
         }
         texture_delete(item->tex);
-        free(item);
     }
-    assert(rend->items == NULL);
+
+    g_nb_submitted_items = nb;
+    g_nb_pending_items -= nb;
+    assert(g_nb_pending_items >= 0);
+    if (g_nb_pending_items == 0 && g_items_arena)
+        arena_reset(g_items_arena);
 }
 
 void render_on_low_memory(renderer_t *rend)
 {
     cache_clear(g_items_cache);
+    if (g_volume.atlas) volume_clear();
+}
+
+void render_get_stats(render_stats_t *stats)
+{
+    stats->nb_items = g_nb_submitted_items;
+    stats->items_mem_max = g_items_arena ?
+        arena_get_high_water_mark(g_items_arena) : 0;
 }
@@ -41,6 +41,7 @@ enum {
     EFFECT_PROJ_SCREEN      = 1 << 15, // Image project in screen.
     EFFECT_ANTIALIASING     = 1 << 16,
     EFFECT_UNLIT            = 1 << 17,
+    EFFECT_VOLUME           = 1 << 18, // Ray marching of the voxels.
 };
 
 typedef struct {
@@ -115,4 +116,11 @@ void render_get_block_pos(renderer_t *rend, const mesh_t *mesh,
 // Attempt to release some memory.
 void render_on_low_memory(renderer_t *rend);
 
+typedef struct {
+    int     nb_items;           // Number of items in the last submit.
+    size_t  items_mem_max;      // High water mark of the items arena.
+} render_stats_t;
+
+void render_get_stats(render_stats_t *stats);
+
 #endif // RENDER_H
@@ -0,0 +1,330 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define N BLOCK_SIZE
+
+// Maximum number of blocks for which we use a dense blocks grid, above
+// that we directly look into the mesh hash table.
+#define MAX_GRID_SIZE (1 << 22)
+#define MAX_THREADS 16
+
+// Sub pixel samples offsets.
+static const float SAMPLES[4][2] = {
+    {0.375, 0.125}, {0.875, 0.375}, {0.125, 0.625}, {0.625, 0.875},
+};
+
+typedef struct {
+    const renderer_t *rend;
+    const mesh_t    *mesh;
+    int             w, h, bpp;
+    const uint8_t   *background;
+    uint8_t         *out;
+    float           inv_mat[4][4];  // Inverse of proj * view.
+    float           light_dir[3];
+    int             pos[3];         // Position of the first block.
+    int             size[3];        // Size of the blocks grid.
+    const uint8_t   **grid;         // Dense blocks data grid (or NULL).
+    int             nb_threads;
+} ctx_t;
+
+typedef struct {
+    ctx_t           *ctx;
+    int             index;
+} job_t;
+
+static const uint8_t *get_block(const ctx_t *ctx, const int v[3])
+{
+    int i, b[3];
+    for (i = 0; i < 3; i++) {
+        b[i] = (v[i] & ~(N - 1));
+        if (b[i] < ctx->pos[i] || b[i] >= ctx->pos[i] + ctx->size[i] * N)
+            return NULL;
+    }
+    if (!ctx->grid) return mesh_get_block_data(ctx->mesh, NULL, b, NULL);
+    for (i = 0; i < 3; i++) b[i] = (b[i] - ctx->pos[i]) / N;
+    return ctx->grid[b[0] + b[1] * ctx->size[0] +
+                     b[2] * ctx->size[0] * ctx->size[1]];
+}
+
+static const uint8_t *get_voxel(const ctx_t *ctx, const uint8_t *block,
+                                const int v[3])
+{
+    static const uint8_t EMPTY[4] = {0};
+    if (!block) return EMPTY;
+    return block + ((v[0] & (N - 1)) +
+                    (v[1] & (N - 1)) * N +
+                    (v[2] & (N - 1)) * N * N) * 4;
+}
+
+static bool is_solid(const ctx_t *ctx, const int v[3])
+{
+    return get_voxel(ctx, get_block(ctx, v), v)[3] >= 127;
+}
+
+/*
+ * Cast a ray into the blocks grid.  Empty blocks are skipped, and we only
+ * walk the voxels of the non empty ones.
+ */
+static bool cast_ray(const ctx_t *ctx, const float ro[3], const float rd_[3],
+                     float *t_out, int v[3], int n[3], uint8_t color[4])
+{
+    int i, j = 0, a, step[3], bmin[3];
+    float rd[3], inv[3], ta, tb, t0 = -FLT_MAX, t1 = FLT_MAX, t, t_exit;
+    float p[3], t_next[3];
+    const uint8_t *block, *voxel;
+    int entry_axis = 0;
+
+    for (i = 0; i < 3; i++) {
+        rd[i] = rd_[i] ?: 1e-9;
+        inv[i] = 1.0 / rd[i];
+        step[i] = rd[i] > 0 ? 1 : -1;
+        ta = (ctx->pos[i] - ro[i]) * inv[i];
+        tb = (ctx->pos[i] + ctx->size[i] * N - ro[i]) * inv[i];
+        if (min(ta, tb) > t0) {
+            t0 = min(ta, tb);
+            entry_axis = i;
+        }
+        t1 = min(t1, max(ta, tb));
+    }
+    if (t1 <= max(t0, 0)) return false;
+    t = max(t0, 0);
+    memset(n, 0, 3 * sizeof(int));
+    n[entry_axis] = -step[entry_axis];
+
+    while (t < t1) {
+        for (i = 0; i < 3; i++) {
+            p[i] = ro[i] + rd[i] * (t + 1e-4);
+            v[i] = clamp((int)floor(p[i]), ctx->pos[i],
+                         ctx->pos[i] + ctx->size[i] * N - 1);
+            bmin[i] = v[i] & ~(N - 1);
+        }
+        block = get_block(ctx, v);
+        if (block) {
+            for (i = 0; i < 3; i++)
+                t_next[i] = (v[i] + (step[i] > 0) - ro[i]) * inv[i];
+            while (true) {
+                voxel = get_voxel(ctx, block, v);
+                if (voxel[3] >= 127) {
+                    memcpy(color, voxel, 4);
+                    *t_out = t;
+                    return true;
+                }
+                a = (t_next[0] < t_next[1]) ?
+                        (t_next[0] < t_next[2] ? 0 : 2) :
+                        (t_next[1] < t_next[2] ? 1 : 2);
+                v[a] += step[a];
+                t = t_next[a];
+                t_next[a] += fabs(inv[a]);
+                memset(n, 0, 3 * sizeof(int));
+                n[a] = -step[a];
+                if (v[a] < bmin[a] || v[a] >= bmin[a] + N) break;
+            }
+            continue;
+        }
+        // Empty block: jump to the next one.
+        t_exit = FLT_MAX;
+        for (i = 0; i < 3; i++) {
+            ta = (bmin[i] + (step[i] > 0 ? N : 0) - ro[i]) * inv[i];
+            if (ta < t_exit) {
+                t_exit = ta;
+                j = i;
+            }
+        }
+        memset(n, 0, 3 * sizeof(int));
+        n[j] = -step[j];
+        t = max(t_exit, t + 1e-4);
+    }
+    return false;
+}
+
+/*
+ * Ambient occlusion of a voxel face, computed from the voxels touching the
+ * face, weighted by their distance to the hit point.
+ */
+static float compute_ao(const ctx_t *ctx, const int v[3], const int n[3],
+                        const float p[3])
+{
+    int i, du, dv, a, u_axis, v_axis, c[3];
+    float fu, fv, du_dist, dv_dist, d, occ = 0;
+
+    a = n[0] ? 0 : n[1] ? 1 : 2;
+    u_axis = (a + 1) % 3;
+    v_axis = (a + 2) % 3;
+    fu = clamp(p[u_axis] - v[u_axis], 0, 1);
+    fv = clamp(p[v_axis] - v[v_axis], 0, 1);
+
+    for (dv = -1; dv <= 1; dv++) for (du = -1; du <= 1; du++) {
+        if (du == 0 && dv == 0) continue;
+        for (i = 0; i < 3; i++) c[i] = v[i] + n[i];
+        c[u_axis] += du;
+        c[v_axis] += dv;
+        if (!is_solid(ctx, c)) continue;
+        du_dist = du == 0 ? 0 : du < 0 ? fu : 1 - fu;
+        dv_dist = dv == 0 ? 0 : dv < 0 ? fv : 1 - fv;
+        d = sqrtf(du_dist * du_dist + dv_dist * dv_dist);
+        occ += max(0, 1 - d);
+    }
+    return max(0.4, 1.0 - 0.3 * occ);
+}
+
+static void render_pixel(const ctx_t *ctx, int x, int y, uint8_t *out)
+{
+    int i, s, v[3], n[3];
+    float ndc[4], near[4], far[4], rd[3], p[3], t, ao, diffuse, light;
+    float c, acc[4] = {0};
+    uint8_t color[4];
+    const renderer_t *rend = ctx->rend;
+
+    for (s = 0; s < ARRAY_SIZE(SAMPLES); s++) {
+        ndc[0] = (x + SAMPLES[s][0]) / ctx->w * 2 - 1;
+        ndc[1] = 1 - (y + SAMPLES[s][1]) / ctx->h * 2;
+        ndc[3] = 1;
+        ndc[2] = -1;
+        mat4_mul_vec4(ctx->inv_mat, ndc, near);
+        ndc[2] = 1;
+        mat4_mul_vec4(ctx->inv_mat, ndc, far);
+        vec3_mul(near, 1.0 / near[3], near);
+        vec3_mul(far, 1.0 / far[3], far);
+        vec3_sub(far, near, rd);
+        vec3_normalize(rd, rd);
+
+        if (!cast_ray(ctx, near, rd, &t, v, n, color)) continue;
+        vec3_addk(near, rd, t, p);
+        ao = compute_ao(ctx, v, n, p);
+        diffuse = max(0, n[0] * ctx->light_dir[0] +
+                         n[1] * ctx->light_dir[1] +
+                         n[2] * ctx->light_dir[2]);
+        light = (rend->settings.ambient + rend->light.intensity * diffuse) *
+                ao;
+        // Shading done in linear space.
+        for (i = 0; i < 3; i++) {
+            c = color[i] / 255.0;
+            acc[i] += clamp(sqrtf(c * c * light), 0, 1);
+        }
+        acc[3] += 1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        c = acc[3] ? acc[i] / acc[3] : 0;
+        if (ctx->background)
+            c = mix(ctx->background[i] / 255.0, c,
+                    acc[3] / ARRAY_SIZE(SAMPLES));
+        out[i] = c * 255;
+    }
+    if (ctx->bpp == 4)
+        out[3] = ctx->background ? 255 : acc[3] * 255 / ARRAY_SIZE(SAMPLES);
+}
+
+static void *render_thread(void *arg)
+{
+    const job_t *job = arg;
+    const ctx_t *ctx = job->ctx;
+    int x, y;
+    for (y = job->index; y < ctx->h; y += ctx->nb_threads) {
+        for (x = 0; x < ctx->w; x++) {
+            render_pixel(ctx, x, y,
+                         ctx->out + (y * ctx->w + x) * ctx->bpp);
+        }
+    }
+    return NULL;
+}
+
+static int get_nb_threads(void)
+{
+    int ret = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    ret = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return clamp(ret, 1, MAX_THREADS);
+}
+
+void soft_render(const renderer_t *rend, const mesh_t *mesh,
+                 int w, int h, int bpp, const uint8_t background[4],
+                 uint8_t *out)
+{
+    ctx_t ctx = {
+        .rend = rend,
+        .mesh = mesh,
+        .w = w,
+        .h = h,
+        .bpp = bpp,
+        .background = background,
+        .out = out,
+    };
+    int i, bpos[3], aabb[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
+                                  {INT_MIN, INT_MIN, INT_MIN}};
+    float mat[4][4];
+    mesh_iterator_t iter;
+    pthread_t threads[MAX_THREADS];
+    job_t jobs[MAX_THREADS];
+    bool started[MAX_THREADS] = {};
+    const uint8_t **grid;
+
+    assert(bpp == 3 || bpp == 4);
+    mat4_mul(rend->proj_mat, rend->view_mat, mat);
+    mat4_invert(mat, ctx.inv_mat);
+    render_get_light_dir(rend, ctx.light_dir);
+
+    // Compute the blocks bbox.
+    iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+    while (mesh_iter(&iter, bpos)) {
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = min(aabb[0][i], bpos[i]);
+            aabb[1][i] = max(aabb[1][i], bpos[i] + N);
+        }
+    }
+    if (aabb[0][0] == INT_MAX) memset(aabb, 0, sizeof(aabb));
+    for (i = 0; i < 3; i++) {
+        ctx.pos[i] = aabb[0][i];
+        ctx.size[i] = (aabb[1][i] - aabb[0][i]) / N;
+    }
+
+    // Put all the blocks data into a dense grid for fast access.
+    if ((int64_t)ctx.size[0] * ctx.size[1] * ctx.size[2] <= MAX_GRID_SIZE) {
+        grid = calloc(max(1, ctx.size[0] * ctx.size[1] * ctx.size[2]),
+                      sizeof(*grid));
+        iter = mesh_get_iterator(mesh, MESH_ITER_BLOCKS);
+        while (mesh_iter(&iter, bpos)) {
+            grid[(bpos[0] - ctx.pos[0]) / N +
+                 (bpos[1] - ctx.pos[1]) / N * ctx.size[0] +
+                 (bpos[2] - ctx.pos[2]) / N * ctx.size[0] * ctx.size[1]] =
+                mesh_get_block_data(mesh, NULL, bpos, NULL);
+        }
+        ctx.grid = grid;
+    }
+
+    ctx.nb_threads = min(get_nb_threads(), h);
+    for (i = 0; i < ctx.nb_threads; i++) {
+        jobs[i] = (job_t){&ctx, i};
+        if (i == 0) continue; // Done by the calling thread.
+        started[i] = pthread_create(&threads[i], NULL, render_thread,
+                                    &jobs[i]) == 0;
+    }
+    render_thread(&jobs[0]);
+    for (i = 1; i < ctx.nb_threads; i++) {
+        // If we could not start the thread, do the job ourself.
+        if (started[i]) pthread_join(threads[i], NULL);
+        else render_thread(&jobs[i]);
+    }
+    free(ctx.grid);
+}
@@ -0,0 +1,56 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simple multi-threaded CPU renderer.
+ *
+ * This is used to create small images (like the preview of the gox files)
+ * without the need of an OpenGL context.  The mesh is ray casted through
+ * its blocks grid, with basic diffuse lighting and ambient occlusion.
+ */
+
+#ifndef SOFT_RENDER_H
+#define SOFT_RENDER_H
+
+#include "mesh.h"
+#include "render.h"
+
+/*
+ * Function: soft_render
+ * Render a mesh into an RGB[A] buffer using only the CPU.
+ *
+ * The function does not modify the mesh, so it is safe to call it from a
+ * background thread as long as nobody modifies the mesh at the same time.
+ * Since meshes copies are cheap, a background task can just render a
+ * copy of the mesh.
+ *
+ * Parameters:
+ *   rend       - Renderer used for the view and projection matrices and the
+ *                light settings.
+ *   mesh       - The mesh to render.
+ *   w          - Width of the output image.
+ *   h          - Height of the output image.
+ *   bpp        - Bytes per pixel of the output (3 or 4).
+ *   background - Background color, or NULL for a transparent background.
+ *   out        - Output buffer of size w * h * bpp.
+ */
+void soft_render(const renderer_t *rend, const mesh_t *mesh,
+                 int w, int h, int bpp, const uint8_t background[4],
+                 uint8_t *out);
+
+#endif // SOFT_RENDER_H
@@ -113,6 +113,46 @@ static void test_load_file_v1_with_preview(void)
     test_file(b64_data, 0x7e06d030);
 }
 
+static int count_layers(int index, const char *name, int nb_blocks,
+                        void *user)
+{
+    (*(int*)user)++;
+    return 0;
+}
+
+static void test_save_load(void)
+{
+    // Save and load back an image, with blocks using both the palette and
+    // the raw encodings.
+    int pos[3], nb_layers;
+    uint32_t crc;
+    mesh_t *mesh;
+    mesh_accessor_t acc;
+    if (DEFINED(WIN32)) return; // Don't test on Windows for the moment!
+    mesh = goxel.image->active_layer->mesh;
+    acc = mesh_get_accessor(mesh);
+    for (pos[2] = 0; pos[2] < 32; pos[2]++)
+    for (pos[1] = 0; pos[1] < 32; pos[1]++)
+    for (pos[0] = 0; pos[0] < 32; pos[0]++) {
+        if (pos[2] < 16)
+            mesh_set_at(mesh, &acc, pos, (uint8_t[]){
+                    pos[0] * 8, pos[1] * 8, pos[2] * 8, 255});
+        else
+            mesh_set_at(mesh, &acc, pos, (uint8_t[]){255, 0, 0, 255});
+    }
+    crc = mesh_crc32(mesh);
+    save_to_file(goxel.image, "/tmp/goxel_test.gox", false);
+    nb_layers = 0;
+    gox_iter_layers("/tmp/goxel_test.gox", count_layers, &nb_layers);
+    TEST(nb_layers == 1);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+    load_from_file("/tmp/goxel_test.gox");
+    TEST(mesh_crc32(goxel.image->active_layer->mesh) == crc);
+    image_delete(goxel.image);
+    goxel.image = image_new();
+}
+
 static void test_load_corrupt(void)
 {
     FILE *file;
@@ -122,9 +162,53 @@ static void test_load_corrupt(void)
     action_exec2("import", "p", "/tmp/goxel_test.gox");
 }
 
+static void test_mesh_sink(void)
+{
+    // Setting voxels through a sink, in any order, should give the same
+    // result as a blit.
+    const int w = 40, h = 20, d = 24;
+    int i, pos[3], nb_diff = 0;
+    uint8_t (*cube)[4], v1[4], v2[4];
+    mesh_t *m1, *m2;
+    mesh_sink_t *sink;
+
+    cube = calloc(w * h * d, sizeof(*cube));
+    for (i = 0; i < w * h * d; i++) {
+        if (i % 3) continue;
+        cube[i][0] = i % 256;
+        cube[i][3] = 255;
+    }
+    m1 = mesh_new();
+    m2 = mesh_new();
+    mesh_blit(m1, (uint8_t*)cube, -7, -7, -7, w, h, d, NULL);
+    sink = mesh_sink_new(m2, (int[2][3]){{-7, -7, -7},
+                                         {-7 + w, -7 + h, -7 + d}});
+    for (pos[0] = 0; pos[0] < w; pos[0]++)
+    for (pos[2] = d - 1; pos[2] >= 0; pos[2]--)
+    for (pos[1] = 0; pos[1] < h; pos[1]++) {
+        i = pos[0] + pos[1] * w + pos[2] * w * h;
+        mesh_sink_set(sink, (int[3]){pos[0] - 7, pos[1] - 7, pos[2] - 7},
+                      cube[i]);
+    }
+    mesh_sink_delete(sink);
+    for (pos[2] = -8; pos[2] < d; pos[2]++)
+    for (pos[1] = -8; pos[1] < h; pos[1]++)
+    for (pos[0] = -8; pos[0] < w; pos[0]++) {
+        mesh_get_at(m1, NULL, pos, v1);
+        mesh_get_at(m2, NULL, pos, v2);
+        if (memcmp(v1, v2, 4) != 0) nb_diff++;
+    }
+    TEST(nb_diff == 0);
+    mesh_delete(m1);
+    mesh_delete(m2);
+    free(cube);
+}
+
 void tests_run(void)
 {
     test_load_file_v2();
     test_load_file_v1_with_preview();
+    test_save_load();
     test_load_corrupt();
+    test_mesh_sink();
 }
@@ -41,11 +41,13 @@ static void do_move(layer_t *layer, const float mat[4][4])
     if (layer->base_id || layer->image || layer->shape) {
         mat4_mul(mat, layer->mat, layer->mat);
         layer->base_mesh_key = 0;
+        layer_touch(layer);
     } else {
         mesh_move(layer->mesh, m);
         if (!box_is_null(layer->box)) {
             mat4_mul(mat, layer->box, layer->box);
             box_get_bbox(layer->box, layer->box);
+            layer_touch(layer);
         }
     }
 }
@@ -0,0 +1,111 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGN 16
+
+typedef struct chunk chunk_t;
+struct chunk {
+    chunk_t *next;
+    size_t  size;
+    size_t  used;
+    uint8_t data[] __attribute__((aligned(ALIGN)));
+};
+
+struct arena {
+    chunk_t *chunks;        // Current chunk first.
+    size_t  used;           // Total used since last reset.
+    size_t  high_water_mark;
+};
+
+static chunk_t *chunk_new(size_t size)
+{
+    chunk_t *chunk = malloc(sizeof(*chunk) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+arena_t *arena_create(size_t size)
+{
+    arena_t *arena = calloc(1, sizeof(*arena));
+    arena->chunks = chunk_new(size);
+    return arena;
+}
+
+void arena_delete(arena_t *arena)
+{
+    chunk_t *chunk, *next;
+    if (!arena) return;
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    chunk_t *chunk = arena->chunks;
+    void *ret;
+
+    size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    if (chunk->used + size > chunk->size) {
+        chunk = chunk_new(size > chunk->size ? size * 2 : chunk->size * 2);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    ret = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    if (arena->used > arena->high_water_mark)
+        arena->high_water_mark = arena->used;
+    memset(ret, 0, size);
+    return ret;
+}
+
+void arena_reset(arena_t *arena)
+{
+    chunk_t *chunk, *next;
+    size_t size = 0;
+
+    // Merge all the chunks into a single one big enough for all the
+    // allocations we did.
+    if (arena->chunks->next) {
+        for (chunk = arena->chunks; chunk; chunk = next) {
+            next = chunk->next;
+            size += chunk->size;
+            free(chunk);
+        }
+        arena->chunks = chunk_new(size);
+    }
+    arena->chunks->used = 0;
+    arena->used = 0;
+}
+
+size_t arena_get_high_water_mark(const arena_t *arena)
+{
+    return arena->high_water_mark;
+}
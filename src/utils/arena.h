@@ -0,0 +1,67 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Simple bump allocator for short lived allocations.
+//
+// All the allocations are released at once with arena_reset.  If the arena
+// needed more than one memory chunk, they are merged into a single bigger
+// one on reset, so that after a few frames we only use one chunk.
+
+typedef struct arena arena_t;
+
+/*
+ * Function: arena_create
+ * Create a new arena.
+ *
+ * Parameters:
+ *   size - Initial size of the arena memory (in bytes).
+ */
+arena_t *arena_create(size_t size);
+
+/*
+ * Function: arena_delete
+ * Delete an arena and all its memory.
+ */
+void arena_delete(arena_t *arena);
+
+/*
+ * Function: arena_alloc
+ * Allocate zero initialized memory from an arena.
+ *
+ * The returned memory is valid until the next call to arena_reset.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * Function: arena_reset
+ * Release all the allocations of an arena.
+ */
+void arena_reset(arena_t *arena);
+
+/*
+ * Function: arena_get_high_water_mark
+ * Return the maximum memory used by the arena between two resets.
+ */
+size_t arena_get_high_water_mark(const arena_t *arena);
+
+#endif // ARENA_H